@@ -1,4 +1,4 @@
-def aprotoc(name, src):
+def aprotoc(name, src, borrow_fields = False):
     # Output header file name.
     header_name = src
     if header_name.endswith(".proto"):
@@ -9,6 +9,9 @@ def aprotoc(name, src):
         name = name,
         srcs = [src],
         outs = [header_name],
-        cmd = "./$(location @org_cloudabi_arpc//scripts:aprotoc) < $(location %s) > $@" % src,
+        cmd = "./$(location @org_cloudabi_arpc//scripts:aprotoc) %s < $(location %s) > $@" % (
+            "--borrow-fields" if borrow_fields else "",
+            src,
+        ),
         tools = ["@org_cloudabi_arpc//scripts:aprotoc"],
     )
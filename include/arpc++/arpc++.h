@@ -24,22 +24,41 @@
 #ifndef ARPCXX_ARPCXX_H
 #define ARPCXX_ARPCXX_H
 
+#include <sys/socket.h>
+#include <sys/uio.h>
+
 #include <unistd.h>
 
+#include <array>
 #include <cassert>
 #include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
 #include <exception>
 #include <forward_list>
+#include <functional>
+#include <initializer_list>
+#include <list>
 #include <map>
 #include <memory>
-#include <set>
+#include <mutex>
+#include <new>
 #include <string>
 #include <string_view>
+#include <thread>
 #include <type_traits>
 #include <utility>
+#include <vector>
 
 #include <argdata.hpp>
 
+namespace arpc_protocol {
+class ClientMessage;
+}
+
 enum arpc_connectivity_state {
   ARPC_CHANNEL_READY,
   ARPC_CHANNEL_SHUTDOWN,
@@ -47,7 +66,14 @@ enum arpc_connectivity_state {
 
 namespace arpc {
 
+class Arena;
+class ArgdataBuilder;
+class ArgdataReader;
+class ArgdataWriter;
 class ClientContext;
+class FileDescriptorRegistry;
+class IoUring;
+class Message;
 class ServerContext;
 class ServerReaderImpl;
 class ServerWriterImpl;
@@ -78,55 +104,543 @@ class FileDescriptor {
   const int fd_;
 };
 
+// Owning handle of a file descriptor, as stored in fields of type fd.
+// File descriptors received from a peer are reference counted through
+// a table indexed by file descriptor number, meaning that handing them
+// out and copying handles doesn't require any allocation. Handles may
+// also share a FileDescriptor object. This is the case for handles
+// constructed from one and handles on which Share() has been called.
+class FileDescriptorHandle {
+ public:
+  FileDescriptorHandle() : fd_(-1) {
+  }
+  explicit FileDescriptorHandle(int fd);
+  FileDescriptorHandle(std::shared_ptr<FileDescriptor> fd)
+      : fd_(fd ? fd->get() : -1), shared_(std::move(fd)) {
+  }
+  FileDescriptorHandle(const FileDescriptorHandle& handle);
+  FileDescriptorHandle(FileDescriptorHandle&& handle) noexcept
+      : fd_(handle.fd_), shared_(std::move(handle.shared_)) {
+    handle.fd_ = -1;
+  }
+
+  ~FileDescriptorHandle() {
+    reset();
+  }
+
+  FileDescriptorHandle& operator=(FileDescriptorHandle handle) noexcept {
+    std::swap(fd_, handle.fd_);
+    shared_.swap(handle.shared_);
+    return *this;
+  }
+
+  int get() const {
+    return fd_;
+  }
+  explicit operator bool() const {
+    return fd_ >= 0;
+  }
+  bool operator==(const FileDescriptorHandle& handle) const {
+    return fd_ == handle.fd_;
+  }
+  bool operator!=(const FileDescriptorHandle& handle) const {
+    return fd_ != handle.fd_;
+  }
+
+  // Returns the FileDescriptor object shared by the handle, if any.
+  const std::shared_ptr<FileDescriptor>& GetShared() const {
+    return shared_;
+  }
+  // Converts the handle to share a FileDescriptor object, returning it.
+  // The object holds a duplicate of the file descriptor if other
+  // handles still refer to it. A null pointer is returned if it could
+  // not be duplicated.
+  const std::shared_ptr<FileDescriptor>& Share();
+
+  void reset() {
+    if (fd_ >= 0 && !shared_)
+      Release(fd_);
+    fd_ = -1;
+    shared_.reset();
+  }
+
+ private:
+  // Drops a reference to a file descriptor, closing it if it was the
+  // last one.
+  static void Release(int fd);
+
+  int fd_;
+  std::shared_ptr<FileDescriptor> shared_;
+};
+
+// Bulk data attached to a message as the read end of a pipe, as done
+// for fields of type stream_bytes. The data does not pass through
+// Argdata, but is fed into the pipe by a thread owned by the stream
+// while the receiver consumes it. The receiver may splice() it into a
+// file or socket directly.
+//
+// On the sending side, the data is either written into a buffer
+// allocated through Create(), or spliced from a file descriptor until
+// end-of-file. Buffers are passed to the pipe with vmsplice(), meaning
+// the pipe references their pages instead of copying them. Each buffer
+// is a separate mapping that is only unmapped, never reused, after the
+// pipe has been fed. The data should not be modified after sending.
+// Destroying the stream stops feeding the pipe and joins the thread,
+// so the receiver observes end-of-file early if the stream is not kept
+// alive until the data has been consumed.
+class ByteStream {
+ public:
+  ~ByteStream();
+
+  // Creates a stream of a given size, whose data should be written to
+  // data() before sending it.
+  static int Create(std::size_t size, std::shared_ptr<ByteStream>* stream);
+
+  // Creates a stream whose data is spliced from a file descriptor.
+  static std::shared_ptr<ByteStream> FromFileDescriptor(
+      const std::shared_ptr<FileDescriptor>& source);
+
+  // Creates a stream that reads from a pipe received from a peer.
+  static std::shared_ptr<ByteStream> FromPipe(
+      const std::shared_ptr<FileDescriptor>& pipe);
+
+  void* data() {
+    return buffer_;
+  }
+  std::size_t size() const {
+    return size_;
+  }
+
+  // Returns the read end of the pipe from which the data of the stream
+  // can be read, starting to feed the pipe if needed.
+  int Open(std::shared_ptr<FileDescriptor>* pipe);
+
+  // Reads data from the stream, returning zero bytes at end-of-file.
+  int Read(void* buf, std::size_t len, std::size_t* received);
+
+  // Writes all of the remaining data of the stream to a file
+  // descriptor, using splice() if supported.
+  int SpliceTo(int fd, std::size_t* length);
+
+ private:
+  ByteStream();
+
+  std::shared_ptr<FileDescriptor> source_;
+  void* buffer_;
+  std::size_t size_;
+  std::shared_ptr<FileDescriptor> pipe_;
+
+  // Thread feeding the pipe. It is cancelled by closing the write end
+  // of a second pipe, on which it waits along with the pipe it feeds.
+  std::thread feeder_;
+  std::shared_ptr<FileDescriptor> cancel_;
+
+  ByteStream(ByteStream const&) = delete;
+  void operator=(ByteStream const&) = delete;
+};
+
+// Read-only data stored in a sealed memfd, as done for fields of type
+// shared_buffer. Sending it only requires passing the file descriptor,
+// meaning that all receivers share a single physical copy of the data.
+// The data is mapped into memory on first access.
+class SharedBuffer {
+ public:
+  SharedBuffer(std::shared_ptr<FileDescriptor> memfd, std::size_t size);
+  ~SharedBuffer();
+
+  // Creates a buffer containing a copy of the provided data.
+  static int Create(std::string_view data,
+                    std::shared_ptr<SharedBuffer>* buffer);
+
+  // Wraps a memfd received from a peer, which must be sealed.
+  static int FromFileDescriptor(const std::shared_ptr<FileDescriptor>& memfd,
+                                std::shared_ptr<SharedBuffer>* buffer);
+
+  const std::shared_ptr<FileDescriptor>& GetFileDescriptor() const {
+    return memfd_;
+  }
+
+  // Returns the contents of the buffer, or an empty view if they could
+  // not be mapped.
+  std::string_view data() const;
+  std::size_t size() const {
+    return size_;
+  }
+
+ private:
+  const std::shared_ptr<FileDescriptor> memfd_;
+  const std::size_t size_;
+
+  mutable std::once_flag map_once_;
+  mutable void* mapping_;
+
+  SharedBuffer(SharedBuffer const&) = delete;
+  void operator=(SharedBuffer const&) = delete;
+};
+
+// Serializer for message classes generated by aprotoc, writing them in
+// the Argdata serialization format without building an argdata_t
+// first. This is done in two passes. Message::ByteSize() computes the
+// length of the message, after which Message::SerializeTo() writes it
+// into a buffer of that length. Lengths of nested messages, sequences,
+// maps and google.protobuf.Any values are recorded while computing the
+// length, so that they can be used to prefix them while serializing
+// without computing them again. Reset() needs to be called between
+// messages.
+//
+// File descriptors are only counted while computing the length, so that
+// ByteSize() has no side effects. They are added to a side array while
+// serializing, as done by argdata_serialize(), using a hash table to
+// number them. Byte streams are also only opened while serializing.
+// Values of google.protobuf.Any fields are serialized by libargdata,
+// which is only supported if they don't contain any file descriptors.
+// ok() returns false if a message could not be serialized, in which
+// case it should be built using an ArgdataBuilder instead.
+class ArgdataSerializer {
+ public:
+  // Type tags used by the Argdata serialization format.
+  static constexpr std::uint8_t kTypeBinary = 1;
+  static constexpr std::uint8_t kTypeBool = 2;
+  static constexpr std::uint8_t kTypeFd = 3;
+  static constexpr std::uint8_t kTypeInt = 5;
+  static constexpr std::uint8_t kTypeMap = 6;
+  static constexpr std::uint8_t kTypeSeq = 7;
+  static constexpr std::uint8_t kTypeStr = 8;
+
+  // File descriptors are stored as a big-endian index into the side
+  // array.
+  static constexpr std::size_t kFdSize = 5;
+
+  // Elements of maps and sequences are prefixed by their length, stored
+  // as big-endian base-128 digits. The last digit has its top bit set.
+  static std::size_t GetSubfieldLengthSize(std::size_t length);
+  static std::uint8_t* PutSubfieldLength(std::uint8_t* out,
+                                         std::size_t length);
+
+  explicit ArgdataSerializer(bool field_numbers = false)
+      : field_numbers_(field_numbers),
+        ok_(true),
+        next_size_(0),
+        fd_count_(0) {
+  }
+
+  // Prepares the serializer for the next message, retaining the memory
+  // of the recorded lengths and the side array.
+  void Reset(bool field_numbers) {
+    field_numbers_ = field_numbers;
+    ok_ = true;
+    sizes_.clear();
+    next_size_ = 0;
+    fd_count_ = 0;
+    fds_.clear();
+  }
+
+  bool UsesFieldNumbers() const {
+    return field_numbers_;
+  }
+  bool ok() const {
+    return ok_;
+  }
+  // Number of file descriptors referenced by the message, as counted
+  // while computing its length. Descriptors referenced multiple times
+  // are counted repeatedly.
+  std::size_t GetFileDescriptorCount() const {
+    return fd_count_;
+  }
+  const std::vector<int>& GetFileDescriptors() const {
+    return fds_;
+  }
+
+  // Functions for computing the serialized length of values.
+  std::size_t GetArgdataSize(const argdata_t* value);
+  std::size_t GetBinarySize(std::string_view value) const {
+    return 1 + value.size();
+  }
+  std::size_t GetBoolSize(bool value) const {
+    return value ? 2 : 1;
+  }
+  std::size_t GetByteStreamSize(const std::shared_ptr<ByteStream>& value) {
+    ++fd_count_;
+    return kFdSize;
+  }
+  std::size_t GetFdSize(const FileDescriptorHandle& value) {
+    ++fd_count_;
+    return kFdSize;
+  }
+  std::size_t GetMessageSize(const Message& value);
+  std::size_t GetSharedBufferSize(const std::shared_ptr<SharedBuffer>& value) {
+    ++fd_count_;
+    return kFdSize;
+  }
+  std::size_t GetStrSize(std::string_view value) const {
+    return 2 + value.size();
+  }
+  static std::size_t GetSubfieldSize(std::size_t length) {
+    return GetSubfieldLengthSize(length) + length;
+  }
+
+  template <typename T>
+  std::size_t GetIntSize(T value) const {
+    if constexpr (std::is_signed_v<T>)
+      return GetSignedIntSize(value);
+    else
+      return GetUnsignedIntSize(value);
+  }
+
+  // Functions for recording lengths of nested values. Lengths are
+  // reserved before computing the length of the value, so that they
+  // are returned by GetRecordedSize() in the order in which the values
+  // are serialized.
+  std::size_t ReserveSize() {
+    sizes_.push_back(0);
+    return sizes_.size() - 1;
+  }
+  void SetSize(std::size_t slot, std::size_t size) {
+    sizes_[slot] = size;
+  }
+  std::size_t GetRecordedSize() {
+    return sizes_[next_size_++];
+  }
+
+  // Functions for writing values, returning the position following
+  // them. Values need to have their length computed first.
+  std::uint8_t* PutArgdata(std::uint8_t* out, const argdata_t* value,
+                           std::size_t length) const;
+  std::uint8_t* PutBinary(std::uint8_t* out, std::string_view value) const;
+  std::uint8_t* PutBool(std::uint8_t* out, bool value) const;
+  std::uint8_t* PutByteStream(std::uint8_t* out,
+                              const std::shared_ptr<ByteStream>& value);
+  std::uint8_t* PutBytes(std::uint8_t* out, std::string_view value) const;
+  std::uint8_t* PutFd(std::uint8_t* out, const FileDescriptorHandle& value);
+  std::uint8_t* PutSharedBuffer(std::uint8_t* out,
+                                const std::shared_ptr<SharedBuffer>& value);
+  std::uint8_t* PutStr(std::uint8_t* out, std::string_view value) const;
+
+  template <typename T>
+  std::uint8_t* PutInt(std::uint8_t* out, T value) const {
+    if constexpr (std::is_signed_v<T>)
+      return PutSignedInt(out, value);
+    else
+      return PutUnsignedInt(out, value);
+  }
+
+ private:
+  static std::size_t GetSignedIntSize(std::intmax_t value);
+  static std::size_t GetUnsignedIntSize(std::uintmax_t value);
+  static std::uint8_t* PutSignedInt(std::uint8_t* out, std::intmax_t value);
+  static std::uint8_t* PutUnsignedInt(std::uint8_t* out, std::uintmax_t value);
+  std::uint8_t* PutFdIndex(std::uint8_t* out, int fd);
+
+  bool field_numbers_;
+  bool ok_;
+
+  // Lengths recorded while computing the length of the message.
+  std::vector<std::size_t> sizes_;
+  std::size_t next_size_;
+
+  // Side array of file descriptors, along with an open addressing hash
+  // table mapping descriptor numbers to their index in the side array.
+  std::size_t fd_count_;
+  std::vector<int> fds_;
+  std::vector<std::uint32_t> fd_indices_;
+};
+
+// Allocates memory from an arena, the bump allocator used internally by
+// ArgdataBuilder and ArgdataParser. The memory is freed along with the
+// arena.
+void* AllocateFromArena(Arena* arena, std::size_t size, std::size_t alignment);
+
+// Allocator for placing standard containers in an arena. Memory
+// released by them is not reused.
+template <typename T>
+class ArenaAllocator {
+ public:
+  using value_type = T;
+
+  explicit ArenaAllocator(Arena* arena) : arena_(arena) {
+  }
+  template <typename U>
+  ArenaAllocator(const ArenaAllocator<U>& allocator)
+      : arena_(allocator.arena_) {
+  }
+
+  T* allocate(std::size_t n) {
+    return static_cast<T*>(
+        AllocateFromArena(arena_, n * sizeof(T), alignof(T)));
+  }
+  void deallocate(T* p, std::size_t n) {
+  }
+
+  bool operator==(const ArenaAllocator& allocator) const {
+    return arena_ == allocator.arena_;
+  }
+  bool operator!=(const ArenaAllocator& allocator) const {
+    return arena_ != allocator.arena_;
+  }
+
+ private:
+  template <typename U>
+  friend class ArenaAllocator;
+
+  Arena* arena_;
+};
+
+// Function that is called when receiving a bytes field, returning a
+// buffer of the given size in which the data of the field should be
+// stored. The field is then left empty in the message. If a null
+// pointer is returned, the data is stored in the message as usual.
+using BytesAllocator =
+    std::function<void*(std::string_view field, std::size_t size)>;
+
 // Helper class that tracks conversion state when converting an
-// argdata_t to a message class generated by aprotoc. This class keeps
-// track of file descriptor objects, so that multiple references to the
-// same file descriptor in the argdata_t can be converted to the same
-// file descriptor object. It may also store argdata_t iterators to make
-// google.protobuf.Any fields work.
+// argdata_t to a message class generated by aprotoc. This class holds a
+// handle of every file descriptor it hands out, so that multiple
+// references to the same file descriptor in the argdata_t are converted
+// to copies of the same handle. These are kept in a vector sorted by
+// file descriptor number, as file descriptors are received in ascending
+// order in practice, making insertions cheap. It may also store
+// argdata_t iterators to make google.protobuf.Any fields work. Both are
+// allocated from an arena.
 class ArgdataParser {
  public:
-  explicit ArgdataParser(argdata_reader_t* reader = nullptr);
+  explicit ArgdataParser(ArgdataReader* reader = nullptr,
+                         const BytesAllocator* bytes_allocator = nullptr);
   ~ArgdataParser();
 
   const argdata_t* ParseAnyFromMap(const argdata_map_iterator_t& it);
-  std::shared_ptr<FileDescriptor> ParseFileDescriptor(const argdata_t& ad);
+  std::shared_ptr<ByteStream> ParseByteStream(const argdata_t& ad);
+  FileDescriptorHandle ParseFileDescriptor(const argdata_t& ad);
+  std::shared_ptr<SharedBuffer> ParseSharedBuffer(const argdata_t& ad);
 
- private:
-  // Comparator for finding file descriptors in a set of shared pointers
-  // to FileDescriptor objects.
-  class FileDescriptorComparator {
-   public:
-    using is_transparent = std::true_type;
+  // Copies the data of a bytes field into a buffer provided by the
+  // BytesAllocator, if any. Returns false if the data should be stored
+  // in the message instead.
+  bool ParseBytes(std::string_view field, const void* data, std::size_t size);
 
-    bool operator()(const std::shared_ptr<FileDescriptor>& a,
-                    const std::shared_ptr<FileDescriptor>& b) const {
-      return a->get() < b->get();
-    }
-    bool operator()(int a, const std::shared_ptr<FileDescriptor>& b) const {
-      return a < b->get();
-    }
-    bool operator()(const std::shared_ptr<FileDescriptor>& a, int b) const {
-      return a->get() < b;
-    }
-  };
+  // Returns false if any of the file descriptors referenced by the
+  // argdata_t could not be handed out.
+  bool ok() const {
+    return ok_;
+  }
 
-  argdata_reader_t* const reader_;
-  std::set<std::shared_ptr<FileDescriptor>, FileDescriptorComparator>
-      file_descriptors_;
-  std::forward_list<argdata_map_iterator_t> maps_;
+ private:
+  FileDescriptorHandle* GetFileDescriptor(int fd);
+  std::shared_ptr<FileDescriptor> ParseSharedFileDescriptor(
+      const argdata_t& ad);
+
+  // Arena holding the file descriptors and iterators, which is only
+  // created when the argdata_t contains any.
+  struct State;
+  State* GetState();
+
+  ArgdataReader* const reader_;
+  const BytesAllocator* const bytes_allocator_;
+  bool ok_;
+  std::unique_ptr<State> state_;
 };
 
 // Allocator for temporary argdata_t objects. This class is used when
 // serializing a message class generated by aprotoc to an argdata_t to
 // store all of the temporarily allocated argdata_t objects. It can
 // safely be destroyed after transmitting the resulting argdata_t.
+//
+// Copies of strings, arrays of values and the builder's own bookkeeping
+// are allocated from an arena. Apart from the argdata_t objects created
+// by libargdata, building a message thus only needs a few allocations.
+//
+// Strings and binary blobs are copied, unless they are at least
+// kMinReferencedLength bytes in size. Those are referenced instead,
+// meaning that the message they are taken from must also be kept alive
+// until the resulting argdata_t has been transmitted, for example by
+// creating it through CreateMessage(). Gather() allows ArgdataWriter to
+// send them without copying them. BuildBorrowedStr() and
+// BuildBorrowedBinary() reference values of any size, which aprotoc's
+// --borrow-fields option uses for the fields of messages.
+//
+// If a FileDescriptorRegistry is provided, file descriptors are built
+// as integer handles, provided that a slot is available for them. The
+// changes made to the registry are attached to the enclosing message
+// through AttachFileDescriptorHandles().
+//
+// Builders can be reused by calling Reset() once the message has been
+// sent. Channels and connections each hold a single builder for all of
+// the messages they send, so that the memory of their arenas is
+// recycled.
+//
+// Messages generated by aprotoc use field names as keys by default.
+// SetFieldNumbers() lets them use the shorter field numbers instead,
+// which is negotiated by channels and servers as their peer needs to
+// understand them. Parse() accepts both.
 class ArgdataBuilder {
  public:
+  static constexpr std::size_t kMinReferencedLength = 4096;
+
+  // Values of a map or sequence, stored in the builder's arena.
+  using Values =
+      std::vector<const argdata_t*, ArenaAllocator<const argdata_t*>>;
+
+  // Values of a map or sequence whose maximum size is known up front,
+  // such as the fields of a message. They are stored on the stack, and
+  // only copied into the arena once the number of values is known.
+  template <std::size_t N>
+  class FixedValues {
+   public:
+    FixedValues() : size_(0) {
+    }
+
+    void push_back(const argdata_t* value) {
+      assert(size_ < N && "Too many values");
+      values_[size_++] = value;
+    }
+
+    const argdata_t* const* data() const {
+      return values_.data();
+    }
+    std::size_t size() const {
+      return size_;
+    }
+
+   private:
+    std::array<const argdata_t*, N> values_;
+    std::size_t size_;
+  };
+
+  // Data referenced by a serialized value that belongs at a given
+  // offset of the buffer returned by Gather().
+  struct Reference {
+    std::size_t offset;
+    std::string_view data;
+  };
+
+  explicit ArgdataBuilder(FileDescriptorRegistry* fd_registry = nullptr);
+  ~ArgdataBuilder();
+
+  // Returns an empty array of values that can hold a given number of
+  // values without growing.
+  Values CreateValues(std::size_t capacity) {
+    Values values{ArenaAllocator<const argdata_t*>(arena_.get())};
+    values.reserve(capacity);
+    return values;
+  }
+
+  const argdata_t* BuildBinary(std::string_view value);
+  const argdata_t* BuildBorrowedBinary(std::string_view value);
+  // Strings passed to this function must be followed by a null byte, as
+  // is the case for std::string and string literals.
+  const argdata_t* BuildBorrowedStr(std::string_view value);
+  const argdata_t* BuildByteStream(const std::shared_ptr<ByteStream>& value);
   const argdata_t* BuildFd(const std::shared_ptr<FileDescriptor>& value);
-  const argdata_t* BuildMap(std::vector<const argdata_t*> keys,
-                            std::vector<const argdata_t*> values);
-  const argdata_t* BuildSeq(std::vector<const argdata_t*> elements);
+  const argdata_t* BuildFd(const FileDescriptorHandle& value);
+  const argdata_t* BuildMap(const Values& keys, const Values& values);
+  const argdata_t* BuildMap(const argdata_t* const* keys,
+                            const argdata_t* const* values,
+                            std::size_t size);
+  const argdata_t* BuildMap(std::initializer_list<const argdata_t*> keys,
+                            std::initializer_list<const argdata_t*> values);
+  const argdata_t* BuildSeq(const Values& elements);
+  const argdata_t* BuildSeq(std::initializer_list<const argdata_t*> elements);
+  const argdata_t* BuildSharedBuffer(
+      const std::shared_ptr<SharedBuffer>& value);
   const argdata_t* BuildStr(std::string_view value);
 
   template <typename T>
@@ -134,11 +648,83 @@ class ArgdataBuilder {
     return argdatas_.emplace_back(argdata_create_int(value)).get();
   }
 
+  // Adds the changes made to the registry to the enclosing message.
+  // Values built afterwards belong to the enclosing message, so file
+  // descriptors are no longer built as handles.
+  void AttachFileDescriptorHandles(arpc_protocol::ClientMessage* message);
+
+  // Whether messages are built with field numbers as keys. This setting
+  // is retained by Reset().
+  void SetFieldNumbers(bool field_numbers) {
+    field_numbers_ = field_numbers;
+  }
+  bool UsesFieldNumbers() const {
+    return field_numbers_;
+  }
+
+  // Sets the registry used for the next message. Reset() clears it.
+  void SetFileDescriptorRegistry(FileDescriptorRegistry* fd_registry) {
+    fd_registry_ = fd_registry;
+  }
+
+  // Destroys all values built, closing the file descriptors and
+  // destroying the messages created by the builder.
+  void Reset();
+
+  // Creates a message that is kept alive until Reset() is called, so
+  // that values built from it may safely reference its data. Messages
+  // are stored in the arena, meaning that creating them doesn't
+  // allocate any memory once the arena has grown large enough.
+  template <typename T>
+  T* CreateMessage() {
+    T* message =
+        new (AllocateFromArena(arena_.get(), sizeof(T), alignof(T))) T();
+    messages_.push_front(message);
+    return message;
+  }
+
+  // Returns whether any of the values built reference data.
+  bool HasReferences() const {
+    return has_references_;
+  }
+
+  // Serializes a value that does not contain any file descriptors,
+  // appending it to a buffer. Referenced data is not copied into the
+  // buffer, but returned separately in the order in which it appears.
+  void Gather(const argdata_t* ad, std::vector<std::uint8_t>* buffer,
+              std::vector<Reference>* references) const;
+
  private:
-  std::vector<std::unique_ptr<argdata_t>> argdatas_;
-  std::vector<std::shared_ptr<FileDescriptor>> file_descriptors_;
-  std::forward_list<std::string> strings_;
-  std::forward_list<std::vector<const argdata_t*>> vectors_;
+  // Map, sequence or referenced string or binary blob created by this
+  // builder, whose contents need to be known by Gather().
+  struct Node {
+    const argdata_t* ad;
+    std::uint8_t type;
+    const argdata_t* const* keys;
+    const argdata_t* const* values;
+    std::size_t size;
+    std::string_view data;
+  };
+  struct GatherState;
+
+  const argdata_t* BuildReference(std::uint8_t type, std::string_view value);
+  void DestroyMessages();
+  void GatherValue(const argdata_t* ad, GatherState* state) const;
+  std::size_t GetSerializedLength(const argdata_t* ad,
+                                  GatherState* state) const;
+
+  const std::unique_ptr<Arena> arena_;
+  std::vector<std::unique_ptr<argdata_t>,
+              ArenaAllocator<std::unique_ptr<argdata_t>>>
+      argdatas_;
+  std::vector<std::shared_ptr<FileDescriptor>,
+              ArenaAllocator<std::shared_ptr<FileDescriptor>>>
+      file_descriptors_;
+  std::vector<Node, ArenaAllocator<Node>> nodes_;
+  FileDescriptorRegistry* fd_registry_;
+  bool has_references_;
+  bool field_numbers_;
+  std::forward_list<Message*, ArenaAllocator<Message*>> messages_;
 };
 
 // Base class for all message classes generated by aprotoc.
@@ -148,7 +734,12 @@ class Message {
   }
 
   virtual const argdata_t* Build(ArgdataBuilder* argdata_builder) const = 0;
+  virtual std::size_t ByteSize(ArgdataSerializer* argdata_serializer) const = 0;
+  virtual std::uint8_t* SerializeTo(
+      std::uint8_t* out, ArgdataSerializer* argdata_serializer) const = 0;
   virtual void Clear() = 0;
+  virtual std::unique_ptr<Message> Clone() const = 0;
+  virtual void CopyFrom(const Message& message) = 0;
   virtual void Parse(const argdata_t& ad, ArgdataParser* argdata_parser) = 0;
 };
 
@@ -225,18 +816,247 @@ class Service {
                                              const argdata_t& request,
                                              ArgdataParser* argdata_parser,
                                              ServerWriterImpl* writer) = 0;
+
+  // Variants of the functions above that are used by in-process
+  // channels, receiving message objects that are of the types expected
+  // by the RPC directly.
+  virtual Status InProcessUnaryCall(std::string_view rpc,
+                                    ServerContext* context,
+                                    const Message& request,
+                                    Message* response) = 0;
+  virtual Status InProcessClientStreamingCall(std::string_view rpc,
+                                              ServerContext* context,
+                                              ServerReaderImpl* reader,
+                                              Message* response) = 0;
+  virtual Status InProcessServerStreamingCall(std::string_view rpc,
+                                              ServerContext* context,
+                                              const Message& request,
+                                              ServerWriterImpl* writer) = 0;
+};
+
+// Configuration of a connection, such as limits on the size of the
+// messages that may be received. Servers are configured through the
+// equivalent functions of ServerBuilder.
+//
+// Options that need to be enabled on both sides are negotiated by
+// channels before sending their first request. Servers that don't
+// support negotiation drop the connection, so they must be upgraded
+// before channels enable any of these options.
+class ChannelArguments {
+ public:
+  ChannelArguments()
+      : max_receive_message_size_(4 * 1024 * 1024),
+        max_receive_file_descriptors_(253),
+        adaptive_receive_buffer_(true),
+        max_corked_bytes_(64 * 1024),
+        max_corked_messages_(128),
+        max_corked_delay_(1000),
+        spill_threshold_(1024 * 1024),
+        shared_memory_ring_size_(0),
+        io_uring_entries_(0),
+        file_descriptor_handles_(0),
+        pidfd_threshold_(0),
+        field_numbers_(false) {
+  }
+
+  // Sets the maximum size of a message in bytes. A negative value
+  // allows messages of any size.
+  void SetMaxReceiveMessageSize(int size) {
+    max_receive_message_size_ = size < 0 ? UINT32_MAX : size;
+  }
+  void SetMaxReceiveFileDescriptors(int count) {
+    max_receive_file_descriptors_ = count < 0 ? UINT32_MAX : count;
+  }
+
+  // Whether the receive buffer should be resized to fit the messages
+  // received, as opposed to allocating a buffer of the maximum message
+  // size up front.
+  void SetAdaptiveReceiveBuffer(bool adaptive) {
+    adaptive_receive_buffer_ = adaptive;
+  }
+
+  std::size_t GetMaxReceiveMessageSize() const {
+    return max_receive_message_size_;
+  }
+  std::size_t GetMaxReceiveFileDescriptors() const {
+    return max_receive_file_descriptors_;
+  }
+  bool GetAdaptiveReceiveBuffer() const {
+    return adaptive_receive_buffer_;
+  }
+
+  // Thresholds at which messages written with WriteOptions::set_corked()
+  // are flushed to the socket. The delay is checked when writing further
+  // messages, so it doesn't bound how long the last corked messages are
+  // held back. Call Flush() when pausing between writes.
+  void SetMaxCorkedBytes(std::size_t bytes) {
+    max_corked_bytes_ = bytes;
+  }
+  void SetMaxCorkedMessages(std::size_t messages) {
+    max_corked_messages_ = messages;
+  }
+  void SetMaxCorkedDelay(std::chrono::microseconds delay) {
+    max_corked_delay_ = delay;
+  }
+
+  std::size_t GetMaxCorkedBytes() const {
+    return max_corked_bytes_;
+  }
+  std::size_t GetMaxCorkedMessages() const {
+    return max_corked_messages_;
+  }
+  std::chrono::microseconds GetMaxCorkedDelay() const {
+    return max_corked_delay_;
+  }
+
+  // Sets the size at which outgoing messages are passed through a
+  // sealed memfd instead of being copied through the socket. Zero
+  // disables this.
+  void SetSpillThreshold(std::size_t bytes) {
+    spill_threshold_ = bytes;
+  }
+  std::size_t GetSpillThreshold() const {
+    return spill_threshold_;
+  }
+
+  // Sets the size of the ring buffers used by the shared memory
+  // transport. Channels request the use of this transport when first
+  // used, while servers accept requests for ring buffers up to this
+  // size. Zero disables the shared memory transport.
+  void SetSharedMemoryRingSize(std::size_t bytes) {
+    shared_memory_ring_size_ = bytes;
+  }
+  std::size_t GetSharedMemoryRingSize() const {
+    return shared_memory_ring_size_;
+  }
+
+  // Sets the size of the io_uring that servers handling multiple
+  // connections use to receive requests and send responses in batches.
+  // Zero disables the use of io_uring. Servers also fall back to using
+  // epoll if io_uring is not supported.
+  void SetIoUringEntries(unsigned entries) {
+    io_uring_entries_ = entries;
+  }
+  unsigned GetIoUringEntries() const {
+    return io_uring_entries_;
+  }
+
+  // Sets the size of the table of file descriptors that channels send
+  // by handle, as done by FileDescriptorRegistry. Servers accept tables
+  // up to this size. Zero disables the use of handles.
+  void SetFileDescriptorHandles(std::size_t count) {
+    file_descriptor_handles_ = count;
+  }
+  std::size_t GetFileDescriptorHandles() const {
+    return file_descriptor_handles_;
+  }
+
+  // Sets the number of file descriptors from which unary requests let
+  // the server duplicate them through pidfd_getfd(), instead of passing
+  // them over the socket. This requires the server to be permitted to
+  // trace the client. Servers only allow this if the threshold is
+  // nonzero. Zero disables the use of pidfd_getfd().
+  void SetPidfdThreshold(std::size_t count) {
+    pidfd_threshold_ = count;
+  }
+  std::size_t GetPidfdThreshold() const {
+    return pidfd_threshold_;
+  }
+
+  // Whether messages are sent using field numbers as keys, as opposed to
+  // field names. This makes messages smaller and faster to parse, but
+  // is only used if enabled on both sides.
+  void SetFieldNumbers(bool field_numbers) {
+    field_numbers_ = field_numbers;
+  }
+  bool GetFieldNumbers() const {
+    return field_numbers_;
+  }
+
+ private:
+  std::size_t max_receive_message_size_;
+  std::size_t max_receive_file_descriptors_;
+  bool adaptive_receive_buffer_;
+  std::size_t max_corked_bytes_;
+  std::size_t max_corked_messages_;
+  std::chrono::microseconds max_corked_delay_;
+  std::size_t spill_threshold_;
+  std::size_t shared_memory_ring_size_;
+  unsigned io_uring_entries_;
+  std::size_t file_descriptor_handles_;
+  std::size_t pidfd_threshold_;
+  bool field_numbers_;
+};
+
+// Per-message options for streaming writes. Corked messages may be
+// held back in a send buffer, so that they can be written to the socket
+// together with the messages that follow them.
+class WriteOptions {
+ public:
+  WriteOptions() : corked_(false) {
+  }
+
+  WriteOptions& set_corked() {
+    corked_ = true;
+    return *this;
+  }
+  WriteOptions& clear_corked() {
+    corked_ = false;
+    return *this;
+  }
+  bool is_corked() const {
+    return corked_;
+  }
+
+ private:
+  bool corked_;
+};
+
+// Handoff of the messages of in-process streaming calls between the
+// client and the server, which run in separate threads. Messages are
+// passed by reference. The writer blocks until the reader has copied
+// the message, or until the reader has gone away.
+class InProcessStream {
+ public:
+  InProcessStream();
+
+  bool Write(const Message& msg);
+  // Indicates that no more messages are written.
+  void Close();
+
+  bool Read(Message* msg);
+  // Indicates that no more messages are read.
+  void Cancel();
+
+ private:
+  std::mutex mutex_;
+  std::condition_variable condition_;
+  const Message* message_;
+  bool closed_;
+  bool cancelled_;
+
+  InProcessStream(InProcessStream const&) = delete;
+  void operator=(InProcessStream const&) = delete;
 };
 
 // ARPC client.
 // TODO(ed): Fix thread safety!
+//
+// Channel through which RPCs are invoked. Channels are either connected
+// to a server through a socket, or are created by
+// Server::InProcessChannel(), in which case calls are dispatched to the
+// server's services directly, without serializing messages.
 class Channel {
  public:
-  explicit Channel(const std::shared_ptr<FileDescriptor>& fd) : fd_(fd) {
-  }
+  explicit Channel(const std::shared_ptr<FileDescriptor>& fd,
+                   const ChannelArguments& arguments = ChannelArguments());
+  explicit Channel(
+      const std::map<std::string, Service*, std::less<>>& services);
+  ~Channel();
 
   Status BlockingUnaryCall(const RpcMethod& method, ClientContext* context,
                            const Message& request, Message* response);
-  Status FinishUnaryResponse(Message* response);
+  Status FinishUnaryResponse(ClientContext* context, Message* response);
 
   arpc_connectivity_state GetState(bool try_to_connect);
 
@@ -244,14 +1064,85 @@ class Channel {
     return fd_;
   }
 
+  // Whether calls are dispatched to services in the same process.
+  bool IsInProcess() const {
+    return fd_ == nullptr;
+  }
+  // Returns the service to which in-process calls are dispatched, or a
+  // null pointer if the service isn't registered.
+  Service* GetInProcessService(std::string_view name) const;
+
+  // Reader and writer that are reused for all messages sent and
+  // received over this channel, so that their buffers only need to be
+  // allocated once. The transport is negotiated before the first
+  // message is written.
+  ArgdataReader* GetReader() {
+    return reader_.get();
+  }
+  ArgdataWriter* GetWriter() {
+    if (!negotiated_)
+      Negotiate();
+    return writer_.get();
+  }
+
+  // Builder that is reused for all messages sent over this channel.
+  // Callers reset it once the message has been sent.
+  ArgdataBuilder* GetBuilder() {
+    return &builder_;
+  }
+
+  // Registry of file descriptors sent by handle, if negotiated.
+  FileDescriptorRegistry* GetFileDescriptorRegistry() {
+    if (!negotiated_)
+      Negotiate();
+    return fd_registry_.get();
+  }
+
+  // Lets the server close its copy of a file descriptor that has been
+  // sent by handle, once the next message is sent.
+  void EvictFileDescriptor(const std::shared_ptr<FileDescriptor>& fd);
+
  private:
+  void Negotiate();
+
   const std::shared_ptr<FileDescriptor> fd_;
+  const std::unique_ptr<ArgdataReader> reader_;
+  const std::unique_ptr<ArgdataWriter> writer_;
+  ArgdataBuilder builder_;
+  const std::size_t shared_memory_ring_size_;
+  const std::size_t file_descriptor_handles_;
+  const std::size_t pidfd_threshold_;
+  const bool field_numbers_;
+  std::unique_ptr<FileDescriptorRegistry> fd_registry_;
+  bool negotiated_;
+  const std::map<std::string, Service*, std::less<>> services_;
 };
 
 std::shared_ptr<Channel> CreateChannel(
     const std::shared_ptr<FileDescriptor>& fd);
+std::shared_ptr<Channel> CreateCustomChannel(
+    const std::shared_ptr<FileDescriptor>& fd,
+    const ChannelArguments& arguments);
 
-class ClientContext {};
+// Per-call options of client-side RPCs.
+class ClientContext {
+ public:
+  // Stores bytes fields of responses in buffers returned by an
+  // allocator, instead of in the response messages themselves. This
+  // prevents copying the data of large fields twice. The allocator is
+  // not used by in-process channels.
+  void SetBytesAllocator(BytesAllocator allocator) {
+    bytes_allocator_ = std::move(allocator);
+  }
+
+  // Returns the allocator to be passed to ArgdataParser, if any.
+  const BytesAllocator* GetBytesAllocator() const {
+    return bytes_allocator_ ? &bytes_allocator_ : nullptr;
+  }
+
+ private:
+  BytesAllocator bytes_allocator_;
+};
 
 // Client-side handle for server-streaming RPCs.
 class ClientReaderImpl {
@@ -264,9 +1155,15 @@ class ClientReaderImpl {
   bool Read(Message* msg);
 
  private:
-  const std::shared_ptr<FileDescriptor> fd_;
+  Channel* const channel_;
+  ClientContext* const context_;
   Status status_;
   bool finished_;
+
+  // State of in-process calls, whose server runs in a separate thread.
+  std::unique_ptr<Message> request_;
+  std::unique_ptr<InProcessStream> stream_;
+  std::thread thread_;
 };
 
 // Type safe wrapper for ClientReaderImpl.
@@ -299,14 +1196,21 @@ class ClientWriterImpl {
   ~ClientWriterImpl();
 
   Status Finish();
-  bool Write(const Message& msg);
+  bool Write(const Message& msg, WriteOptions options = WriteOptions());
   bool WritesDone();
+  bool Flush();
 
  private:
   Channel* const channel_;
+  ClientContext* const context_;
   Message* const response_;
   Status status_;
   bool writes_done_;
+
+  // State of in-process calls, whose server runs in a separate thread.
+  std::unique_ptr<InProcessStream> stream_;
+  std::thread thread_;
+  Status server_status_;
 };
 
 // Type safe wrapper for ClientWriterImpl.
@@ -327,37 +1231,148 @@ class ClientWriter {
     return impl_.Write(msg);
   }
 
+  bool Write(const W& msg, WriteOptions options) {
+    return impl_.Write(msg, options);
+  }
+
   bool WritesDone() {
     return impl_.WritesDone();
   }
 
+  // Sends messages that have been corked.
+  bool Flush() {
+    return impl_.Flush();
+  }
+
  private:
   ClientWriterImpl impl_;
 };
 
 // ARPC server.
+//
+// A server constructed with a file descriptor handles requests on just
+// that connection, returning -1 from HandleRequest() when the client
+// closes it. Servers constructed without one, or to which connections
+// are added through AddConnection(), wait for requests on any of their
+// connections using epoll. Connections that are closed by the client or
+// on which errors occur are removed, after which HandleRequest()
+// returns zero. GetConnectionCount() can be used to determine whether
+// any connections remain. Errors are only returned if waiting for
+// requests fails as a whole, e.g. when epoll or io_uring fail.
+// Connections may be added from other threads while HandleRequest() is
+// waiting.
+//
+// When enabled through SetIoUringEntries(), such servers use io_uring
+// to receive data from connections that use sockets. Responses to
+// unary and client-streaming calls are then sent asynchronously, so
+// that they can be submitted to the kernel together with the receive
+// operations of other connections.
 class Server {
  public:
   Server(const std::shared_ptr<FileDescriptor>& fd,
-         const std::map<std::string, Service*, std::less<>>& services)
-      : fd_(fd), services_(services) {
-  }
+         const std::map<std::string, Service*, std::less<>>& services,
+         const ChannelArguments& arguments = ChannelArguments());
+  ~Server();
 
+  int AddConnection(const std::shared_ptr<FileDescriptor>& fd);
   int HandleRequest();
+  std::size_t GetConnectionCount();
+
+  // Creates a channel through which the services of this server can be
+  // invoked from within the same process. Message objects are passed
+  // to the services directly, as opposed to being serialized. Streaming
+  // calls are processed by a separate thread.
+  std::shared_ptr<Channel> InProcessChannel() {
+    return std::make_shared<Channel>(services_);
+  }
 
  private:
-  const std::shared_ptr<FileDescriptor> fd_;
+  struct Connection;
+
+  int CreateEpoll();
+  int HandleRequest(Connection* connection);
+  int WaitForRequest(Connection** connection);
+  int WaitForEvents(int timeout);
+  void MarkReady(Connection* connection);
+  void ResumeConnection(Connection* connection);
+  void RemoveConnection(Connection* connection);
+
+  void CancelOperations(Connection* connection);
+  void CompleteOperation(std::uint64_t user_data, int result);
+  int PrepareReceive(Connection* connection);
+  int PrepareSend(Connection* connection);
+  int WaitForCompletions();
+
   const std::map<std::string, Service*, std::less<>> services_;
+  const ChannelArguments arguments_;
+
+  // Connections on which requests are handled. The epoll descriptor is
+  // only created when handling multiple connections. Connections that
+  // need to be processed are queued in the order in which they became
+  // ready, so that idle connections don't need to be scanned.
+  std::shared_ptr<FileDescriptor> epoll_;
+  std::mutex connections_mutex_;
+  std::list<std::unique_ptr<Connection>> connections_;
+  std::deque<Connection*> ready_;
+
+  // State of the io_uring, if used. Connections that are removed while
+  // operations are still pending on them are kept around until these
+  // have completed. The eventfd is used to wake up the server when
+  // connections are added.
+  std::unique_ptr<IoUring> io_uring_;
+  std::shared_ptr<FileDescriptor> wakeup_;
+  std::size_t pending_operations_;
+  bool polling_;
+  std::list<std::unique_ptr<Connection>> closing_connections_;
 };
 
 // ARPC server factory.
 class ServerBuilder {
  public:
+  ServerBuilder() {
+  }
   ServerBuilder(const std::shared_ptr<FileDescriptor>& fd) : fd_(fd) {
   }
 
   std::unique_ptr<Server> Build() {
-    return std::make_unique<Server>(fd_, services_);
+    return std::make_unique<Server>(fd_, services_, arguments_);
+  }
+
+  void SetMaxReceiveMessageSize(int size) {
+    arguments_.SetMaxReceiveMessageSize(size);
+  }
+  void SetMaxReceiveFileDescriptors(int count) {
+    arguments_.SetMaxReceiveFileDescriptors(count);
+  }
+  void SetAdaptiveReceiveBuffer(bool adaptive) {
+    arguments_.SetAdaptiveReceiveBuffer(adaptive);
+  }
+  void SetMaxCorkedBytes(std::size_t bytes) {
+    arguments_.SetMaxCorkedBytes(bytes);
+  }
+  void SetMaxCorkedMessages(std::size_t messages) {
+    arguments_.SetMaxCorkedMessages(messages);
+  }
+  void SetMaxCorkedDelay(std::chrono::microseconds delay) {
+    arguments_.SetMaxCorkedDelay(delay);
+  }
+  void SetSpillThreshold(std::size_t bytes) {
+    arguments_.SetSpillThreshold(bytes);
+  }
+  void SetSharedMemoryRingSize(std::size_t bytes) {
+    arguments_.SetSharedMemoryRingSize(bytes);
+  }
+  void SetIoUringEntries(unsigned entries) {
+    arguments_.SetIoUringEntries(entries);
+  }
+  void SetFileDescriptorHandles(std::size_t count) {
+    arguments_.SetFileDescriptorHandles(count);
+  }
+  void SetPidfdThreshold(std::size_t count) {
+    arguments_.SetPidfdThreshold(count);
+  }
+  void SetFieldNumbers(bool field_numbers) {
+    arguments_.SetFieldNumbers(field_numbers);
   }
 
   void RegisterService(Service* service) {
@@ -369,6 +1384,7 @@ class ServerBuilder {
  private:
   const std::shared_ptr<FileDescriptor> fd_;
   std::map<std::string, Service*, std::less<>> services_;
+  ChannelArguments arguments_;
 };
 
 class ServerContext {};
@@ -376,8 +1392,12 @@ class ServerContext {};
 // Server-side handle for client-streaming RPCs.
 class ServerReaderImpl {
  public:
-  explicit ServerReaderImpl(const std::shared_ptr<FileDescriptor>& fd)
-      : fd_(fd), finished_(false) {
+  ServerReaderImpl(const std::shared_ptr<FileDescriptor>& fd,
+                   ArgdataReader* reader)
+      : fd_(fd), reader_(reader), stream_(nullptr), finished_(false) {
+  }
+  explicit ServerReaderImpl(InProcessStream* stream)
+      : reader_(nullptr), stream_(stream), finished_(false) {
   }
   ~ServerReaderImpl();
 
@@ -385,6 +1405,8 @@ class ServerReaderImpl {
 
  private:
   const std::shared_ptr<FileDescriptor> fd_;
+  ArgdataReader* const reader_;
+  InProcessStream* const stream_;
   bool finished_;
 };
 
@@ -406,14 +1428,29 @@ class ServerReader {
 // Server-side handle for server-streaming RPCs.
 class ServerWriterImpl {
  public:
-  explicit ServerWriterImpl(const std::shared_ptr<FileDescriptor>& fd)
-      : fd_(fd), finished_(false) {
+  ServerWriterImpl(const std::shared_ptr<FileDescriptor>& fd,
+                   ArgdataWriter* writer, ArgdataBuilder* builder)
+      : fd_(fd),
+        writer_(writer),
+        builder_(builder),
+        stream_(nullptr),
+        finished_(false) {
+  }
+  explicit ServerWriterImpl(InProcessStream* stream)
+      : writer_(nullptr),
+        builder_(nullptr),
+        stream_(stream),
+        finished_(false) {
   }
 
-  bool Write(const Message& msg);
+  bool Write(const Message& msg, WriteOptions options = WriteOptions());
+  bool Flush();
 
  private:
   const std::shared_ptr<FileDescriptor> fd_;
+  ArgdataWriter* const writer_;
+  ArgdataBuilder* const builder_;
+  InProcessStream* const stream_;
   bool finished_;
 };
 
@@ -428,6 +1465,16 @@ class ServerWriter {
     return impl_->Write(msg);
   }
 
+  bool Write(const W& msg, WriteOptions options) {
+    return impl_->Write(msg, options);
+  }
+
+  // Sends messages that have been corked. Corked messages are also sent
+  // when the RPC completes.
+  bool Flush() {
+    return impl_->Flush();
+  }
+
  private:
   ServerWriterImpl* impl_;
 };
@@ -23,6 +23,7 @@
 # OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
 # SUCH DAMAGE.
 
+import argparse
 import hashlib
 import pypeg2
 import re
@@ -34,7 +35,53 @@ import toposort
 FORBIDDEN_WORDS = {'namespace'}
 
 
-class ScalarType:
+def serialize_subfield(data):
+    # Prefixes a value by its length, as done for the elements of maps
+    # and sequences in the Argdata serialization format.
+    length = len(data)
+    digits = [0x80 | (length & 0x7f)]
+    while length > 0x7f:
+        length >>= 7
+        digits.insert(0, length & 0x7f)
+    return bytes(digits) + data
+
+
+def serialize_key(field, field_numbers):
+    if field_numbers:
+        number = field.get_number()
+        digits = number.to_bytes((number.bit_length() + 8) // 8, 'big')
+        return serialize_subfield(b'\x05' + digits)
+    return serialize_subfield(
+        b'\x08' + field.get_name(False).encode('UTF-8') + b'\x00')
+
+
+def string_view_literal(data):
+    # Use octal escape sequences, as they can't absorb the characters
+    # that follow them.
+    return 'std::string_view("%s", %d)' % (
+        ''.join(chr(b) if chr(b).isalnum() or chr(b) == '_' else '\\%03o' % b
+                for b in data),
+        len(data))
+
+
+class SingleValueType:
+
+    def get_serialized_size_expression(self, var, declarations):
+        # Expression for the length of a value while serializing, after
+        # its length has been computed through get_size_expression().
+        return self.get_size_expression(var, declarations)
+
+    def print_byte_size(self, name, declarations):
+        print('      std::size_t valuesize = %s;' % self.get_size_expression(name + '_', declarations))
+
+    def print_serialized_size(self, name, declarations):
+        print('      std::size_t valuesize = %s;' % self.get_serialized_size_expression(name + '_', declarations))
+
+    def print_serializing(self, name, declarations):
+        print('      out = %s;' % self.get_serializing_expression(name + '_', declarations))
+
+
+class ScalarType(SingleValueType):
 
     def get_dependencies(self):
         return set()
@@ -79,7 +126,13 @@ class IntegerType(NumericType):
     def print_building_repeated(self, declarations):
         print('        elements.push_back(argdata_builder->BuildInt(element));')
 
-    def print_parsing(self, name, declarations):
+    def get_size_expression(self, var, declarations):
+        return 'argdata_serializer->GetIntSize(%s)' % var
+
+    def get_serializing_expression(self, var, declarations):
+        return 'argdata_serializer->PutInt(out, %s)' % var
+
+    def print_parsing(self, name, key, declarations):
         print('          argdata_get_int(value, &%s_);' % name)
 
     def print_parsing_map_key(self):
@@ -139,7 +192,7 @@ class FloatingPointType(NumericType):
     def get_storage_type(self, declarations):
         return 'double'
 
-    def print_parsing(self, name, declarations):
+    def print_parsing(self, name, key, declarations):
         print('            argdata_get_float(value, &%s_);' % name)
 
 
@@ -156,7 +209,13 @@ class BooleanType(NumericType):
     def print_building(self, name, declarations):
         print('      values.push_back(&argdata_true);')
 
-    def print_parsing(self, name, declarations):
+    def get_size_expression(self, var, declarations):
+        return 'argdata_serializer->GetBoolSize(%s)' % var
+
+    def get_serializing_expression(self, var, declarations):
+        return 'argdata_serializer->PutBool(out, %s)' % var
+
+    def print_parsing(self, name, key, declarations):
         print('          argdata_get_bool(value, &%s_);' % name)
 
 
@@ -190,18 +249,24 @@ class StringType(StringlikeType):
     grammar = ['string']
 
     def print_building(self, name, declarations):
-        print('      values.push_back(argdata_builder->BuildStr(%s_));' % name)
+        print('      values.push_back(argdata_builder->%s(%s_));' % (BUILD_STR, name))
 
     def print_building_map_key(self):
-        print('        mapkeys.push_back(argdata_builder->BuildStr(mapentry.first));')
+        print('        mapkeys.push_back(argdata_builder->%s(mapentry.first));' % BUILD_STR)
 
     def print_building_map_value(self, declarations):
-        print('        mapvalues.push_back(argdata_builder->BuildStr(mapentry.second));')
+        print('        mapvalues.push_back(argdata_builder->%s(mapentry.second));' % BUILD_STR)
 
     def print_building_repeated(self, declarations):
-        print('        elements.push_back(argdata_builder->BuildStr(element));')
+        print('        elements.push_back(argdata_builder->%s(element));' % BUILD_STR)
+
+    def get_size_expression(self, var, declarations):
+        return 'argdata_serializer->GetStrSize(%s)' % var
 
-    def print_parsing(self, name, declarations):
+    def get_serializing_expression(self, var, declarations):
+        return 'argdata_serializer->PutStr(out, %s)' % var
+
+    def print_parsing(self, name, key, declarations):
         print('          const char* valuestr;');
         print('          std::size_t valuelen;');
         print('          if (argdata_get_str(value, &valuestr, &valuelen) == 0)')
@@ -230,14 +295,30 @@ class BytesType(StringlikeType):
 
     grammar = ['bytes']
 
-    def print_parsing(self, name, declarations):
+    def print_building(self, name, declarations):
+        print('      values.push_back(argdata_builder->%s(%s_));' % (BUILD_BINARY, name))
+
+    def print_building_map_value(self, declarations):
+        print('        mapvalues.push_back(argdata_builder->%s(mapentry.second));' % BUILD_BINARY)
+
+    def print_building_repeated(self, declarations):
+        print('        elements.push_back(argdata_builder->%s(element));' % BUILD_BINARY)
+
+    def get_size_expression(self, var, declarations):
+        return 'argdata_serializer->GetBinarySize(%s)' % var
+
+    def get_serializing_expression(self, var, declarations):
+        return 'argdata_serializer->PutBinary(out, %s)' % var
+
+    def print_parsing(self, name, key, declarations):
         print('          const void* valuestr;');
         print('          std::size_t valuelen;');
-        print('          if (argdata_get_binary(value, &valuestr, &valuelen) == 0)')
+        print('          if (argdata_get_binary(value, &valuestr, &valuelen) == 0 &&')
+        print('              !argdata_parser->ParseBytes("%s", valuestr, valuelen))' % key)
         print('            %s_ = std::string_view(static_cast<const char*>(valuestr), valuelen);' % name)
 
 
-class FileDescriptorType:
+class FileDescriptorType(SingleValueType):
 
     grammar = ['fd']
 
@@ -251,38 +332,136 @@ class FileDescriptorType:
         return name + '_'
 
     def get_storage_type(self, declarations):
-        return 'std::shared_ptr<arpc::FileDescriptor>'
+        return 'arpc::FileDescriptorHandle'
 
     def print_accessors(self, name, declarations):
-        print('  const std::shared_ptr<arpc::FileDescriptor>& %s() const { return %s_; }' % (name, name))
-        print('  void set_%s(const std::shared_ptr<arpc::FileDescriptor>& value) { %s_ = value; }' % (name, name))
+        print('  const arpc::FileDescriptorHandle& %s() const { return %s_; }' % (name, name))
+        print('  arpc::FileDescriptorHandle* mutable_%s() { return &%s_; }' % (name, name))
+        print('  void set_%s(arpc::FileDescriptorHandle value) { %s_ = std::move(value); }' % (name, name))
         print('  void clear_%s() { %s_.reset(); }' % (name, name))
 
     def print_accessors_repeated(self, name, declarations):
-        print('  const std::shared_ptr<arpc::FileDescriptor>& %s(std::size_t index) const { return %s_[index]; }' % (name, name))
-        print('  void set_%s(std::size_t index, const std::shared_ptr<arpc::FileDescriptor>& value) { %s_[index] = value; }' % (name, name))
-        print('  void add_%s(const std::shared_ptr<arpc::FileDescriptor>& value) { %s_.push_back(value); }' % (name, name))
+        print('  const arpc::FileDescriptorHandle& %s(std::size_t index) const { return %s_[index]; }' % (name, name))
+        print('  arpc::FileDescriptorHandle* mutable_%s(std::size_t index) { return &%s_[index]; }' % (name, name))
+        print('  void set_%s(std::size_t index, arpc::FileDescriptorHandle value) { %s_[index] = std::move(value); }' % (name, name))
+        print('  void add_%s(arpc::FileDescriptorHandle value) { %s_.push_back(std::move(value)); }' % (name, name))
 
     def print_building(self, name, declarations):
         print('      values.push_back(argdata_builder->BuildFd(%s_));' % name)
 
+    def print_building_repeated(self, declarations):
+        print('        elements.push_back(argdata_builder->BuildFd(element));')
+
+    def get_size_expression(self, var, declarations):
+        return 'argdata_serializer->GetFdSize(%s)' % var
+
+    def get_serialized_size_expression(self, var, declarations):
+        return 'arpc::ArgdataSerializer::kFdSize'
+
+    def get_serializing_expression(self, var, declarations):
+        return 'argdata_serializer->PutFd(out, %s)' % var
+
     def print_fields(self, name, declarations):
-        print('  std::shared_ptr<arpc::FileDescriptor> %s_;' % name)
+        print('  arpc::FileDescriptorHandle %s_;' % name)
 
-    def print_parsing(self, name, declarations):
-        print('          std::shared_ptr<arpc::FileDescriptor> fd = argdata_parser->ParseFileDescriptor(*value);')
+    def print_parsing(self, name, key, declarations):
+        print('          arpc::FileDescriptorHandle fd = argdata_parser->ParseFileDescriptor(*value);')
         print('          if (fd)')
         print('            %s_ = std::move(fd);' % name)
 
     def print_parsing_map_value(self, name, declarations):
-        print('          std::shared_ptr<arpc::FileDescriptor> fd = argdata_parser->ParseFileDescriptor(*key2);')
+        print('          arpc::FileDescriptorHandle fd = argdata_parser->ParseFileDescriptor(*key2);')
         print('          if (fd)')
-        print('            %s_.emplace(mapkey, nullptr).first->second = std::move(fd);' % name)
+        print('            %s_.emplace(mapkey, arpc::FileDescriptorHandle()).first->second = std::move(fd);' % name)
 
     def print_parsing_repeated(self, name, declarations):
-        print('          std::shared_ptr<arpc::FileDescriptor> fd = argdata_parser->ParseFileDescriptor(*element);')
-        print('          if (fd)')
-        print('            %s_.emplace_back(std::move(fd));' % name)
+        print('            arpc::FileDescriptorHandle fd = argdata_parser->ParseFileDescriptor(*element);')
+        print('            if (fd)')
+        print('              %s_.emplace_back(std::move(fd));' % name)
+
+
+class StreamBytesType(SingleValueType):
+
+    grammar = ['stream_bytes']
+
+    def get_dependencies(self):
+        return set()
+
+    def get_initializer(self, name, declarations):
+        return ''
+
+    def get_isset_expression(self, name, declarations):
+        return name + '_'
+
+    def get_storage_type(self, declarations):
+        return 'std::shared_ptr<arpc::ByteStream>'
+
+    def print_accessors(self, name, declarations):
+        print('  const std::shared_ptr<arpc::ByteStream>& %s() const { return %s_; }' % (name, name))
+        print('  void set_%s(const std::shared_ptr<arpc::ByteStream>& value) { %s_ = value; }' % (name, name))
+        print('  void clear_%s() { %s_.reset(); }' % (name, name))
+
+    def print_building(self, name, declarations):
+        print('      values.push_back(argdata_builder->BuildByteStream(%s_));' % name)
+
+    def get_size_expression(self, var, declarations):
+        return 'argdata_serializer->GetByteStreamSize(%s)' % var
+
+    def get_serialized_size_expression(self, var, declarations):
+        return 'arpc::ArgdataSerializer::kFdSize'
+
+    def get_serializing_expression(self, var, declarations):
+        return 'argdata_serializer->PutByteStream(out, %s)' % var
+
+    def print_fields(self, name, declarations):
+        print('  std::shared_ptr<arpc::ByteStream> %s_;' % name)
+
+    def print_parsing(self, name, key, declarations):
+        print('          std::shared_ptr<arpc::ByteStream> stream = argdata_parser->ParseByteStream(*value);')
+        print('          if (stream)')
+        print('            %s_ = std::move(stream);' % name)
+
+
+class SharedBufferType(SingleValueType):
+
+    grammar = ['shared_buffer']
+
+    def get_dependencies(self):
+        return set()
+
+    def get_initializer(self, name, declarations):
+        return ''
+
+    def get_isset_expression(self, name, declarations):
+        return name + '_'
+
+    def get_storage_type(self, declarations):
+        return 'std::shared_ptr<arpc::SharedBuffer>'
+
+    def print_accessors(self, name, declarations):
+        print('  const std::shared_ptr<arpc::SharedBuffer>& %s() const { return %s_; }' % (name, name))
+        print('  void set_%s(const std::shared_ptr<arpc::SharedBuffer>& value) { %s_ = value; }' % (name, name))
+        print('  void clear_%s() { %s_.reset(); }' % (name, name))
+
+    def print_building(self, name, declarations):
+        print('      values.push_back(argdata_builder->BuildSharedBuffer(%s_));' % name)
+
+    def get_size_expression(self, var, declarations):
+        return 'argdata_serializer->GetSharedBufferSize(%s)' % var
+
+    def get_serialized_size_expression(self, var, declarations):
+        return 'arpc::ArgdataSerializer::kFdSize'
+
+    def get_serializing_expression(self, var, declarations):
+        return 'argdata_serializer->PutSharedBuffer(out, %s)' % var
+
+    def print_fields(self, name, declarations):
+        print('  std::shared_ptr<arpc::SharedBuffer> %s_;' % name)
+
+    def print_parsing(self, name, key, declarations):
+        print('          std::shared_ptr<arpc::SharedBuffer> buffer = argdata_parser->ParseSharedBuffer(*value);')
+        print('          if (buffer)')
+        print('            %s_ = std::move(buffer);' % name)
 
 
 class AnyType:
@@ -293,28 +472,50 @@ class AnyType:
         return set()
 
     def get_initializer(self, name, declarations):
-        return '%s_(nullptr)' % name
+        return '%s_(nullptr), %s_message_(nullptr)' % (name, name)
 
     def get_isset_expression(self, name, declarations):
-        return '%s_ != nullptr' % name
+        return '%s_ != nullptr || %s_message_ != nullptr' % (name, name)
 
     def print_accessors(self, name, declarations):
-        print('  bool has_%s() const { return %s_ != nullptr; }' % (name, name))
+        # Instead of a value, the field may reference a message that is
+        # built or serialized in place, which is left empty by parsing.
+        print('  bool has_%s() const { return %s_ != nullptr || %s_message_ != nullptr; }' % (name, name, name))
         print('  const argdata_t* %s() const { return %s_ == nullptr ? &argdata_null : %s_; }' % (name, name, name))
-        print('  void set_%s(const argdata_t* value) { %s_ = value; }' % (name, name))
-        print('  void clear_%s() { %s_ = nullptr; }' % (name, name))
+        print('  void set_%s(const argdata_t* value) {' % name)
+        print('    %s_ = value;' % name)
+        print('    %s_message_ = nullptr;' % name)
+        print('  }')
+        print('  void set_%s_message(const arpc::Message* value) {' % name)
+        print('    %s_ = nullptr;' % name)
+        print('    %s_message_ = value;' % name)
+        print('  }')
+        print('  void clear_%s() {' % name)
+        print('    %s_ = nullptr;' % name)
+        print('    %s_message_ = nullptr;' % name)
+        print('  }')
 
     def print_building(self, name, declarations):
-        print('      values.push_back(%s_);' % name)
+        print('      values.push_back(%s_message_ != nullptr ? %s_message_->Build(argdata_builder) : %s_);' % (name, name, name))
+
+    def print_byte_size(self, name, declarations):
+        print('      std::size_t valuesize = %s_message_ != nullptr ? argdata_serializer->GetMessageSize(*%s_message_) : argdata_serializer->GetArgdataSize(%s_);' % (name, name, name))
+
+    def print_serialized_size(self, name, declarations):
+        print('      std::size_t valuesize = argdata_serializer->GetRecordedSize();')
+
+    def print_serializing(self, name, declarations):
+        print('      out = %s_message_ != nullptr ? %s_message_->SerializeTo(out, argdata_serializer) : argdata_serializer->PutArgdata(out, %s_, valuesize);' % (name, name, name))
 
     def print_fields(self, name, declarations):
         print('  const argdata_t* %s_;' % name)
+        print('  const arpc::Message* %s_message_;' % name)
 
-    def print_parsing(self, name, declarations):
+    def print_parsing(self, name, key, declarations):
         print('          %s_ = argdata_parser->ParseAnyFromMap(it);' % name)
 
 
-class ReferenceType:
+class ReferenceType(SingleValueType):
 
     grammar = pypeg2.word
 
@@ -348,10 +549,19 @@ class ReferenceType:
     def print_building_repeated(self, declarations):
         declarations[self._name].print_building_repeated()
 
+    def get_size_expression(self, var, declarations):
+        return declarations[self._name].get_size_expression(var)
+
+    def get_serialized_size_expression(self, var, declarations):
+        return declarations[self._name].get_serialized_size_expression(var)
+
+    def get_serializing_expression(self, var, declarations):
+        return declarations[self._name].get_serializing_expression(var)
+
     def print_fields(self, name, declarations):
         declarations[self._name].print_fields(name)
 
-    def print_parsing(self, name, declarations):
+    def print_parsing(self, name, key, declarations):
         declarations[self._name].print_parsing(name)
 
     def print_parsing_map_value(self, name, declarations):
@@ -371,6 +581,8 @@ PrimitiveType = [
     StringType,
     BytesType,
     FileDescriptorType,
+    StreamBytesType,
+    SharedBufferType,
     AnyType,
     ReferenceType,
 ]
@@ -410,18 +622,38 @@ class MapType:
         print('  %s* mutable_%s() { return &%s_; }' % (self.get_storage_type(declarations), name, name))
 
     def print_building(self, name, declarations):
-        print('      std::vector<const argdata_t*> mapkeys;')
-        print('      std::vector<const argdata_t*> mapvalues;')
+        print('      arpc::ArgdataBuilder::Values mapkeys = argdata_builder->CreateValues(%s_.size());' % name)
+        print('      arpc::ArgdataBuilder::Values mapvalues = argdata_builder->CreateValues(%s_.size());' % name)
         print('      for (const auto& mapentry : %s_) {' % name)
         self._key_type.print_building_map_key()
         self._value_type.print_building_map_value(declarations)
         print('      }')
-        print('      values.push_back(argdata_builder->BuildMap(std::move(mapkeys), std::move(mapvalues)));')
+        print('      values.push_back(argdata_builder->BuildMap(mapkeys, mapvalues));')
+
+    def print_byte_size(self, name, declarations):
+        print('      std::size_t valueslot = argdata_serializer->ReserveSize();')
+        print('      std::size_t valuesize = 1;')
+        print('      for (const auto& mapentry : %s_)' % name)
+        print('        valuesize += argdata_serializer->GetSubfieldSize(%s) +' % self._key_type.get_size_expression('mapentry.first', declarations))
+        print('                     argdata_serializer->GetSubfieldSize(%s);' % self._value_type.get_size_expression('mapentry.second', declarations))
+        print('      argdata_serializer->SetSize(valueslot, valuesize);')
+
+    def print_serialized_size(self, name, declarations):
+        print('      std::size_t valuesize = argdata_serializer->GetRecordedSize();')
+
+    def print_serializing(self, name, declarations):
+        print('      *out++ = arpc::ArgdataSerializer::kTypeMap;')
+        print('      for (const auto& mapentry : %s_) {' % name)
+        print('        out = argdata_serializer->PutSubfieldLength(out, %s);' % self._key_type.get_serialized_size_expression('mapentry.first', declarations))
+        print('        out = %s;' % self._key_type.get_serializing_expression('mapentry.first', declarations))
+        print('        out = argdata_serializer->PutSubfieldLength(out, %s);' % self._value_type.get_serialized_size_expression('mapentry.second', declarations))
+        print('        out = %s;' % self._value_type.get_serializing_expression('mapentry.second', declarations))
+        print('      }')
 
     def print_fields(self, name, declarations):
         print('  %s %s_;' % (self.get_storage_type(declarations), name))
 
-    def print_parsing(self, name, declarations):
+    def print_parsing(self, name, key, declarations):
         print('          argdata_map_iterator_t it2;')
         print('          argdata_map_iterate(value, &it2);')
         print('          const argdata_t* key2, *value2;')
@@ -460,16 +692,33 @@ class RepeatedType:
         print('  %s* mutable_%s() { return &%s_; }' % (self.get_storage_type(declarations), name, name))
 
     def print_building(self, name, declarations):
-        print('      std::vector<const argdata_t*> elements;')
+        print('      arpc::ArgdataBuilder::Values elements = argdata_builder->CreateValues(%s_.size());' % name)
         print('      for (const auto& element : %s_) {' % name)
         self._type.print_building_repeated(declarations)
         print('      }')
-        print('      values.push_back(argdata_builder->BuildSeq(std::move(elements)));')
+        print('      values.push_back(argdata_builder->BuildSeq(elements));')
+
+    def print_byte_size(self, name, declarations):
+        print('      std::size_t valueslot = argdata_serializer->ReserveSize();')
+        print('      std::size_t valuesize = 1;')
+        print('      for (const auto& element : %s_)' % name)
+        print('        valuesize += argdata_serializer->GetSubfieldSize(%s);' % self._type.get_size_expression('element', declarations))
+        print('      argdata_serializer->SetSize(valueslot, valuesize);')
+
+    def print_serialized_size(self, name, declarations):
+        print('      std::size_t valuesize = argdata_serializer->GetRecordedSize();')
+
+    def print_serializing(self, name, declarations):
+        print('      *out++ = arpc::ArgdataSerializer::kTypeSeq;')
+        print('      for (const auto& element : %s_) {' % name)
+        print('        out = argdata_serializer->PutSubfieldLength(out, %s);' % self._type.get_serialized_size_expression('element', declarations))
+        print('        out = %s;' % self._type.get_serializing_expression('element', declarations))
+        print('      }')
 
     def print_fields(self, name, declarations):
         print('  %s %s_;' % (self.get_storage_type(declarations), name))
 
-    def print_parsing(self, name, declarations):
+    def print_parsing(self, name, key, declarations):
         print('          argdata_seq_iterator_t it2;')
         print('          argdata_seq_iterate(value, &it2);')
         print('          const argdata_t* element;')
@@ -536,10 +785,19 @@ class EnumDeclaration:
         print('  void add_%s(%s value) { return %s_.push_back(value); }' % (name, self._name, name))
 
     def print_building(self, name):
-        print('      values.push_back(argdata_builder->BuildStr(%s_Name(%s_)));' % (self._name, name))
+        print('      values.push_back(argdata_builder->BuildBorrowedStr(%s_Name(%s_)));' % (self._name, name))
 
     def print_building_repeated(self):
-        print('        elements.push_back(argdata_builder->BuildStr(%s_Name(element)));' % self._name)
+        print('        elements.push_back(argdata_builder->BuildBorrowedStr(%s_Name(element)));' % self._name)
+
+    def get_size_expression(self, var):
+        return 'argdata_serializer->GetStrSize(%s_Name(%s))' % (self._name, var)
+
+    def get_serialized_size_expression(self, var):
+        return self.get_size_expression(var)
+
+    def get_serializing_expression(self, var):
+        return 'argdata_serializer->PutStr(out, %s_Name(%s))' % (self._name, var)
 
     def print_code(self, declarations):
         print('enum %s {' % self._name)
@@ -600,17 +858,21 @@ class MessageFieldDeclaration:
         MapType,
         RepeatedType,
         PrimitiveType,
-    ], pypeg2.word, '=', pypeg2.ignore(re.compile(r'\d+')), ';',
+    ], pypeg2.word, '=', re.compile(r'\d+'), ';',
 
     def __init__(self, arguments):
         self._type = arguments[0]
         self._name = arguments[1]
+        self._number = int(arguments[2])
 
     def get_name(self, sanitized):
         if sanitized and self._name in FORBIDDEN_WORDS:
             return self._name + '_'
         return self._name
 
+    def get_number(self):
+        return self._number
+
     def get_type(self):
         return self._type
 
@@ -663,6 +925,45 @@ class MessageDeclaration:
     def print_building_repeated(self):
         print('        elements.push_back(element.Build(argdata_builder));')
 
+    def get_size_expression(self, var):
+        return 'argdata_serializer->GetMessageSize(%s)' % var
+
+    def get_serialized_size_expression(self, var):
+        return 'argdata_serializer->GetRecordedSize()'
+
+    def get_serializing_expression(self, var):
+        return '%s.SerializeTo(out, argdata_serializer)' % var
+
+    def print_parsing_dispatch(self):
+        # Select fields by the length of the key, followed by a character
+        # in which all fields of that length differ. This leaves only a
+        # single string comparison per key.
+        fields = sorted(self._fields, key=lambda field: field.get_name(False))
+        fields_by_length = {}
+        for i, field in enumerate(fields):
+            fields_by_length.setdefault(len(field.get_name(False)), []).append((i, field))
+        print('        switch (keylen) {')
+        for length, candidates in sorted(fields_by_length.items()):
+            names = [field.get_name(False) for i, field in candidates]
+            position = next(
+                (i for i in range(length)
+                 if len({name[i] for name in names}) == len(names)), None)
+            print('        case %d:' % length)
+            if len(candidates) > 1 and position is not None:
+                print('          switch (keystr[%d]) {' % position)
+                for (i, field), name in zip(candidates, names):
+                    print("          case '%s':" % name[position])
+                    print('            if (keyss == "%s")' % name)
+                    print('              field = %d;' % i)
+                    print('            break;')
+                print('          }')
+            else:
+                for (i, field), name in zip(candidates, names):
+                    print('          if (keyss == "%s")' % name)
+                    print('            field = %d;' % i)
+            print('          break;')
+        print('        }')
+
     def print_code(self, declarations):
         print('class %s final : public arpc::Message {' % self._name)
         print(' public:')
@@ -674,22 +975,76 @@ class MessageDeclaration:
             print()
         print('  const argdata_t* Build(arpc::ArgdataBuilder* argdata_builder) const override {')
         if self._fields:
-            print('    std::vector<const argdata_t*> keys;')
-            print('    std::vector<const argdata_t*> values;')
-            for field in sorted(self._fields, key=lambda field: field.get_name(False)):
+            # Keys are shared by all instances of the message. Fields
+            # are identified by name, or by number if negotiated.
+            fields = sorted(self._fields, key=lambda field: field.get_name(False))
+            print('    static const std::unique_ptr<argdata_t> fieldnames[] = {')
+            for field in fields:
+                print('      std::unique_ptr<argdata_t>(argdata_create_str("%s", %d)),' % (field.get_name(False), len(field.get_name(False))))
+            print('    };')
+            print('    static const std::unique_ptr<argdata_t> fieldnumbers[] = {')
+            for field in fields:
+                print('      std::unique_ptr<argdata_t>(argdata_create_int(%d)),' % field.get_number())
+            print('    };')
+            print('    const std::unique_ptr<argdata_t>* fieldkeys = argdata_builder->UsesFieldNumbers() ? fieldnumbers : fieldnames;')
+            print('    arpc::ArgdataBuilder::FixedValues<%d> keys;' % len(fields))
+            print('    arpc::ArgdataBuilder::FixedValues<%d> values;' % len(fields))
+            for i, field in enumerate(fields):
                 print('    if (%s) {' % (field.get_type().get_isset_expression(field.get_name(True), declarations)))
-                print('      keys.push_back(argdata_builder->BuildStr("%s"));' % field.get_name(False))
+                print('      keys.push_back(fieldkeys[%d].get());' % i)
                 field.get_type().print_building(field.get_name(True), declarations)
                 print('    }')
-            print('    return argdata_builder->BuildMap(std::move(keys), std::move(values));')
+            print('    return argdata_builder->BuildMap(keys.data(), values.data(), values.size());')
         else:
             print('    return &argdata_null;')
         print('  }')
         print()
+        print('  std::size_t ByteSize(arpc::ArgdataSerializer* argdata_serializer) const override {')
+        if self._fields:
+            fields = sorted(self._fields, key=lambda field: field.get_name(False))
+            print('    const bool fieldnumbers = argdata_serializer->UsesFieldNumbers();')
+            print('    std::size_t size = 1;')
+            for field in fields:
+                print('    if (%s) {' % (field.get_type().get_isset_expression(field.get_name(True), declarations)))
+                field.get_type().print_byte_size(field.get_name(True), declarations)
+                print('      size += (fieldnumbers ? %d : %d) + argdata_serializer->GetSubfieldSize(valuesize);' % (
+                    len(serialize_key(field, True)), len(serialize_key(field, False))))
+                print('    }')
+            print('    return size;')
+        else:
+            print('    return 0;')
+        print('  }')
+        print()
+        print('  std::uint8_t* SerializeTo(std::uint8_t* out, arpc::ArgdataSerializer* argdata_serializer) const override {')
+        if self._fields:
+            # Keys are written along with their length prefix.
+            fields = sorted(self._fields, key=lambda field: field.get_name(False))
+            print('    const bool fieldnumbers = argdata_serializer->UsesFieldNumbers();')
+            print('    *out++ = arpc::ArgdataSerializer::kTypeMap;')
+            for field in fields:
+                print('    if (%s) {' % (field.get_type().get_isset_expression(field.get_name(True), declarations)))
+                print('      out = argdata_serializer->PutBytes(out, fieldnumbers ? %s : %s);' % (
+                    string_view_literal(serialize_key(field, True)),
+                    string_view_literal(serialize_key(field, False))))
+                field.get_type().print_serialized_size(field.get_name(True), declarations)
+                print('      out = argdata_serializer->PutSubfieldLength(out, valuesize);')
+                field.get_type().print_serializing(field.get_name(True), declarations)
+                print('    }')
+        print('    return out;')
+        print('  }')
+        print()
         print('  void Clear() override {')
         print('    *this = %s();' % self._name)
         print('  }')
         print()
+        print('  std::unique_ptr<arpc::Message> Clone() const override {')
+        print('    return std::make_unique<%s>(*this);' % self._name)
+        print('  }')
+        print()
+        print('  void CopyFrom(const arpc::Message& message) override {')
+        print('    *this = static_cast<const %s&>(message);' % self._name)
+        print('  }')
+        print()
         print('  void Parse(const argdata_t& ad, arpc::ArgdataParser* argdata_parser) override {')
         if self._fields:
             print('    argdata_map_iterator_t it;')
@@ -697,17 +1052,29 @@ class MessageDeclaration:
             print('    const argdata_t* key;')
             print('    const argdata_t* value;')
             print('    while (argdata_map_get(&it, &key, &value)) {')
+            print('      // Keys may either be field names or field numbers.')
+            print('      int field = -1;')
             print('      const char* keystr;')
             print('      std::size_t keylen;')
+            print('      std::uint64_t keynumber;')
             print('      if (argdata_get_str(key, &keystr, &keylen) == 0) {')
             print('        std::string_view keyss(keystr, keylen);')
-            prefix = ''
-            for field in sorted(self._fields, key=lambda field: field.get_name(False)):
-                print('        %sif (keyss == "%s") {' % (prefix, field.get_name(False)))
-                field.get_type().print_parsing(field.get_name(True), declarations)
-                prefix = '} else '
+            self.print_parsing_dispatch()
+            print('      } else if (argdata_get_int(key, &keynumber) == 0) {')
+            print('        switch (keynumber) {')
+            for i, field in enumerate(sorted(self._fields, key=lambda field: field.get_name(False))):
+                print('        case %d:' % field.get_number())
+                print('          field = %d;' % i)
+                print('          break;')
             print('        }')
             print('      }')
+            print('      switch (field) {')
+            for i, field in enumerate(sorted(self._fields, key=lambda field: field.get_name(False))):
+                print('      case %d: {' % i)
+                field.get_type().print_parsing(field.get_name(True), field.get_name(False), declarations)
+                print('        break;')
+                print('      }')
+            print('      }')
             print('      argdata_map_next(&it);')
             print('    }')
         print('  }')
@@ -767,10 +1134,10 @@ class ServiceRpcDeclaration:
         if self._argument_type.is_stream() and not self._return_type.is_stream():
             print('    if (rpc == "%s") {' % self._name)
             print('      arpc::ServerReader<%s> reader_object(reader);' % self._argument_type.get_storage_type(declarations))
-            print('      %s response_object;' % self._return_type.get_storage_type(declarations))
-            print('      arpc::Status status = %s(context, &reader_object, &response_object);' % self._name)
+            print('      auto response_object = argdata_builder->CreateMessage<%s>();' % self._return_type.get_storage_type(declarations))
+            print('      arpc::Status status = %s(context, &reader_object, response_object);' % self._name)
             print('      if (status.ok())')
-            print('        *response = response_object.Build(argdata_builder);')
+            print('        *response = response_object->Build(argdata_builder);')
             print('      return status;')
             print('    }')
 
@@ -779,6 +1146,8 @@ class ServiceRpcDeclaration:
             print('    if (rpc == "%s") {' % self._name)
             print('      %s request_object;' % self._argument_type.get_storage_type(declarations))
             print('      request_object.Parse(request, argdata_parser);')
+            print('      if (!argdata_parser->ok())')
+            print('        return arpc::Status(arpc::StatusCode::INTERNAL, "Failed to receive file descriptors");')
             print('      arpc::ServerWriter<%s> writer_object(writer);' % self._return_type.get_storage_type(declarations))
             print('      return %s(context, &request_object, &writer_object);' % self._name)
             print('    }')
@@ -788,13 +1157,34 @@ class ServiceRpcDeclaration:
             print('    if (rpc == "%s") {' % self._name)
             print('      %s request_object;' % self._argument_type.get_storage_type(declarations))
             print('      request_object.Parse(request, argdata_parser);')
-            print('      %s response_object;' % self._return_type.get_storage_type(declarations))
-            print('      arpc::Status status = %s(context, &request_object, &response_object);' % self._name)
+            print('      if (!argdata_parser->ok())')
+            print('        return arpc::Status(arpc::StatusCode::INTERNAL, "Failed to receive file descriptors");')
+            print('      auto response_object = argdata_builder->CreateMessage<%s>();' % self._return_type.get_storage_type(declarations))
+            print('      arpc::Status status = %s(context, &request_object, response_object);' % self._name)
             print('      if (status.ok())')
-            print('        *response = response_object.Build(argdata_builder);')
+            print('        *response = response_object->Build(argdata_builder);')
             print('      return status;')
             print('    }')
 
+    def print_service_in_process_client_streaming_call(self, declarations):
+        if self._argument_type.is_stream() and not self._return_type.is_stream():
+            print('    if (rpc == "%s") {' % self._name)
+            print('      arpc::ServerReader<%s> reader_object(reader);' % self._argument_type.get_storage_type(declarations))
+            print('      return %s(context, &reader_object, static_cast<%s*>(response));' % (self._name, self._return_type.get_storage_type(declarations)))
+            print('    }')
+
+    def print_service_in_process_server_streaming_call(self, declarations):
+        if not self._argument_type.is_stream() and self._return_type.is_stream():
+            print('    if (rpc == "%s") {' % self._name)
+            print('      arpc::ServerWriter<%s> writer_object(writer);' % self._return_type.get_storage_type(declarations))
+            print('      return %s(context, static_cast<const %s*>(&request), &writer_object);' % (self._name, self._argument_type.get_storage_type(declarations)))
+            print('    }')
+
+    def print_service_in_process_unary_call(self, declarations):
+        if not self._argument_type.is_stream() and not self._return_type.is_stream():
+            print('    if (rpc == "%s")' % self._name)
+            print('      return %s(context, static_cast<const %s*>(&request), static_cast<%s*>(response));' % (self._name, self._argument_type.get_storage_type(declarations), self._return_type.get_storage_type(declarations)))
+
     def print_service_function(self, declarations):
         if self._argument_type.is_stream():
             if self._return_type.is_stream():
@@ -877,6 +1267,27 @@ class ServiceDeclaration:
             rpc.print_service_blocking_server_streaming_call(declarations)
         print('    return arpc::Status(arpc::StatusCode::UNIMPLEMENTED, "Operation not provided by this service");')
         print('  }')
+        print()
+
+        print('  arpc::Status InProcessUnaryCall(std::string_view rpc, arpc::ServerContext* context, const arpc::Message& request, arpc::Message* response) override {')
+        for rpc in self._rpcs:
+            rpc.print_service_in_process_unary_call(declarations)
+        print('    return arpc::Status(arpc::StatusCode::UNIMPLEMENTED, "Operation not provided by this service");')
+        print('  }')
+        print()
+
+        print('  arpc::Status InProcessClientStreamingCall(std::string_view rpc, arpc::ServerContext* context, arpc::ServerReaderImpl* reader, arpc::Message* response) override {')
+        for rpc in self._rpcs:
+            rpc.print_service_in_process_client_streaming_call(declarations)
+        print('    return arpc::Status(arpc::StatusCode::UNIMPLEMENTED, "Operation not provided by this service");')
+        print('  }')
+        print()
+
+        print('  arpc::Status InProcessServerStreamingCall(std::string_view rpc, arpc::ServerContext* context, const arpc::Message& request, arpc::ServerWriterImpl* writer) override {')
+        for rpc in self._rpcs:
+            rpc.print_service_in_process_server_streaming_call(declarations)
+        print('    return arpc::Status(arpc::StatusCode::UNIMPLEMENTED, "Operation not provided by this service");')
+        print('  }')
 
         for rpc in self._rpcs:
             print()
@@ -916,6 +1327,17 @@ ProtoFile = (
 )
 
 
+parser = argparse.ArgumentParser(
+    description='Convert a .proto file read from stdin to C++ bindings.')
+parser.add_argument(
+    '--borrow-fields', action='store_true',
+    help='Reference string and bytes fields from messages when building '
+         'them, instead of copying them. Messages must then remain valid '
+         'until they have been sent.')
+args = parser.parse_args()
+BUILD_STR = 'BuildBorrowedStr' if args.borrow_fields else 'BuildStr'
+BUILD_BINARY = 'BuildBorrowedBinary' if args.borrow_fields else 'BuildBinary'
+
 input_str = sys.stdin.read()
 input_sha256 = hashlib.sha256(input_str.encode('UTF-8')).hexdigest()
 declarations = pypeg2.parse(input_str, ProtoFile, comment=pypeg2.comment_cpp)
@@ -0,0 +1,81 @@
+// Copyright (c) 2017 Nuxi (https://nuxi.nl/) and contributors.
+//
+// SPDX-License-Identifier: BSD-2-Clause
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <new>
+#include <string_view>
+
+#include <arpc++/arpc++.h>
+
+#include "arena.h"
+
+using namespace arpc;
+
+Arena::~Arena() {
+  FreeChunks(chunk_);
+}
+
+void* Arena::Allocate(std::size_t size, std::size_t alignment) {
+  std::size_t padding =
+      -reinterpret_cast<std::uintptr_t>(position_) & (alignment - 1);
+  if (padding + size > std::size_t(end_ - position_)) {
+    // Start a new chunk that is large enough to hold the allocation.
+    // Chunks grow exponentially, so that large messages only need a
+    // small number of them.
+    std::size_t chunk_size =
+        std::max(next_chunk_size_, sizeof(Chunk) + alignment + size);
+    next_chunk_size_ = std::min(2 * next_chunk_size_, kMaxChunkSize);
+    Chunk* chunk = static_cast<Chunk*>(::operator new(chunk_size));
+    chunk->previous = chunk_;
+    chunk->size = chunk_size;
+    chunk_ = chunk;
+    position_ = reinterpret_cast<char*>(chunk + 1);
+    end_ = reinterpret_cast<char*>(chunk) + chunk_size;
+    padding = -reinterpret_cast<std::uintptr_t>(position_) & (alignment - 1);
+  }
+  void* result = position_ + padding;
+  position_ += padding + size;
+  return result;
+}
+
+std::string_view Arena::CopyString(std::string_view value) {
+  char* copy = static_cast<char*>(Allocate(value.size() + 1, 1));
+  if (!value.empty())
+    std::memcpy(copy, value.data(), value.size());
+  copy[value.size()] = '\0';
+  return std::string_view(copy, value.size());
+}
+
+void Arena::Reset() {
+  if (chunk_ == nullptr)
+    return;
+  if (chunk_->size > kMaxRetainedChunkSize) {
+    // Start over with chunks of the largest size that may be retained.
+    FreeChunks(chunk_);
+    chunk_ = nullptr;
+    position_ = nullptr;
+    end_ = nullptr;
+    next_chunk_size_ = std::min(next_chunk_size_, kMaxRetainedChunkSize);
+  } else {
+    FreeChunks(chunk_->previous);
+    chunk_->previous = nullptr;
+    position_ = reinterpret_cast<char*>(chunk_ + 1);
+  }
+}
+
+void* arpc::AllocateFromArena(Arena* arena, std::size_t size,
+                              std::size_t alignment) {
+  return arena->Allocate(size, alignment);
+}
+
+void Arena::FreeChunks(Chunk* chunk) {
+  while (chunk != nullptr) {
+    Chunk* previous = chunk->previous;
+    ::operator delete(chunk);
+    chunk = previous;
+  }
+}
@@ -0,0 +1,70 @@
+// Copyright (c) 2017 Nuxi (https://nuxi.nl/) and contributors.
+//
+// SPDX-License-Identifier: BSD-2-Clause
+
+#ifndef SRC_ARENA_H
+#define SRC_ARENA_H
+
+#include <cstddef>
+#include <string_view>
+
+#include <arpc++/arpc++.h>
+
+namespace arpc {
+
+// Bump allocator for objects that share the lifetime of a message being
+// built or parsed. Memory is handed out from large chunks, which are
+// only freed when the arena is destroyed or reset. Allocator can be
+// used to place standard containers in an arena. Memory released by
+// them is not reused.
+//
+// Reset() makes all memory available again, so that an arena can be
+// reused for the next message. It retains the most recently allocated
+// chunk, which is also the largest one, unless it exceeds
+// kMaxRetainedChunkSize. Memory needed by an exceptionally large
+// message is thus freed, instead of being held on to indefinitely.
+class Arena {
+ public:
+  template <typename T>
+  using Allocator = ArenaAllocator<T>;
+
+  Arena()
+      : chunk_(nullptr),
+        position_(nullptr),
+        end_(nullptr),
+        next_chunk_size_(kMinChunkSize) {
+  }
+  ~Arena();
+
+  static constexpr std::size_t kMaxRetainedChunkSize = 64 * 1024;
+
+  void* Allocate(std::size_t size, std::size_t alignment);
+  // Copies a string into the arena, adding a trailing null byte.
+  std::string_view CopyString(std::string_view value);
+  // Invalidates all memory allocated from the arena.
+  void Reset();
+
+ private:
+  static constexpr std::size_t kMinChunkSize = 1024;
+  static constexpr std::size_t kMaxChunkSize = 1024 * 1024;
+
+  // Header at the start of every chunk.
+  struct Chunk {
+    Chunk* previous;
+    std::size_t size;
+  };
+
+  static void FreeChunks(Chunk* chunk);
+
+  Chunk* chunk_;
+  char* position_;
+  char* end_;
+  std::size_t next_chunk_size_;
+
+  Arena(Arena const&) = delete;
+  void operator=(Arena const&) = delete;
+};
+
+}  // namespace arpc
+
+#endif
@@ -2,46 +2,285 @@
 //
 // SPDX-License-Identifier: BSD-2-Clause
 
+#include <cstdint>
 #include <memory>
 #include <string_view>
+#include <unordered_map>
+#include <utility>
 #include <vector>
 
 #include <arpc++/arpc++.h>
 #include <argdata.hpp>
 
+#include "arena.h"
+#include "file_descriptor_registry.h"
+
 using namespace arpc;
 
+namespace {
+
+constexpr std::uint8_t kTypeBinary = ArgdataSerializer::kTypeBinary;
+constexpr std::uint8_t kTypeMap = ArgdataSerializer::kTypeMap;
+constexpr std::uint8_t kTypeSeq = ArgdataSerializer::kTypeSeq;
+constexpr std::uint8_t kTypeStr = ArgdataSerializer::kTypeStr;
+
+void PutSubfieldLength(std::size_t length, std::vector<std::uint8_t>* buffer) {
+  std::size_t offset = buffer->size();
+  buffer->resize(offset + ArgdataSerializer::GetSubfieldLengthSize(length));
+  ArgdataSerializer::PutSubfieldLength(buffer->data() + offset, length);
+}
+
+}  // namespace
+
+// Nodes created by the builder, indexed by the argdata_t that
+// represents them, along with their serialized length once computed.
+struct ArgdataBuilder::GatherState {
+  std::unordered_map<const argdata_t*, std::pair<const Node*, std::size_t>>
+      nodes;
+  std::vector<std::uint8_t>* buffer;
+  std::vector<Reference>* references;
+};
+
+ArgdataBuilder::ArgdataBuilder(FileDescriptorRegistry* fd_registry)
+    : arena_(std::make_unique<Arena>()),
+      argdatas_(ArenaAllocator<std::unique_ptr<argdata_t>>(arena_.get())),
+      file_descriptors_(
+          ArenaAllocator<std::shared_ptr<FileDescriptor>>(arena_.get())),
+      nodes_(ArenaAllocator<Node>(arena_.get())),
+      fd_registry_(fd_registry),
+      has_references_(false),
+      field_numbers_(false),
+      messages_(ArenaAllocator<Message*>(arena_.get())) {
+}
+
+ArgdataBuilder::~ArgdataBuilder() {
+  DestroyMessages();
+}
+
+const argdata_t* ArgdataBuilder::BuildBinary(std::string_view value) {
+  if (value.size() >= kMinReferencedLength)
+    return BuildReference(kTypeBinary, value);
+  return BuildBorrowedBinary(arena_->CopyString(value));
+}
+
+const argdata_t* ArgdataBuilder::BuildBorrowedBinary(std::string_view value) {
+  if (value.size() >= kMinReferencedLength)
+    return BuildReference(kTypeBinary, value);
+  return argdatas_
+      .emplace_back(argdata_create_binary(value.data(), value.size()))
+      .get();
+}
+
+const argdata_t* ArgdataBuilder::BuildBorrowedStr(std::string_view value) {
+  if (value.size() >= kMinReferencedLength)
+    return BuildReference(kTypeStr, value);
+  return argdatas_.emplace_back(argdata_create_str(value.data(), value.size()))
+      .get();
+}
+
+const argdata_t* ArgdataBuilder::BuildByteStream(
+    const std::shared_ptr<ByteStream>& value) {
+  // Streams are attached as the read end of the pipe.
+  std::shared_ptr<FileDescriptor> pipe;
+  if (value->Open(&pipe) != 0)
+    return &argdata_null;
+  return BuildFd(pipe);
+}
+
 const argdata_t* ArgdataBuilder::BuildFd(
     const std::shared_ptr<FileDescriptor>& value) {
+  std::uint64_t handle;
+  if (fd_registry_ != nullptr && fd_registry_->Register(value, &handle))
+    return BuildInt(handle);
   return argdatas_
       .emplace_back(
           argdata_create_fd(file_descriptors_.emplace_back(value)->get()))
       .get();
 }
 
-const argdata_t* ArgdataBuilder::BuildMap(
-    std::vector<const argdata_t*> keys, std::vector<const argdata_t*> values) {
+const argdata_t* ArgdataBuilder::BuildFd(const FileDescriptorHandle& value) {
+  // Only shared file descriptors can be kept alive by the builder and
+  // stored in the registry. Other ones are owned by the message that
+  // is being built.
+  if (const std::shared_ptr<FileDescriptor>& shared = value.GetShared())
+    return BuildFd(shared);
+  return argdatas_.emplace_back(argdata_create_fd(value.get())).get();
+}
+
+const argdata_t* ArgdataBuilder::BuildMap(const Values& keys,
+                                          const Values& values) {
+  // The arrays are stored in the arena, meaning they remain valid after
+  // the Values objects are destroyed.
   std::size_t size = keys.size();
-  return argdatas_
-      .emplace_back(argdata_create_map(
-          vectors_.emplace_front(std::move(keys)).data(),
-          vectors_.emplace_front(std::move(values)).data(), size))
-      .get();
+  const argdata_t* ad =
+      argdatas_
+          .emplace_back(argdata_create_map(keys.data(), values.data(), size))
+          .get();
+  nodes_.push_back({ad, kTypeMap, keys.data(), values.data(), size, {}});
+  return ad;
 }
 
-const argdata_t* ArgdataBuilder::BuildSeq(
-    std::vector<const argdata_t*> elements) {
+const argdata_t* ArgdataBuilder::BuildMap(const argdata_t* const* keys,
+                                          const argdata_t* const* values,
+                                          std::size_t size) {
+  // Empty maps are shared, so that messages without any fields set
+  // can be built without allocating memory.
+  static const std::unique_ptr<argdata_t> empty_map(
+      argdata_create_map(nullptr, nullptr, 0));
+  if (size == 0)
+    return empty_map.get();
+  Values keys_copy = CreateValues(size);
+  keys_copy.assign(keys, keys + size);
+  Values values_copy = CreateValues(size);
+  values_copy.assign(values, values + size);
+  return BuildMap(keys_copy, values_copy);
+}
+
+const argdata_t* ArgdataBuilder::BuildMap(
+    std::initializer_list<const argdata_t*> keys,
+    std::initializer_list<const argdata_t*> values) {
+  Values keys_copy = CreateValues(keys.size());
+  keys_copy.assign(keys);
+  Values values_copy = CreateValues(values.size());
+  values_copy.assign(values);
+  return BuildMap(keys_copy, values_copy);
+}
+
+const argdata_t* ArgdataBuilder::BuildSeq(const Values& elements) {
   std::size_t size = elements.size();
-  return argdatas_
-      .emplace_back(argdata_create_seq(
-          vectors_.emplace_front(std::move(elements)).data(), size))
-      .get();
+  const argdata_t* ad =
+      argdatas_.emplace_back(argdata_create_seq(elements.data(), size)).get();
+  nodes_.push_back({ad, kTypeSeq, nullptr, elements.data(), size, {}});
+  return ad;
+}
+
+const argdata_t* ArgdataBuilder::BuildSeq(
+    std::initializer_list<const argdata_t*> elements) {
+  Values elements_copy = CreateValues(elements.size());
+  elements_copy.assign(elements);
+  return BuildSeq(elements_copy);
+}
+
+const argdata_t* ArgdataBuilder::BuildSharedBuffer(
+    const std::shared_ptr<SharedBuffer>& value) {
+  return BuildFd(value->GetFileDescriptor());
 }
 
 const argdata_t* ArgdataBuilder::BuildStr(std::string_view value) {
-  std::size_t size = value.size();
-  return argdatas_
-      .emplace_back(
-          argdata_create_str(strings_.emplace_front(value).data(), size))
-      .get();
+  if (value.size() >= kMinReferencedLength)
+    return BuildReference(kTypeStr, value);
+  return BuildBorrowedStr(arena_->CopyString(value));
+}
+
+void ArgdataBuilder::AttachFileDescriptorHandles(
+    arpc_protocol::ClientMessage* message) {
+  if (fd_registry_ != nullptr) {
+    fd_registry_->Attach(message);
+    fd_registry_ = nullptr;
+  }
+}
+
+void ArgdataBuilder::Reset() {
+  // The containers are stored in the arena, so they need to be replaced
+  // by empty ones before the arena is reset.
+  decltype(argdatas_)(argdatas_.get_allocator()).swap(argdatas_);
+  decltype(file_descriptors_)(file_descriptors_.get_allocator())
+      .swap(file_descriptors_);
+  decltype(nodes_)(nodes_.get_allocator()).swap(nodes_);
+  DestroyMessages();
+  arena_->Reset();
+  fd_registry_ = nullptr;
+  has_references_ = false;
+}
+
+void ArgdataBuilder::DestroyMessages() {
+  for (Message* message : messages_)
+    message->~Message();
+  decltype(messages_)(messages_.get_allocator()).swap(messages_);
+}
+
+const argdata_t* ArgdataBuilder::BuildReference(std::uint8_t type,
+                                                std::string_view value) {
+  const argdata_t* ad =
+      argdatas_
+          .emplace_back(type == kTypeStr
+                            ? argdata_create_str(value.data(), value.size())
+                            : argdata_create_binary(value.data(),
+                                                    value.size()))
+          .get();
+  nodes_.push_back({ad, type, nullptr, nullptr, 0, value});
+  has_references_ = true;
+  return ad;
+}
+
+void ArgdataBuilder::Gather(const argdata_t* ad,
+                            std::vector<std::uint8_t>* buffer,
+                            std::vector<Reference>* references) const {
+  GatherState state;
+  for (const Node& node : nodes_)
+    state.nodes.emplace(node.ad, std::make_pair(&node, 0));
+  state.buffer = buffer;
+  state.references = references;
+  GatherValue(ad, &state);
+}
+
+void ArgdataBuilder::GatherValue(const argdata_t* ad,
+                                 GatherState* state) const {
+  std::vector<std::uint8_t>* buffer = state->buffer;
+  auto found = state->nodes.find(ad);
+  if (found == state->nodes.end()) {
+    // Values that don't contain anything referenced can be serialized
+    // as is.
+    std::size_t offset = buffer->size();
+    buffer->resize(offset + GetSerializedLength(ad, state));
+    argdata_serialize(ad, buffer->data() + offset, nullptr);
+    return;
+  }
+
+  const Node& node = *found->second.first;
+  buffer->push_back(node.type);
+  if (node.type == kTypeMap || node.type == kTypeSeq) {
+    for (std::size_t i = 0; i < node.size; ++i) {
+      if (node.keys != nullptr) {
+        PutSubfieldLength(GetSerializedLength(node.keys[i], state), buffer);
+        GatherValue(node.keys[i], state);
+      }
+      PutSubfieldLength(GetSerializedLength(node.values[i], state), buffer);
+      GatherValue(node.values[i], state);
+    }
+  } else {
+    // Strings are followed by a null byte.
+    state->references->push_back({buffer->size(), node.data});
+    if (node.type == kTypeStr)
+      buffer->push_back(0);
+  }
+}
+
+std::size_t ArgdataBuilder::GetSerializedLength(const argdata_t* ad,
+                                                GatherState* state) const {
+  auto found = state->nodes.find(ad);
+  if (found == state->nodes.end()) {
+    std::size_t data_length, fds_length;
+    argdata_serialized_length(ad, &data_length, &fds_length);
+    return data_length;
+  }
+
+  // Compute the length of nodes only once, as they're visited both
+  // when computing the length of their parent and when serializing.
+  auto& [node, length] = found->second;
+  if (length == 0) {
+    length = 1;
+    if (node->type == kTypeMap || node->type == kTypeSeq) {
+      for (std::size_t i = 0; i < node->size; ++i) {
+        if (node->keys != nullptr)
+          length += ArgdataSerializer::GetSubfieldSize(
+              GetSerializedLength(node->keys[i], state));
+        length += ArgdataSerializer::GetSubfieldSize(
+            GetSerializedLength(node->values[i], state));
+      }
+    } else {
+      length += node->data.size() + (node->type == kTypeStr ? 1 : 0);
+    }
+  }
+  return length;
 }
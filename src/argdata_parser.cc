@@ -2,14 +2,43 @@
 //
 // SPDX-License-Identifier: BSD-2-Clause
 
+#include <algorithm>
+#include <cstdint>
 #include <cstdlib>
+#include <cstring>
+#include <forward_list>
+#include <memory>
+#include <string_view>
+#include <vector>
 
 #include <argdata.h>
 #include <arpc++/arpc++.h>
 
+#include "arena.h"
+#include "argdata_reader.h"
+#include "file_descriptor_registry.h"
+
 using namespace arpc;
 
-ArgdataParser::ArgdataParser(argdata_reader_t* reader) : reader_(reader) {
+struct ArgdataParser::State {
+  State()
+      : file_descriptors(Arena::Allocator<FileDescriptorHandle>(&arena)),
+        maps(Arena::Allocator<argdata_map_iterator_t>(&arena)) {
+  }
+
+  Arena arena;
+  std::vector<FileDescriptorHandle, Arena::Allocator<FileDescriptorHandle>>
+      file_descriptors;
+  std::forward_list<argdata_map_iterator_t,
+                    Arena::Allocator<argdata_map_iterator_t>>
+      maps;
+};
+
+ArgdataParser::ArgdataParser(ArgdataReader* reader,
+                             const BytesAllocator* bytes_allocator)
+    : reader_(reader),
+      bytes_allocator_(bytes_allocator),
+      ok_(true) {
 }
 
 ArgdataParser::~ArgdataParser() {
@@ -17,30 +46,105 @@ ArgdataParser::~ArgdataParser() {
   // messages containing them. Allow the reader to close any file
   // descriptors attached to the message, except those that have been
   // handed out by us.
-  if (reader_ != nullptr)
-    for (const auto& file_descriptor : file_descriptors_)
-      argdata_reader_release_fd(reader_, file_descriptor->get());
+  if (reader_ != nullptr && state_ != nullptr &&
+      !state_->file_descriptors.empty())
+    reader_->ReleaseFds(state_->file_descriptors.data(),
+                        state_->file_descriptors.size());
 }
 
 const argdata_t* ArgdataParser::ParseAnyFromMap(
     const argdata_map_iterator_t& it) {
   const argdata_t *key, *value;
-  if (!argdata_map_get(&maps_.emplace_front(it), &key, &value))
+  if (!argdata_map_get(&GetState()->maps.emplace_front(it), &key, &value))
     std::abort();
   return value;
 }
 
-std::shared_ptr<FileDescriptor> ArgdataParser::ParseFileDescriptor(
+std::shared_ptr<ByteStream> ArgdataParser::ParseByteStream(
     const argdata_t& ad) {
+  std::shared_ptr<FileDescriptor> pipe = ParseSharedFileDescriptor(ad);
+  if (!pipe)
+    return nullptr;
+  return ByteStream::FromPipe(pipe);
+}
+
+FileDescriptorHandle ArgdataParser::ParseFileDescriptor(const argdata_t& ad) {
   // Parse file descriptor object.
   int fd;
-  if (argdata_get_fd(&ad, &fd) != 0)
+  if (argdata_get_fd(&ad, &fd) == 0)
+    return *GetFileDescriptor(fd);
+
+  // File descriptors may also be referred to by handle. Handles that
+  // refer to empty slots can't be resolved.
+  FileDescriptorRegistry* fd_registry =
+      reader_ != nullptr ? reader_->GetFileDescriptorRegistry() : nullptr;
+  std::uint64_t handle;
+  if (fd_registry == nullptr || argdata_get_int(&ad, &handle) != 0)
+    return FileDescriptorHandle();
+  FileDescriptorHandle registered = fd_registry->Lookup(handle);
+  if (!registered)
+    ok_ = false;
+  return registered;
+}
+
+std::shared_ptr<SharedBuffer> ArgdataParser::ParseSharedBuffer(
+    const argdata_t& ad) {
+  std::shared_ptr<FileDescriptor> memfd = ParseSharedFileDescriptor(ad);
+  std::shared_ptr<SharedBuffer> buffer;
+  if (!memfd || SharedBuffer::FromFileDescriptor(memfd, &buffer) != 0)
     return nullptr;
+  return buffer;
+}
+
+FileDescriptorHandle* ArgdataParser::GetFileDescriptor(int fd) {
+  // Return the existing handle of the file descriptor. Create a new one
+  // if none exists. File descriptors are typically parsed in ascending
+  // order, so check the last one first.
+  auto& file_descriptors = GetState()->file_descriptors;
+  auto lookup = file_descriptors.end();
+  if (!file_descriptors.empty() && file_descriptors.back().get() >= fd)
+    lookup = std::lower_bound(
+        file_descriptors.begin(), file_descriptors.end(), fd,
+        [](const FileDescriptorHandle& a, int b) { return a.get() < b; });
+  if (lookup != file_descriptors.end() && lookup->get() == fd)
+    return &*lookup;
+  return &*file_descriptors.emplace(lookup, fd);
+}
+
+ArgdataParser::State* ArgdataParser::GetState() {
+  if (state_ == nullptr)
+    state_ = std::make_unique<State>();
+  return state_.get();
+}
+
+std::shared_ptr<FileDescriptor> ArgdataParser::ParseSharedFileDescriptor(
+    const argdata_t& ad) {
+  // Share our own handle of the file descriptor, so that it doesn't
+  // need to be duplicated if the argdata_t references it only once.
+  int fd;
+  FileDescriptorHandle registered;
+  FileDescriptorHandle* handle;
+  if (argdata_get_fd(&ad, &fd) == 0) {
+    handle = GetFileDescriptor(fd);
+  } else {
+    registered = ParseFileDescriptor(ad);
+    if (!registered)
+      return nullptr;
+    handle = &registered;
+  }
+  const std::shared_ptr<FileDescriptor>& shared = handle->Share();
+  if (!shared)
+    ok_ = false;
+  return shared;
+}
 
-  // Try to return an existing shared pointer instance. Create a new
-  // instance if none exists.
-  auto lookup = file_descriptors_.find(fd);
-  if (lookup != file_descriptors_.end())
-    return *lookup;
-  return *file_descriptors_.insert(std::make_shared<FileDescriptor>(fd)).first;
+bool ArgdataParser::ParseBytes(std::string_view field, const void* data,
+                               std::size_t size) {
+  if (bytes_allocator_ == nullptr)
+    return false;
+  void* buffer = (*bytes_allocator_)(field, size);
+  if (buffer == nullptr)
+    return false;
+  std::memcpy(buffer, data, size);
+  return true;
 }
@@ -0,0 +1,474 @@
+// Copyright (c) 2017 Nuxi (https://nuxi.nl/) and contributors.
+//
+// SPDX-License-Identifier: BSD-2-Clause
+
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+
+#if __has_include(<linux/kcmp.h>)
+#include <linux/kcmp.h>
+#endif
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+
+#include <argdata.h>
+#include <arpc++/arpc++.h>
+
+#include "argdata_reader.h"
+
+using namespace arpc;
+
+namespace {
+
+// Size of the header preceding every frame.
+constexpr std::size_t kHeaderLength = 8;
+
+// Size of the buffer allocated by readers in adaptive mode before any
+// messages have been received.
+constexpr std::size_t kInitialBufferSize = 4096;
+
+std::size_t RoundUpToPowerOfTwo(std::size_t size) {
+  std::size_t result = 1;
+  while (result < size)
+    result <<= 1;
+  return result;
+}
+
+std::size_t GetBigEndian32(const std::uint8_t* buf) {
+  return std::size_t(buf[0]) << 24 | std::size_t(buf[1]) << 16 |
+         std::size_t(buf[2]) << 8 | buf[3];
+}
+
+// Duplicates a file descriptor from the process referred to by a pidfd.
+int GetRemoteFd(int pidfd, int target_fd, int* fd) {
+#ifdef SYS_pidfd_getfd
+  int retval = syscall(SYS_pidfd_getfd, pidfd, target_fd, 0);
+  if (retval < 0)
+    return errno;
+  *fd = retval;
+  return 0;
+#else
+  return ENOSYS;
+#endif
+}
+
+}  // namespace
+
+ArgdataReader::ArgdataReader(std::size_t max_data_length, std::size_t max_fds,
+                             bool adaptive)
+    : max_data_length_(max_data_length),
+      max_fds_(max_fds),
+      adaptive_(adaptive),
+      packet_mode_(false),
+      buffer_size_(0),
+      begin_(0),
+      end_(0),
+      control_size_(CMSG_SPACE(std::min(max_fds, kMaxFdsPerWrite) *
+                               sizeof(int))),
+      receive_error_(0),
+      frame_length_(0),
+      mapping_(nullptr),
+      mapping_length_(0),
+      history_(),
+      history_index_(0) {
+  control_ = std::make_unique<char[]>(control_size_);
+  ResizeBuffer(adaptive_ ? std::min(kInitialBufferSize, kHeaderLength +
+                                                            max_data_length_)
+                         : kHeaderLength + max_data_length_);
+}
+
+ArgdataReader::~ArgdataReader() {
+  Discard();
+  for (int fd : queued_fds_)
+    close(fd);
+  for (int fd : continued_fds_)
+    close(fd);
+}
+
+bool ArgdataReader::IsPacketSocket(int fd) {
+  int type;
+  socklen_t length = sizeof(type);
+  return getsockopt(fd, SOL_SOCKET, SO_TYPE, &type, &length) == 0 &&
+         type == SOCK_SEQPACKET;
+}
+
+int ArgdataReader::SetPidfd(std::shared_ptr<FileDescriptor> pidfd,
+                            int probe_fd) {
+#if defined(SYS_kcmp) && __has_include(<linux/kcmp.h>)
+  // The probed file descriptor should be the pidfd itself. This proves
+  // that the pidfd refers to the peer, as opposed to some other process
+  // whose file descriptors the peer wants to get hold of.
+  int fd;
+  if (int error = GetRemoteFd(pidfd->get(), probe_fd, &fd); error != 0)
+    return error;
+  pid_t pid = getpid();
+  int retval = syscall(SYS_kcmp, pid, pid, KCMP_FILE, fd, pidfd->get());
+  int error = retval < 0 ? errno : retval != 0 ? EPERM : 0;
+  close(fd);
+  if (error == 0)
+    pidfd_ = std::move(pidfd);
+  return error;
+#else
+  return ENOSYS;
+#endif
+}
+
+void ArgdataReader::SetPacketMode() {
+  // Packets are consumed entirely before receiving the next one, so a
+  // buffer of the maximum packet size never needs to grow or shrink.
+  packet_mode_ = true;
+  ResizeBuffer(kMaxPacketLength);
+}
+
+int ArgdataReader::Pull(int fd) {
+  return PullFrame(fd, ReceiveMode::BLOCKING);
+}
+
+int ArgdataReader::TryPull(int fd) {
+  return PullFrame(fd, ReceiveMode::NONBLOCKING);
+}
+
+int ArgdataReader::PullBuffered() {
+  return PullFrame(-1, ReceiveMode::BUFFERED);
+}
+
+bool ArgdataReader::IsReadable() const {
+  if ((ring_ != nullptr && ring_->IsReadable()) || receive_error_ != 0)
+    return true;
+
+  // Check whether the buffer contains another frame, or at least a
+  // header that should be rejected.
+  std::size_t begin = begin_ + frame_length_;
+  std::size_t available = end_ - begin;
+  if (available < kHeaderLength)
+    return false;
+  std::size_t data_length = GetBigEndian32(&buffer_[begin]);
+  std::size_t fds_length = GetBigEndian32(&buffer_[begin + 4]);
+  return (fds_length & kSpilledFrame) != 0 ||
+         data_length > max_data_length_ ||
+         available >= kHeaderLength + data_length;
+}
+
+int ArgdataReader::PullFrame(int fd, ReceiveMode mode) {
+  Discard();
+
+  // Before waiting for the next message, shrink the buffer if it was
+  // only enlarged to hold the previous message. Buffers that are
+  // needed by the messages preceding it are retained, so that
+  // consistently large messages don't cause repeated allocations.
+  if (adaptive_ && !IsReceivingPackets() && begin_ == end_) {
+    std::size_t needed = kInitialBufferSize;
+    for (std::size_t i = 1; i < history_.size(); ++i)
+      needed = std::max(
+          needed,
+          history_[(history_index_ + history_.size() - i) % history_.size()]);
+    needed = std::min(RoundUpToPowerOfTwo(needed),
+                      kHeaderLength + max_data_length_);
+    if (buffer_size_ > needed)
+      ResizeBuffer(needed);
+  }
+
+  for (;;) {
+    // Return the next frame if it has been received completely.
+    std::size_t available = end_ - begin_;
+    std::size_t needed = kHeaderLength;
+    if (available >= kHeaderLength) {
+      std::size_t data_length = GetBigEndian32(&buffer_[begin_]);
+      std::size_t fds_length = GetBigEndian32(&buffer_[begin_ + 4]);
+      if ((fds_length & kContinuationFrame) != 0) {
+        // Hold back the file descriptors attached to continuation
+        // frames until the frame following them is parsed.
+        fds_length &= ~kContinuationFrame;
+        if (data_length != 0 || fds_length == 0 ||
+            (fds_length & kSpilledFrame) != 0)
+          return EBADMSG;
+        if (continued_fds_.size() + fds_length > max_fds_)
+          return EMSGSIZE;
+        if (queued_fds_.size() < fds_length)
+          return EBADMSG;
+        for (std::size_t i = 0; i < fds_length; ++i) {
+          continued_fds_.push_back(queued_fds_.front());
+          queued_fds_.pop_front();
+        }
+        begin_ += kHeaderLength;
+        if (begin_ == end_)
+          begin_ = end_ = 0;
+        continue;
+      }
+      // File descriptors of remote frames are duplicated from the peer.
+      std::size_t remote_fds = 0;
+      if ((fds_length & kRemoteFrame) != 0) {
+        remote_fds = fds_length & ~kRemoteFrame;
+        fds_length = 0;
+        if (pidfd_ == nullptr || (remote_fds & kSpilledFrame) != 0 ||
+            4 * remote_fds > data_length)
+          return EBADMSG;
+        if (remote_fds > max_fds_)
+          return EMSGSIZE;
+      }
+      bool spilled = (fds_length & kSpilledFrame) != 0;
+      if (spilled) {
+        // The data of the frame is stored in the last file descriptor.
+        fds_length &= ~kSpilledFrame;
+        if (fds_length == 0)
+          return EBADMSG;
+      } else {
+        needed += data_length;
+      }
+      if (data_length > max_data_length_ || fds_length > max_fds_ + spilled)
+        return EMSGSIZE;
+      if (continued_fds_.size() > fds_length)
+        return EBADMSG;
+      if (available >= needed) {
+        // File descriptors are attached to the start of the frame, so
+        // they must have been received along with it. When using the
+        // shared memory transport, they are received from the socket
+        // separately.
+        fds_length -= continued_fds_.size();
+        while (ring_ != nullptr && queued_fds_.size() < fds_length) {
+          std::uint8_t byte;
+          std::size_t received;
+          if (int error = ReceiveFromSocket(fd, &byte, 1, 0, &received);
+              error != 0)
+            return error;
+          if (received == 0)
+            break;
+        }
+        if (queued_fds_.size() < fds_length)
+          return EBADMSG;
+        for (int continued_fd : continued_fds_)
+          fds_.push_back({continued_fd, false});
+        continued_fds_.clear();
+        for (std::size_t i = 0; i < fds_length; ++i) {
+          fds_.push_back({queued_fds_.front(), false});
+          queued_fds_.pop_front();
+        }
+
+        frame_length_ = needed;
+        history_index_ = (history_index_ + 1) % history_.size();
+        history_[history_index_] = needed;
+        if (spilled) {
+          int error = MapSpilledFrame(fds_.back().fd, data_length);
+          close(fds_.back().fd);
+          fds_.pop_back();
+          if (error != 0)
+            return error;
+          root_.reset(argdata_from_buffer(mapping_, data_length, ConvertFd,
+                                          this));
+        } else {
+          const std::uint8_t* data = &buffer_[begin_ + kHeaderLength];
+          for (std::size_t i = 0; i < remote_fds; ++i) {
+            int fd;
+            if (int error = GetRemoteFd(
+                    pidfd_->get(), GetBigEndian32(&data[4 * i]), &fd);
+                error != 0)
+              return error;
+            fds_.push_back({fd, false});
+          }
+          root_.reset(argdata_from_buffer(&data[4 * remote_fds],
+                                          data_length - 4 * remote_fds,
+                                          ConvertFd, this));
+        }
+        return 0;
+      }
+    }
+
+    // Packets only contain complete frames, so any data that remains
+    // must be a truncated frame.
+    if (IsReceivingPackets()) {
+      if (available > 0)
+        return EBADMSG;
+    } else if (needed > buffer_size_) {
+      // Make room for the remainder of the frame, either by moving the
+      // data to the start of the buffer or by growing the buffer.
+      ResizeBuffer(std::min(RoundUpToPowerOfTwo(needed),
+                            kHeaderLength + max_data_length_));
+    } else if (needed > buffer_size_ - begin_) {
+      std::memmove(&buffer_[0], &buffer_[begin_], available);
+      begin_ = 0;
+      end_ = available;
+    }
+
+    // Read as much data as fits in the buffer. End-of-file is only
+    // permitted in between frames.
+    std::size_t received;
+    if (int error = Receive(fd, mode, &received); error != 0)
+      return error;
+    if (received == 0)
+      return available == 0 ? 0 : EBADMSG;
+    end_ += received;
+  }
+}
+
+void ArgdataReader::ReleaseFd(int fd) {
+  for (ReceivedFileDescriptor& received_fd : fds_)
+    if (received_fd.fd == fd)
+      received_fd.released = true;
+}
+
+void ArgdataReader::ReleaseFds(const FileDescriptorHandle* fds,
+                               std::size_t count) {
+  for (ReceivedFileDescriptor& received_fd : fds_) {
+    const FileDescriptorHandle* lookup = std::lower_bound(
+        fds, fds + count, received_fd.fd,
+        [](const FileDescriptorHandle& a, int b) { return a.get() < b; });
+    if (lookup != fds + count && lookup->get() == received_fd.fd)
+      received_fd.released = true;
+  }
+}
+
+int ArgdataReader::ConvertFd(void* arg, std::size_t index) {
+  const ArgdataReader* reader = static_cast<const ArgdataReader*>(arg);
+  return index < reader->fds_.size() ? reader->fds_[index].fd : -1;
+}
+
+void ArgdataReader::Discard() {
+  // Close all file descriptors that have not been handed out to
+  // messages containing them.
+  root_.reset();
+  for (const ReceivedFileDescriptor& received_fd : fds_)
+    if (!received_fd.released)
+      close(received_fd.fd);
+  fds_.clear();
+  if (mapping_ != nullptr) {
+    munmap(mapping_, mapping_length_);
+    mapping_ = nullptr;
+  }
+
+  // Consume the frame from the buffer.
+  begin_ += frame_length_;
+  frame_length_ = 0;
+  if (begin_ == end_)
+    begin_ = end_ = 0;
+}
+
+int ArgdataReader::MapSpilledFrame(int fd, std::size_t length) {
+#ifdef F_GET_SEALS
+  // Only accept memfds that are sealed, as the sender could otherwise
+  // modify the data while it's being parsed.
+  int seals = fcntl(fd, F_GET_SEALS);
+  if (seals < 0 || (seals & (F_SEAL_SHRINK | F_SEAL_WRITE)) !=
+                       (F_SEAL_SHRINK | F_SEAL_WRITE))
+    return EBADMSG;
+  struct stat sb;
+  if (fstat(fd, &sb) != 0)
+    return errno;
+  if (length == 0 || std::size_t(sb.st_size) < length)
+    return EBADMSG;
+
+  void* mapping = mmap(nullptr, length, PROT_READ, MAP_SHARED, fd, 0);
+  if (mapping == MAP_FAILED)
+    return errno;
+  mapping_ = mapping;
+  mapping_length_ = length;
+  return 0;
+#else
+  return ENOSYS;
+#endif
+}
+
+void ArgdataReader::ResizeBuffer(std::size_t size) {
+  // Move data that has not been consumed yet to the new buffer.
+  std::unique_ptr<std::uint8_t[]> buffer(new std::uint8_t[size]);
+  if (end_ > begin_)
+    std::memcpy(buffer.get(), &buffer_[begin_], end_ - begin_);
+  buffer_ = std::move(buffer);
+  buffer_size_ = size;
+  end_ -= begin_;
+  begin_ = 0;
+}
+
+void ArgdataReader::PrepareReceive(struct msghdr* msg, struct iovec* iov) {
+  *iov = {.iov_base = &buffer_[end_], .iov_len = buffer_size_ - end_};
+  *msg = {};
+  msg->msg_iov = iov;
+  msg->msg_iovlen = 1;
+  msg->msg_control = control_.get();
+  msg->msg_controllen = control_size_;
+}
+
+void ArgdataReader::CompleteReceive(const struct msghdr* msg, int result) {
+  if (result < 0) {
+    receive_error_ = -result;
+  } else if (result == 0) {
+    receive_error_ = -1;
+  } else {
+    receive_error_ = ExtractFds(msg);
+    end_ += result;
+  }
+  if (receive_error_ == 0 && (msg->msg_flags & MSG_TRUNC) != 0)
+    receive_error_ = EMSGSIZE;
+}
+
+int ArgdataReader::Receive(int fd, ReceiveMode mode, std::size_t* received) {
+  switch (mode) {
+    case ReceiveMode::BUFFERED:
+      // Report the outcome of the last receive performed externally.
+      if (receive_error_ > 0)
+        return receive_error_;
+      if (receive_error_ == 0 || ring_ != nullptr)
+        return EAGAIN;
+      *received = 0;
+      return 0;
+    case ReceiveMode::NONBLOCKING:
+      if (ring_ != nullptr)
+        return ring_->Read(fd, &buffer_[end_], buffer_size_ - end_, received,
+                           false);
+      return ReceiveFromSocket(fd, &buffer_[end_], buffer_size_ - end_,
+                               MSG_DONTWAIT, received);
+    default:
+      if (ring_ != nullptr)
+        return ring_->Read(fd, &buffer_[end_], buffer_size_ - end_, received);
+      return ReceiveFromSocket(fd, &buffer_[end_], buffer_size_ - end_, 0,
+                               received);
+  }
+}
+
+int ArgdataReader::ReceiveFromSocket(int fd, void* buf, std::size_t len,
+                                     int flags, std::size_t* received) {
+  struct iovec iov = {.iov_base = buf, .iov_len = len};
+  struct msghdr msg = {};
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control_.get();
+  msg.msg_controllen = control_size_;
+  ssize_t retval;
+  do {
+    retval = recvmsg(fd, &msg, MSG_CMSG_CLOEXEC | flags);
+  } while (retval < 0 && errno == EINTR);
+  if (retval < 0)
+    return errno;
+  if (int error = ExtractFds(&msg); error != 0)
+    return error;
+  // Packets exceeding the buffer are truncated by the kernel.
+  if ((msg.msg_flags & MSG_TRUNC) != 0)
+    return EMSGSIZE;
+  *received = retval;
+  return 0;
+}
+
+int ArgdataReader::ExtractFds(const struct msghdr* msg) {
+  for (struct cmsghdr* cmsg = CMSG_FIRSTHDR(msg); cmsg != nullptr;
+       cmsg = CMSG_NXTHDR(const_cast<struct msghdr*>(msg), cmsg)) {
+    if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+      std::size_t count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+      for (std::size_t i = 0; i < count; ++i) {
+        int received_fd;
+        std::memcpy(&received_fd, CMSG_DATA(cmsg) + i * sizeof(int),
+                    sizeof(int));
+        queued_fds_.push_back(received_fd);
+      }
+    }
+  }
+  return (msg->msg_flags & MSG_CTRUNC) != 0 ? EMSGSIZE : 0;
+}
@@ -0,0 +1,221 @@
+// Copyright (c) 2017 Nuxi (https://nuxi.nl/) and contributors.
+//
+// SPDX-License-Identifier: BSD-2-Clause
+
+#ifndef SRC_ARGDATA_READER_H
+#define SRC_ARGDATA_READER_H
+
+#include <sys/socket.h>
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <vector>
+
+#include <arpc++/arpc++.h>
+
+#include "file_descriptor_registry.h"
+#include "shared_memory_ring.h"
+
+namespace arpc {
+
+// Reader for messages received over a socket. Messages are expected to
+// be framed in the same way as done by argdata_writer_t and
+// ArgdataWriter: an eight-byte header containing the length of the data
+// and the number of file descriptors, followed by the serialized
+// argdata_t.
+//
+// Unlike argdata_reader_t, the size of the receive buffer is not fixed.
+// In adaptive mode the buffer starts out small and grows to fit the
+// frames that are actually received, up to the configured limit.
+// Buffers that have grown to accommodate a spike in message size are
+// shrunk again before waiting for the next message, so that idle
+// connections don't retain them.
+//
+// Data is read from the socket in chunks that may contain multiple
+// frames, so that streams of small messages don't require a system call
+// per message. File descriptors are queued in the order in which they
+// are received and handed out to frames as they are parsed.
+//
+// Frames may also be spilled, meaning that their data is not sent over
+// the socket, but stored in a sealed memfd that is attached as the last
+// file descriptor. The data of such frames is mapped into memory and
+// parsed in place.
+//
+// The kernel limits the number of file descriptors that can be attached
+// to a single write to kMaxFdsPerWrite. Frames carrying more file
+// descriptors are preceded by continuation frames, which have no data
+// and carry the excess file descriptors. These are held back until the
+// frame following them is parsed. The file descriptor count of that
+// frame includes the ones that were passed along with the continuation
+// frames.
+//
+// After switching to the shared memory transport, frames are read from
+// a SharedMemoryRing. The socket is then only used to receive file
+// descriptors, which are sent along with a single byte.
+//
+// In packet mode, used for SOCK_SEQPACKET sockets, every packet holds
+// one or more complete frames. Each packet is received by a single call
+// to recvmsg() into a fixed buffer of kMaxPacketLength bytes, meaning
+// that frames never have to be reassembled from partial reads.
+class ArgdataReader {
+ public:
+  // Flag set in the file descriptor count of spilled frames.
+  static constexpr std::uint32_t kSpilledFrame = 0x80000000;
+
+  // Flag set in the file descriptor count of continuation frames.
+  static constexpr std::uint32_t kContinuationFrame = 0x40000000;
+
+  // Flag set in the file descriptor count of remote frames. Instead of
+  // having file descriptors attached, the data of these frames starts
+  // with the numbers of the file descriptors in the sender's file
+  // descriptor table, stored as 32-bit big-endian integers. They are
+  // duplicated by the receiver through pidfd_getfd().
+  static constexpr std::uint32_t kRemoteFrame = 0x20000000;
+
+  // Largest number of file descriptors attached to a single write,
+  // being the limit imposed by the kernel (SCM_MAX_FD).
+  static constexpr std::size_t kMaxFdsPerWrite = 253;
+
+  // Largest packet sent and received in packet mode.
+  static constexpr std::size_t kMaxPacketLength = 64 * 1024;
+
+  // Returns whether a socket preserves the boundaries of the packets
+  // sent over it, meaning that packet mode should be used.
+  static bool IsPacketSocket(int fd);
+
+  ArgdataReader(std::size_t max_data_length, std::size_t max_fds,
+                bool adaptive);
+  ~ArgdataReader();
+
+  const argdata_t* Get() const {
+    return root_.get();
+  }
+
+  int Pull(int fd);
+  void ReleaseFd(int fd);
+  // Marks multiple file descriptors as handed out at once. The file
+  // descriptors must be sorted by number.
+  void ReleaseFds(const FileDescriptorHandle* fds, std::size_t count);
+
+  // Non-blocking variant of Pull(), returning EAGAIN if no complete
+  // frame is available yet.
+  int TryPull(int fd);
+
+  // Returns whether TryPull() may make progress without the socket
+  // becoming readable, as data has already been received.
+  bool IsReadable() const;
+
+  // Functions for receiving data from the socket externally, e.g. using
+  // io_uring. PullBuffered() only parses frames that have already been
+  // received, returning EAGAIN if there are none. After that, the buffer
+  // may not be accessed until the recvmsg() call set up by
+  // PrepareReceive() has completed and its result has been passed to
+  // CompleteReceive(). End-of-file and errors are reported by the next
+  // call to PullBuffered().
+  int PullBuffered();
+  void PrepareReceive(struct msghdr* msg, struct iovec* iov);
+  void CompleteReceive(const struct msghdr* msg, int result);
+
+  void SetSharedMemory(std::unique_ptr<SharedMemoryRing> ring) {
+    ring_ = std::move(ring);
+  }
+  SharedMemoryRing* GetSharedMemory() {
+    return ring_.get();
+  }
+
+  // Registry used to resolve file descriptors that are referred to by
+  // handle, if negotiated.
+  void SetFileDescriptorRegistry(
+      std::unique_ptr<FileDescriptorRegistry> registry) {
+    fd_registry_ = std::move(registry);
+  }
+  FileDescriptorRegistry* GetFileDescriptorRegistry() {
+    return fd_registry_.get();
+  }
+
+  // Allows receiving remote frames, whose file descriptors are
+  // duplicated from the process referred to by a pidfd. Fails if the
+  // kernel or the permissions of the process don't allow this, tested
+  // by duplicating one of its file descriptors.
+  int SetPidfd(std::shared_ptr<FileDescriptor> pidfd, int probe_fd);
+
+  void SetPacketMode();
+
+ private:
+  struct ReceivedFileDescriptor {
+    int fd;
+    bool released;
+  };
+
+  enum class ReceiveMode {
+    BLOCKING,
+    NONBLOCKING,
+    BUFFERED,
+  };
+
+  static int ConvertFd(void* arg, std::size_t index);
+
+  void Discard();
+  int ExtractFds(const struct msghdr* msg);
+  int MapSpilledFrame(int fd, std::size_t length);
+  int PullFrame(int fd, ReceiveMode mode);
+  void ResizeBuffer(std::size_t size);
+  int Receive(int fd, ReceiveMode mode, std::size_t* received);
+  int ReceiveFromSocket(int fd, void* buf, std::size_t len, int flags,
+                        std::size_t* received);
+
+  // Frames are no longer received as packets after switching to the
+  // shared memory transport.
+  bool IsReceivingPackets() const {
+    return packet_mode_ && ring_ == nullptr;
+  }
+
+  const std::size_t max_data_length_;
+  const std::size_t max_fds_;
+  const bool adaptive_;
+  bool packet_mode_;
+
+  // Data received from the socket. The range [begin_, end_) contains
+  // data that has not been consumed yet, starting with the frame that
+  // is currently being parsed, if any.
+  std::unique_ptr<std::uint8_t[]> buffer_;
+  std::size_t buffer_size_;
+  std::size_t begin_;
+  std::size_t end_;
+  std::unique_ptr<char[]> control_;
+  std::size_t control_size_;
+  std::deque<int> queued_fds_;
+  std::unique_ptr<SharedMemoryRing> ring_;
+
+  // File descriptors received through continuation frames, belonging
+  // to the next frame.
+  std::vector<int> continued_fds_;
+  std::unique_ptr<FileDescriptorRegistry> fd_registry_;
+  std::shared_ptr<FileDescriptor> pidfd_;
+
+  // Outcome of the last receive performed externally, being either an
+  // error, end-of-file (-1) or zero.
+  int receive_error_;
+
+  // Frame that is currently being parsed.
+  std::size_t frame_length_;
+  std::vector<ReceivedFileDescriptor> fds_;
+  void* mapping_;
+  std::size_t mapping_length_;
+  std::unique_ptr<argdata_t> root_;
+
+  // Lengths of the most recently received messages, used to determine
+  // whether the buffer may be shrunk.
+  std::array<std::size_t, 8> history_;
+  std::size_t history_index_;
+
+  ArgdataReader(ArgdataReader const&) = delete;
+  void operator=(ArgdataReader const&) = delete;
+};
+
+}  // namespace arpc
+
+#endif
@@ -0,0 +1,176 @@
+// Copyright (c) 2017 Nuxi (https://nuxi.nl/) and contributors.
+//
+// SPDX-License-Identifier: BSD-2-Clause
+
+#include <cassert>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <string_view>
+
+#include <argdata.h>
+#include <arpc++/arpc++.h>
+
+using namespace arpc;
+
+std::size_t ArgdataSerializer::GetArgdataSize(const argdata_t* value) {
+  // File descriptors would need to be renumbered, which can't be done
+  // without parsing the serialized value.
+  std::size_t length, fds_length;
+  argdata_serialized_length(value, &length, &fds_length);
+  if (fds_length > 0)
+    ok_ = false;
+  SetSize(ReserveSize(), length);
+  return length;
+}
+
+std::size_t ArgdataSerializer::GetMessageSize(const Message& value) {
+  std::size_t slot = ReserveSize();
+  std::size_t size = value.ByteSize(this);
+  SetSize(slot, size);
+  return size;
+}
+
+std::size_t ArgdataSerializer::GetSubfieldLengthSize(std::size_t length) {
+  std::size_t size = 1;
+  while ((length >>= 7) > 0)
+    ++size;
+  return size;
+}
+
+std::uint8_t* ArgdataSerializer::PutSubfieldLength(std::uint8_t* out,
+                                                   std::size_t length) {
+  for (std::size_t i = GetSubfieldLengthSize(length) - 1; i > 0; --i)
+    *out++ = (length >> (i * 7)) & 0x7f;
+  *out++ = (length & 0x7f) | 0x80;
+  return out;
+}
+
+std::uint8_t* ArgdataSerializer::PutArgdata(std::uint8_t* out,
+                                            const argdata_t* value,
+                                            std::size_t length) const {
+  argdata_serialize(value, out, nullptr);
+  return out + length;
+}
+
+std::uint8_t* ArgdataSerializer::PutBinary(std::uint8_t* out,
+                                           std::string_view value) const {
+  *out++ = kTypeBinary;
+  return PutBytes(out, value);
+}
+
+std::uint8_t* ArgdataSerializer::PutBool(std::uint8_t* out,
+                                         bool value) const {
+  *out++ = kTypeBool;
+  if (value)
+    *out++ = 1;
+  return out;
+}
+
+std::uint8_t* ArgdataSerializer::PutByteStream(
+    std::uint8_t* out, const std::shared_ptr<ByteStream>& value) {
+  // Streams are attached as the read end of the pipe. Opening the
+  // stream starts feeding it, so only do this once the message is
+  // actually serialized.
+  std::shared_ptr<FileDescriptor> pipe;
+  if (value->Open(&pipe) != 0) {
+    ok_ = false;
+    return out + kFdSize;
+  }
+  return PutFdIndex(out, pipe->get());
+}
+
+std::uint8_t* ArgdataSerializer::PutBytes(std::uint8_t* out,
+                                          std::string_view value) const {
+  std::memcpy(out, value.data(), value.size());
+  return out + value.size();
+}
+
+std::uint8_t* ArgdataSerializer::PutFd(std::uint8_t* out,
+                                       const FileDescriptorHandle& value) {
+  return PutFdIndex(out, value.get());
+}
+
+std::uint8_t* ArgdataSerializer::PutFdIndex(std::uint8_t* out, int fd) {
+  // File descriptors are only added to the side array once. Look them
+  // up in a hash table that has at least twice as many buckets as the
+  // number of file descriptors counted while computing the length.
+  constexpr std::uint32_t kNoIndex = UINT32_MAX;
+  if (fds_.empty()) {
+    std::size_t buckets = 1;
+    while (buckets < 2 * fd_count_)
+      buckets <<= 1;
+    fd_indices_.assign(buckets, kNoIndex);
+  }
+  assert(fds_.size() < fd_indices_.size() &&
+         "File descriptor was not counted while computing the length");
+  std::size_t mask = fd_indices_.size() - 1;
+  std::size_t bucket = fd & mask;
+  while (fd_indices_[bucket] != kNoIndex && fds_[fd_indices_[bucket]] != fd)
+    bucket = (bucket + 1) & mask;
+  std::uint32_t index = fd_indices_[bucket];
+  if (index == kNoIndex) {
+    index = fd_indices_[bucket] = fds_.size();
+    fds_.push_back(fd);
+  }
+
+  *out++ = kTypeFd;
+  *out++ = index >> 24;
+  *out++ = index >> 16;
+  *out++ = index >> 8;
+  *out++ = index;
+  return out;
+}
+
+std::uint8_t* ArgdataSerializer::PutSharedBuffer(
+    std::uint8_t* out, const std::shared_ptr<SharedBuffer>& value) {
+  return PutFdIndex(out, value->GetFileDescriptor()->get());
+}
+
+std::uint8_t* ArgdataSerializer::PutStr(std::uint8_t* out,
+                                        std::string_view value) const {
+  *out++ = kTypeStr;
+  out = PutBytes(out, value);
+  *out++ = 0;
+  return out;
+}
+
+// Integers are stored as big-endian two's complement numbers of minimal
+// length. Zero is stored without any digits.
+std::size_t ArgdataSerializer::GetSignedIntSize(std::intmax_t value) {
+  std::size_t size = 1;
+  if (value != 0) {
+    ++size;
+    for (; value < -128 || value > 127; value >>= 8)
+      ++size;
+  }
+  return size;
+}
+
+std::size_t ArgdataSerializer::GetUnsignedIntSize(std::uintmax_t value) {
+  std::size_t size = 1;
+  if (value != 0) {
+    ++size;
+    for (; value > 127; value >>= 8)
+      ++size;
+  }
+  return size;
+}
+
+std::uint8_t* ArgdataSerializer::PutSignedInt(std::uint8_t* out,
+                                              std::intmax_t value) {
+  *out++ = kTypeInt;
+  for (std::size_t i = GetSignedIntSize(value) - 1; i > 0; --i)
+    *out++ = value >> ((i - 1) * 8);
+  return out;
+}
+
+std::uint8_t* ArgdataSerializer::PutUnsignedInt(std::uint8_t* out,
+                                                std::uintmax_t value) {
+  // Values with the top bit set are preceded by a zero byte, which lies
+  // beyond the width of the value.
+  *out++ = kTypeInt;
+  for (std::size_t i = GetUnsignedIntSize(value) - 1; i > 0; --i)
+    *out++ = i > sizeof(value) ? 0 : value >> ((i - 1) * 8);
+  return out;
+}
@@ -0,0 +1,412 @@
+// Copyright (c) 2017 Nuxi (https://nuxi.nl/) and contributors.
+//
+// SPDX-License-Identifier: BSD-2-Clause
+
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cassert>
+#include <cerrno>
+#include <chrono>
+#include <climits>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <vector>
+
+#include <argdata.h>
+#include <arpc++/arpc++.h>
+
+#include "argdata_reader.h"
+#include "argdata_writer.h"
+
+using namespace arpc;
+
+namespace {
+
+void PutBigEndian32(std::uint8_t* buf, std::size_t value) {
+  buf[0] = value >> 24;
+  buf[1] = value >> 16;
+  buf[2] = value >> 8;
+  buf[3] = value;
+}
+
+}  // namespace
+
+ArgdataWriter::ArgdataWriter(std::size_t max_corked_bytes,
+                             std::size_t max_corked_messages,
+                             std::chrono::microseconds max_corked_delay,
+                             std::size_t spill_threshold)
+    : max_corked_bytes_(max_corked_bytes),
+      max_corked_messages_(max_corked_messages),
+      max_corked_delay_(max_corked_delay),
+      spill_threshold_(spill_threshold),
+      packet_mode_(false),
+      pidfd_threshold_(0),
+      messages_(0) {
+}
+
+int ArgdataWriter::Push(int fd, const argdata_t* ad, bool corked) {
+  return PushFrame(fd, ad, nullptr, corked, false);
+}
+
+int ArgdataWriter::Push(int fd, const argdata_t* ad,
+                        const ArgdataBuilder& builder, bool corked) {
+  return PushFrame(fd, ad, &builder, corked, false);
+}
+
+int ArgdataWriter::PushUnaryRequest(int fd, const argdata_t* ad,
+                                    const ArgdataBuilder& builder) {
+  return PushFrame(fd, ad, &builder, false, true);
+}
+
+int ArgdataWriter::Push(int fd, const Message& message,
+                        ArgdataBuilder* builder, bool corked) {
+  return PushMessage(fd, message, builder, corked, false);
+}
+
+int ArgdataWriter::PushUnaryRequest(int fd, const Message& message,
+                                    ArgdataBuilder* builder) {
+  return PushMessage(fd, message, builder, false, true);
+}
+
+int ArgdataWriter::PushFrame(int fd, const argdata_t* ad,
+                             const ArgdataBuilder* builder, bool corked,
+                             bool unary_request) {
+  std::size_t data_length, fds_length;
+  argdata_serialized_length(ad, &data_length, &fds_length);
+  // Remote frames are prefixed by the numbers of their file descriptors.
+  bool remote = unary_request && pidfd_threshold_ > 0 &&
+                fds_length >= pidfd_threshold_;
+  std::size_t frame_length = 8 + data_length + (remote ? 4 * fds_length : 0);
+  bool sending_packets = packet_mode_ && ring_ == nullptr;
+  bool exceeds_packet = frame_length > ArgdataReader::kMaxPacketLength;
+#ifdef MFD_ALLOW_SEALING
+  if ((spill_threshold_ > 0 && data_length >= spill_threshold_) ||
+      (sending_packets && exceeds_packet))
+    return PushSpilled(fd, ad, data_length, fds_length);
+#else
+  if (sending_packets && exceeds_packet)
+    return EMSGSIZE;
+#endif
+
+  if (int error = PrepareFrame(fd, frame_length, fds_length > 0 && !remote,
+                               &corked);
+      error != 0)
+    return error;
+
+  // Data referenced by the builder can only be sent without copying it
+  // if the frame is sent right away, as it's owned by the caller.
+  if (builder != nullptr && builder->HasReferences() && !corked &&
+      fds_length == 0 && ring_ == nullptr)
+    return PushGathered(fd, ad, *builder, data_length);
+
+  // Append the frame to the send buffer.
+  std::size_t offset = buffer_.size();
+  buffer_.resize(offset + frame_length);
+  if (remote) {
+    std::vector<int> fds(fds_length);
+    PutBigEndian32(&buffer_[offset], 4 * fds_length + data_length);
+    PutBigEndian32(&buffer_[offset + 4],
+                   fds_length | ArgdataReader::kRemoteFrame);
+    argdata_serialize(ad, &buffer_[offset + 8 + 4 * fds_length], fds.data());
+    for (std::size_t i = 0; i < fds_length; ++i)
+      PutBigEndian32(&buffer_[offset + 8 + 4 * i], fds[i]);
+  } else {
+    PutBigEndian32(&buffer_[offset], data_length);
+    PutBigEndian32(&buffer_[offset + 4], fds_length);
+    fds_.resize(fds_length);
+    argdata_serialize(ad, &buffer_[offset + 8], fds_.data());
+  }
+  return FinishFrame(fd, corked);
+}
+
+int ArgdataWriter::PushMessage(int fd, const Message& message,
+                               ArgdataBuilder* builder, bool corked,
+                               bool unary_request) {
+  // Spilling the message, sending it as a remote frame and sending
+  // referenced data without copying it all depend on it being built.
+  // Messages of which the data could be referenced are also built, as
+  // copying their data would be more expensive than building them.
+  // The number of file descriptors is only known after serializing.
+  // Use the number of references to them as an upper bound until then.
+  serializer_.Reset(builder->UsesFieldNumbers());
+  std::size_t data_length = message.ByteSize(&serializer_);
+  std::size_t fd_count = serializer_.GetFileDescriptorCount();
+  if (!serializer_.ok() ||
+      data_length >= ArgdataBuilder::kMinReferencedLength ||
+      (spill_threshold_ > 0 && data_length >= spill_threshold_) ||
+      (unary_request && pidfd_threshold_ > 0 && fd_count >= pidfd_threshold_))
+    return PushFrame(fd, message.Build(builder), builder, corked,
+                     unary_request);
+
+  std::size_t frame_length = 8 + data_length;
+  if (int error = PrepareFrame(fd, frame_length, fd_count > 0, &corked);
+      error != 0)
+    return error;
+
+  // Serialize the message straight into the send buffer. Build it
+  // instead if this fails, e.g. because a byte stream can't be opened.
+  std::size_t offset = buffer_.size();
+  buffer_.resize(offset + frame_length);
+  [[maybe_unused]] std::uint8_t* end =
+      message.SerializeTo(&buffer_[offset + 8], &serializer_);
+  assert(end == buffer_.data() + buffer_.size() &&
+         "Serialized message does not match its computed length");
+  if (!serializer_.ok()) {
+    buffer_.resize(offset);
+    return PushFrame(fd, message.Build(builder), builder, corked,
+                     unary_request);
+  }
+  const std::vector<int>& fds = serializer_.GetFileDescriptors();
+  PutBigEndian32(&buffer_[offset], data_length);
+  PutBigEndian32(&buffer_[offset + 4], fds.size());
+  fds_.assign(fds.begin(), fds.end());
+  return FinishFrame(fd, corked);
+}
+
+int ArgdataWriter::PrepareFrame(int fd, std::size_t frame_length,
+                                bool has_fds, bool* corked) {
+  // Frames may not be split up across packets.
+  if (packet_mode_ && ring_ == nullptr &&
+      buffer_.size() + frame_length > ArgdataReader::kMaxPacketLength) {
+    if (int error = Flush(fd); error != 0)
+      return error;
+  }
+
+  // File descriptors need to be attached to the first frame of a write.
+  // As they are owned by the message, they also cannot be held back.
+  if (has_fds) {
+    if (int error = Flush(fd); error != 0)
+      return error;
+    *corked = false;
+  }
+  return 0;
+}
+
+int ArgdataWriter::FinishFrame(int fd, bool corked) {
+  if (!corked)
+    return Flush(fd);
+  auto now = std::chrono::steady_clock::now();
+  if (messages_++ == 0)
+    first_corked_ = now;
+  if (buffer_.size() >= max_corked_bytes_ ||
+      messages_ >= max_corked_messages_ ||
+      now - first_corked_ >= max_corked_delay_)
+    return Flush(fd);
+  return 0;
+}
+
+int ArgdataWriter::Flush(int fd) {
+  if (buffer_.empty())
+    return 0;
+
+  int error = 0;
+  if (ring_ == nullptr) {
+    error = SendContinuationFrames(fd);
+    if (error == 0)
+      error = SendToSocket(fd, buffer_.data(), buffer_.size(), fds_.data(),
+                           fds_.size());
+  } else {
+    // File descriptors cannot be passed through the ring buffer. Send
+    // them over the socket with a single byte of data before writing
+    // the frame, so that they're available once the frame is read.
+    static const std::uint8_t byte = 0;
+    for (std::size_t i = 0; i < fds_.size() && error == 0;
+         i += ArgdataReader::kMaxFdsPerWrite)
+      error = SendToSocket(
+          fd, &byte, 1, &fds_[i],
+          std::min(fds_.size() - i, ArgdataReader::kMaxFdsPerWrite));
+    if (error == 0)
+      error = ring_->Write(fd, buffer_.data(), buffer_.size());
+  }
+
+  Clear();
+  return error;
+}
+
+bool ArgdataWriter::PrepareFlush(struct msghdr* msg, struct iovec* iov) {
+  // File descriptors are owned by the messages, which may be destroyed
+  // before the call completes.
+  if (buffer_.empty() || !fds_.empty() || ring_ != nullptr)
+    return false;
+  *iov = {.iov_base = buffer_.data(), .iov_len = buffer_.size()};
+  *msg = {};
+  msg->msg_iov = iov;
+  msg->msg_iovlen = 1;
+  return true;
+}
+
+int ArgdataWriter::CompleteFlush(int result) {
+  // Retain the remainder of the data if the write was short, as
+  // writing it synchronously may block.
+  if (result >= 0 && std::size_t(result) < buffer_.size()) {
+    buffer_.erase(buffer_.begin(), buffer_.begin() + result);
+    return 0;
+  }
+  Clear();
+  return result < 0 ? -result : 0;
+}
+
+int ArgdataWriter::PushGathered(int fd, const argdata_t* ad,
+                                const ArgdataBuilder& builder,
+                                std::size_t data_length) {
+  // Append the frame to the send buffer, except for the referenced
+  // data. Corked frames preceding it are sent along with it.
+  std::size_t offset = buffer_.size();
+  buffer_.resize(offset + 8);
+  PutBigEndian32(&buffer_[offset], data_length);
+  PutBigEndian32(&buffer_[offset + 4], 0);
+  std::vector<ArgdataBuilder::Reference> references;
+  builder.Gather(ad, &buffer_, &references);
+
+  // Interleave the send buffer with the referenced data.
+  std::vector<struct iovec> iov;
+  iov.reserve(2 * references.size() + 1);
+  std::size_t position = 0;
+  std::size_t referenced_length = 0;
+  for (const ArgdataBuilder::Reference& reference : references) {
+    iov.push_back({.iov_base = &buffer_[position],
+                   .iov_len = reference.offset - position});
+    iov.push_back(
+        {.iov_base = const_cast<char*>(reference.data.data()),
+         .iov_len = reference.data.size()});
+    position = reference.offset;
+    referenced_length += reference.data.size();
+  }
+  iov.push_back({.iov_base = &buffer_[position],
+                 .iov_len = buffer_.size() - position});
+  assert(buffer_.size() - offset - 8 + referenced_length == data_length &&
+         "Gathered frame does not match its serialized length");
+
+  int error = SendToSocket(fd, iov.data(), iov.size());
+  Clear();
+  return error;
+}
+
+int ArgdataWriter::SendContinuationFrames(int fd) {
+  // Send all file descriptors except for the last batch along with
+  // continuation frames. The last batch is sent with the frame itself.
+  const std::size_t batch = ArgdataReader::kMaxFdsPerWrite;
+  std::size_t continued = fds_.empty() ? 0 : (fds_.size() - 1) / batch * batch;
+  for (std::size_t i = 0; i < continued; i += batch) {
+    std::uint8_t header[8];
+    PutBigEndian32(&header[0], 0);
+    PutBigEndian32(&header[4], batch | ArgdataReader::kContinuationFrame);
+    if (int error = SendToSocket(fd, header, sizeof(header), &fds_[i], batch);
+        error != 0)
+      return error;
+  }
+  fds_.erase(fds_.begin(), fds_.begin() + continued);
+  return 0;
+}
+
+void ArgdataWriter::Clear() {
+  // Only retain buffers that are needed for corking, as opposed to
+  // buffers that have been enlarged to hold a single large message.
+  if (buffer_.capacity() > 2 * max_corked_bytes_)
+    std::vector<std::uint8_t>().swap(buffer_);
+  else
+    buffer_.clear();
+  fds_.clear();
+  messages_ = 0;
+}
+
+int ArgdataWriter::SendToSocket(int fd, const void* buf, std::size_t len,
+                                const int* fds, std::size_t fds_length) {
+  struct iovec iov = {.iov_base = const_cast<void*>(buf), .iov_len = len};
+  return SendToSocket(fd, &iov, 1, fds, fds_length);
+}
+
+int ArgdataWriter::SendToSocket(int fd, struct iovec* iov, std::size_t iovcnt,
+                                const int* fds, std::size_t fds_length) {
+  bool first = true;
+  for (;;) {
+    // Skip over the parts that have been written entirely.
+    while (iovcnt > 0 && iov->iov_len == 0) {
+      ++iov;
+      --iovcnt;
+    }
+    if (iovcnt == 0)
+      return 0;
+
+    struct msghdr msg = {};
+    msg.msg_iov = iov;
+    msg.msg_iovlen = std::min(iovcnt, std::size_t(IOV_MAX));
+
+    // Attach file descriptors to the first call to sendmsg().
+    std::unique_ptr<char[]> control;
+    if (first && fds_length > 0) {
+      std::size_t control_size = CMSG_SPACE(fds_length * sizeof(int));
+      control = std::make_unique<char[]>(control_size);
+      msg.msg_control = control.get();
+      msg.msg_controllen = control_size;
+      struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+      cmsg->cmsg_level = SOL_SOCKET;
+      cmsg->cmsg_type = SCM_RIGHTS;
+      cmsg->cmsg_len = CMSG_LEN(fds_length * sizeof(int));
+      std::memcpy(CMSG_DATA(cmsg), fds, fds_length * sizeof(int));
+    }
+
+    ssize_t retval = sendmsg(fd, &msg, MSG_NOSIGNAL);
+    if (retval < 0) {
+      if (errno == EINTR)
+        continue;
+      return errno;
+    }
+    first = false;
+
+    std::size_t written = retval;
+    for (; written > iov->iov_len; ++iov, --iovcnt)
+      written -= iov->iov_len;
+    iov->iov_base = static_cast<char*>(iov->iov_base) + written;
+    iov->iov_len -= written;
+  }
+}
+
+#ifdef MFD_ALLOW_SEALING
+int ArgdataWriter::PushSpilled(int fd, const argdata_t* ad,
+                               std::size_t data_length,
+                               std::size_t fds_length) {
+  if (int error = Flush(fd); error != 0)
+    return error;
+
+  // Serialize the message into a memfd. Seal it, so that the receiver
+  // can safely parse it in place.
+  int memfd = memfd_create("arpc", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+  if (memfd < 0)
+    return errno;
+  fds_.resize(fds_length);
+  void* data;
+  if (ftruncate(memfd, data_length) != 0 ||
+      (data = mmap(nullptr, data_length, PROT_READ | PROT_WRITE, MAP_SHARED,
+                   memfd, 0)) == MAP_FAILED) {
+    int error = errno;
+    close(memfd);
+    return error;
+  }
+  argdata_serialize(ad, data, fds_.data());
+  munmap(data, data_length);
+  if (fcntl(memfd, F_ADD_SEALS,
+            F_SEAL_SEAL | F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE) != 0) {
+    int error = errno;
+    close(memfd);
+    return error;
+  }
+
+  // Send a frame without any data, having the memfd attached as the
+  // last file descriptor.
+  fds_.push_back(memfd);
+  buffer_.resize(8);
+  PutBigEndian32(&buffer_[0], data_length);
+  PutBigEndian32(&buffer_[4], (fds_length + 1) | ArgdataReader::kSpilledFrame);
+  int error = Flush(fd);
+  close(memfd);
+  return error;
+}
+#endif
@@ -0,0 +1,150 @@
+// Copyright (c) 2017 Nuxi (https://nuxi.nl/) and contributors.
+//
+// SPDX-License-Identifier: BSD-2-Clause
+
+#ifndef SRC_ARGDATA_WRITER_H
+#define SRC_ARGDATA_WRITER_H
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include <arpc++/arpc++.h>
+
+#include "shared_memory_ring.h"
+
+namespace arpc {
+
+// Writer for messages sent over a socket, using the same framing as
+// ArgdataReader. Messages may be corked, meaning that they are
+// collected in a send buffer and sent together with the messages
+// following them. The send buffer is flushed as soon as an uncorked
+// message is written, when it exceeds the configured number of bytes or
+// messages, or when its oldest message has been corked for longer than
+// the configured delay. The delay is only checked when writing, not by
+// a timer. Clients and servers flush corked messages before waiting for
+// their peer, but writers that go idle otherwise should call Flush().
+//
+// The receiving side associates file descriptors with the frame at the
+// start of a write. Frames carrying file descriptors are therefore
+// never corked, nor are they placed behind other corked frames.
+//
+// Messages whose serialized size reaches the spill threshold are
+// written into a sealed memfd instead, which is sent along with the
+// frame, so that their data doesn't need to be copied through the
+// socket. Spilling is disabled if the threshold is zero.
+//
+// After switching to the shared memory transport, frames are written
+// into a SharedMemoryRing. File descriptors attached to them are sent
+// over the socket before the frame is written.
+//
+// In packet mode, the send buffer is flushed before it would exceed
+// ArgdataReader::kMaxPacketLength, so that every sendmsg() call sends a
+// packet containing complete frames. Larger frames are always spilled.
+//
+// Frames carrying more than ArgdataReader::kMaxFdsPerWrite file
+// descriptors are split up, sending the excess file descriptors along
+// with continuation frames using as few writes as possible.
+//
+// Unary requests carrying at least the configured number of file
+// descriptors may be sent as remote frames instead, letting the peer
+// duplicate them through pidfd_getfd(). This is only safe because the
+// caller keeps the file descriptors open until the peer has replied.
+//
+// Frames built by an ArgdataBuilder that are sent right away don't need
+// to be copied into the send buffer entirely. Strings and binary blobs
+// referenced by the builder are sent straight from their storage, by
+// interleaving them with the send buffer in a single sendmsg() call.
+//
+// Messages generated by aprotoc can be pushed without building them,
+// by serializing them straight into the send buffer. They are built
+// using the builder provided instead if they need to be spilled, sent
+// as remote frames, or if they are large enough to reference data. The
+// builder is also used to determine whether field numbers are used.
+class ArgdataWriter {
+ public:
+  ArgdataWriter(std::size_t max_corked_bytes, std::size_t max_corked_messages,
+                std::chrono::microseconds max_corked_delay,
+                std::size_t spill_threshold);
+
+  int Push(int fd, const argdata_t* ad, bool corked = false);
+  int Push(int fd, const argdata_t* ad, const ArgdataBuilder& builder,
+           bool corked = false);
+  // Sends a unary request, whose builder is kept alive until the
+  // response has been received.
+  int PushUnaryRequest(int fd, const argdata_t* ad,
+                       const ArgdataBuilder& builder);
+  int Push(int fd, const Message& message, ArgdataBuilder* builder,
+           bool corked = false);
+  int PushUnaryRequest(int fd, const Message& message,
+                       ArgdataBuilder* builder);
+  int Flush(int fd);
+
+  // Returns whether frames have been corked that still need to be sent.
+  bool IsCorked() const {
+    return !buffer_.empty();
+  }
+
+  // Functions for flushing corked frames externally, e.g. using
+  // io_uring. PrepareFlush() sets up a sendmsg() call, returning false
+  // if there is nothing to send or if Flush() needs to be used instead.
+  // The writer may not be used until the call has completed and its
+  // result has been passed to CompleteFlush(). The remainder of a short
+  // write stays corked, so that it can be sent by another call.
+  bool PrepareFlush(struct msghdr* msg, struct iovec* iov);
+  int CompleteFlush(int result);
+
+  void SetSharedMemory(std::unique_ptr<SharedMemoryRing> ring) {
+    ring_ = std::move(ring);
+  }
+  void SetPacketMode() {
+    packet_mode_ = true;
+  }
+  // Sets the number of file descriptors from which unary requests are
+  // sent as remote frames. Zero disables the use of remote frames.
+  void SetPidfdThreshold(std::size_t count) {
+    pidfd_threshold_ = count;
+  }
+
+ private:
+  void Clear();
+  int PushFrame(int fd, const argdata_t* ad, const ArgdataBuilder* builder,
+                bool corked, bool unary_request);
+  int PushMessage(int fd, const Message& message, ArgdataBuilder* builder,
+                  bool corked, bool unary_request);
+  int PrepareFrame(int fd, std::size_t frame_length, bool has_fds,
+                   bool* corked);
+  int FinishFrame(int fd, bool corked);
+  int PushGathered(int fd, const argdata_t* ad, const ArgdataBuilder& builder,
+                   std::size_t data_length);
+  int PushSpilled(int fd, const argdata_t* ad, std::size_t data_length,
+                  std::size_t fds_length);
+  int SendContinuationFrames(int fd);
+  int SendToSocket(int fd, const void* buf, std::size_t len,
+                   const int* fds = nullptr, std::size_t fds_length = 0);
+  int SendToSocket(int fd, struct iovec* iov, std::size_t iovcnt,
+                   const int* fds = nullptr, std::size_t fds_length = 0);
+
+  const std::size_t max_corked_bytes_;
+  const std::size_t max_corked_messages_;
+  const std::chrono::microseconds max_corked_delay_;
+  const std::size_t spill_threshold_;
+  bool packet_mode_;
+  std::size_t pidfd_threshold_;
+
+  std::vector<std::uint8_t> buffer_;
+  std::vector<int> fds_;
+  std::size_t messages_;
+  std::chrono::steady_clock::time_point first_corked_;
+  std::unique_ptr<SharedMemoryRing> ring_;
+  ArgdataSerializer serializer_;
+
+  ArgdataWriter(ArgdataWriter const&) = delete;
+  void operator=(ArgdataWriter const&) = delete;
+};
+
+}  // namespace arpc
+
+#endif
@@ -0,0 +1,632 @@
+// Copyright (c) 2017 Nuxi (https://nuxi.nl/) and contributors.
+//
+// SPDX-License-Identifier: BSD-2-Clause
+
+#include <sys/resource.h>
+#include <sys/socket.h>
+
+#include <unistd.h>
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <new>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include <arpc++/arpc++.h>
+
+#include "benchmark_proto.ad.h"
+
+// Throughput benchmarks for ARPC. Every benchmark runs a server on one
+// end of a socket pair in a separate thread and issues calls against it
+// from the other end. The benchmarks to run can be limited by passing
+// name prefixes on the command line.
+
+namespace {
+
+// Number of allocations performed through operator new, used to report
+// the number of allocations needed to build and parse messages.
+std::atomic<std::uint64_t> allocations;
+
+}  // namespace
+
+void* operator new(std::size_t size) {
+  allocations.fetch_add(1, std::memory_order_relaxed);
+  if (void* ptr = std::malloc(size == 0 ? 1 : size))
+    return ptr;
+  throw std::bad_alloc();
+}
+
+void operator delete(void* ptr) noexcept {
+  std::free(ptr);
+}
+
+void operator delete(void* ptr, std::size_t size) noexcept {
+  std::free(ptr);
+}
+
+namespace {
+
+class BenchmarkService final
+    : public benchmark_proto::BenchmarkService::Service {
+ public:
+  arpc::Status Echo(arpc::ServerContext* context,
+                    const benchmark_proto::EchoRequest* request,
+                    benchmark_proto::EchoResponse* response) override {
+    response->set_payload(request->payload());
+    return arpc::Status::OK;
+  }
+
+  arpc::Status PassFileDescriptors(
+      arpc::ServerContext* context,
+      const benchmark_proto::FileDescriptorsRequest* request,
+      benchmark_proto::FileDescriptorsResponse* response) override {
+    return arpc::Status::OK;
+  }
+
+  arpc::Status Sequence(
+      arpc::ServerContext* context,
+      const benchmark_proto::SequenceRequest* request,
+      arpc::ServerWriter<benchmark_proto::SequenceResponse>* writer) override {
+    benchmark_proto::SequenceResponse response;
+    arpc::WriteOptions options;
+    if (request->corked())
+      options.set_corked();
+    for (std::uint32_t i = 0; i < request->count(); ++i) {
+      response.set_index(i);
+      if (!writer->Write(response, options))
+        break;
+    }
+    return arpc::Status::OK;
+  }
+};
+
+// Runs a client function against a server that is connected through a
+// socket pair of a given type. The server terminates when the client
+// closes its end.
+void WithServer(
+    const arpc::ChannelArguments& arguments, int type,
+    const std::function<void(benchmark_proto::BenchmarkService::Stub*)>&
+        client) {
+  int fds[2];
+  if (socketpair(AF_UNIX, type, 0, fds) != 0) {
+    std::perror("socketpair");
+    std::exit(1);
+  }
+
+  std::thread server_thread([fd = fds[1], &arguments]() {
+    arpc::ServerBuilder builder(std::make_shared<arpc::FileDescriptor>(fd));
+    builder.SetSharedMemoryRingSize(arguments.GetSharedMemoryRingSize());
+    builder.SetMaxReceiveFileDescriptors(
+        arguments.GetMaxReceiveFileDescriptors());
+    builder.SetPidfdThreshold(arguments.GetPidfdThreshold());
+    builder.SetFieldNumbers(arguments.GetFieldNumbers());
+    BenchmarkService service;
+    builder.RegisterService(&service);
+    std::unique_ptr<arpc::Server> server = builder.Build();
+    while (server->HandleRequest() == 0) {
+    }
+  });
+
+  {
+    std::unique_ptr<benchmark_proto::BenchmarkService::Stub> stub =
+        benchmark_proto::BenchmarkService::NewStub(arpc::CreateCustomChannel(
+            std::make_shared<arpc::FileDescriptor>(fds[0]), arguments));
+    client(stub.get());
+  }
+  server_thread.join();
+}
+
+// Measures the time needed to perform a given number of operations and
+// prints the resulting rate.
+void Measure(std::string_view name, std::uint64_t operations,
+             const std::function<void()>& body) {
+  auto start = std::chrono::steady_clock::now();
+  body();
+  std::chrono::duration<double> elapsed =
+      std::chrono::steady_clock::now() - start;
+  std::cout << name << ": " << std::uint64_t(operations / elapsed.count())
+            << " ops/s" << std::endl;
+}
+
+void UnaryEcho(std::string_view name, const arpc::ChannelArguments& arguments,
+               std::size_t payload_size, std::uint64_t calls,
+               int type = SOCK_STREAM) {
+  WithServer(
+      arguments, type, [&](benchmark_proto::BenchmarkService::Stub* stub) {
+        benchmark_proto::EchoRequest request;
+        request.set_payload(std::string(payload_size, 'x'));
+        benchmark_proto::EchoResponse response;
+        Measure(name, calls, [&]() {
+          for (std::uint64_t i = 0; i < calls; ++i) {
+            arpc::ClientContext context;
+            if (!stub->Echo(&context, request, &response).ok()) {
+              std::cerr << name << ": call failed" << std::endl;
+              std::exit(1);
+            }
+          }
+        });
+      });
+}
+
+// Passes file descriptors to the server, reporting the number of file
+// descriptors per second, as opposed to the number of calls.
+void PassFileDescriptors(std::string_view name,
+                         const arpc::ChannelArguments& arguments,
+                         std::size_t fds_per_call, std::uint64_t fds) {
+  WithServer(
+      arguments, SOCK_STREAM,
+      [&](benchmark_proto::BenchmarkService::Stub* stub) {
+        benchmark_proto::FileDescriptorsRequest request;
+        for (std::size_t i = 0; i < fds_per_call; ++i)
+          request.add_fds(arpc::FileDescriptorHandle(dup(0)));
+        benchmark_proto::FileDescriptorsResponse response;
+        std::uint64_t calls = fds / fds_per_call;
+        Measure(name, calls * fds_per_call, [&]() {
+          for (std::uint64_t i = 0; i < calls; ++i) {
+            arpc::ClientContext context;
+            if (!stub->PassFileDescriptors(&context, request, &response)
+                     .ok()) {
+              std::cerr << name << ": call failed" << std::endl;
+              std::exit(1);
+            }
+          }
+        });
+      });
+}
+
+// Builds and parses a message repeatedly, without transmitting it. In
+// addition to the rate, the number of allocations per message on either
+// side is reported, excluding serialization. Allocations made by
+// libargdata are only included if it uses operator new. Messages are
+// either built using a new builder each time, or by resetting a single
+// builder, like channels and connections do.
+template <typename T>
+void BuildAndParse(std::string_view name, const T& message,
+                   std::uint64_t iterations, bool reuse_builder) {
+  std::vector<std::uint8_t> buffer;
+  std::uint64_t build_allocations = 0, parse_allocations = 0;
+  arpc::ArgdataBuilder reused_builder;
+  Measure(name, iterations, [&]() {
+    for (std::uint64_t i = 0; i < iterations; ++i) {
+      {
+        std::uint64_t start = allocations.load(std::memory_order_relaxed);
+        arpc::ArgdataBuilder new_builder;
+        arpc::ArgdataBuilder* argdata_builder =
+            reuse_builder ? &reused_builder : &new_builder;
+        const argdata_t* ad = message.Build(argdata_builder);
+        build_allocations +=
+            allocations.load(std::memory_order_relaxed) - start;
+        std::size_t data_length, fds_length;
+        argdata_serialized_length(ad, &data_length, &fds_length);
+        buffer.resize(data_length);
+        argdata_serialize(ad, buffer.data(), nullptr);
+        argdata_builder->Reset();
+      }
+      {
+        std::unique_ptr<argdata_t> ad(argdata_from_buffer(
+            buffer.data(), buffer.size(), nullptr, nullptr));
+        std::uint64_t start = allocations.load(std::memory_order_relaxed);
+        {
+          arpc::ArgdataParser argdata_parser;
+          T parsed;
+          parsed.Parse(*ad, &argdata_parser);
+        }
+        parse_allocations +=
+            allocations.load(std::memory_order_relaxed) - start;
+      }
+    }
+  });
+  std::cout << name << ": " << build_allocations / iterations
+            << " allocations per build, " << parse_allocations / iterations
+            << " per parse" << std::endl;
+}
+
+// Serializes a message repeatedly, either by building it using a reused
+// builder and serializing the resulting argdata_t, or by serializing it
+// directly. The number of allocations per message is reported, which
+// only includes allocations made by libargdata if it uses operator new.
+template <typename T>
+void Serialize(std::string_view name, const T& message,
+               std::uint64_t iterations, bool direct) {
+  std::vector<std::uint8_t> buffer;
+  std::uint64_t serialize_allocations = 0;
+  arpc::ArgdataBuilder argdata_builder;
+  arpc::ArgdataSerializer argdata_serializer;
+  Measure(name, iterations, [&]() {
+    for (std::uint64_t i = 0; i < iterations; ++i) {
+      std::uint64_t start = allocations.load(std::memory_order_relaxed);
+      if (direct) {
+        argdata_serializer.Reset(false);
+        buffer.resize(message.ByteSize(&argdata_serializer));
+        message.SerializeTo(buffer.data(), &argdata_serializer);
+      } else {
+        const argdata_t* ad = message.Build(&argdata_builder);
+        std::size_t data_length, fds_length;
+        argdata_serialized_length(ad, &data_length, &fds_length);
+        buffer.resize(data_length);
+        argdata_serialize(ad, buffer.data(), nullptr);
+        argdata_builder.Reset();
+      }
+      serialize_allocations +=
+          allocations.load(std::memory_order_relaxed) - start;
+    }
+  });
+  std::cout << name << ": " << serialize_allocations / iterations
+            << " allocations per message" << std::endl;
+}
+
+// Parses a serialized message repeatedly, so that the cost of matching
+// keys to fields can be measured separately from building. The size of
+// the serialized message is reported as well.
+template <typename T>
+void Parse(std::string_view name, const T& message, std::uint64_t iterations,
+           bool field_numbers) {
+  std::vector<std::uint8_t> buffer;
+  {
+    arpc::ArgdataBuilder argdata_builder;
+    argdata_builder.SetFieldNumbers(field_numbers);
+    const argdata_t* ad = message.Build(&argdata_builder);
+    std::size_t data_length, fds_length;
+    argdata_serialized_length(ad, &data_length, &fds_length);
+    buffer.resize(data_length);
+    argdata_serialize(ad, buffer.data(), nullptr);
+  }
+  std::unique_ptr<argdata_t> ad(
+      argdata_from_buffer(buffer.data(), buffer.size(), nullptr, nullptr));
+  T parsed;
+  Measure(name, iterations, [&]() {
+    for (std::uint64_t i = 0; i < iterations; ++i) {
+      arpc::ArgdataParser argdata_parser;
+      parsed.Clear();
+      parsed.Parse(*ad, &argdata_parser);
+    }
+  });
+  std::cout << name << ": " << buffer.size() << " bytes" << std::endl;
+}
+
+// Like UnaryEcho(), except that the service is invoked directly through
+// an in-process channel.
+void InProcessUnaryEcho(std::string_view name, std::size_t payload_size,
+                        std::uint64_t calls) {
+  arpc::ServerBuilder builder;
+  BenchmarkService service;
+  builder.RegisterService(&service);
+  std::shared_ptr<arpc::Server> server = builder.Build();
+  std::unique_ptr<benchmark_proto::BenchmarkService::Stub> stub =
+      benchmark_proto::BenchmarkService::NewStub(server->InProcessChannel());
+
+  benchmark_proto::EchoRequest request;
+  request.set_payload(std::string(payload_size, 'x'));
+  benchmark_proto::EchoResponse response;
+  Measure(name, calls, [&]() {
+    for (std::uint64_t i = 0; i < calls; ++i) {
+      arpc::ClientContext context;
+      if (!stub->Echo(&context, request, &response).ok()) {
+        std::cerr << name << ": call failed" << std::endl;
+        std::exit(1);
+      }
+    }
+  });
+}
+
+void ServerStream(std::string_view name,
+                  const arpc::ChannelArguments& arguments,
+                  std::uint32_t messages, bool corked,
+                  int type = SOCK_STREAM) {
+  WithServer(
+      arguments, type, [&](benchmark_proto::BenchmarkService::Stub* stub) {
+        benchmark_proto::SequenceRequest request;
+        request.set_count(messages);
+        request.set_corked(corked);
+        benchmark_proto::SequenceResponse response;
+        Measure(name, messages, [&]() {
+          arpc::ClientContext context;
+          std::unique_ptr<arpc::ClientReader<benchmark_proto::SequenceResponse>>
+              reader(stub->Sequence(&context, request));
+          while (reader->Read(&response)) {
+          }
+          if (!reader->Finish().ok()) {
+            std::cerr << name << ": call failed" << std::endl;
+            std::exit(1);
+          }
+        });
+      });
+}
+
+// Issues calls from many clients concurrently against a single server
+// that handles all of their connections.
+void MultiClientEcho(std::string_view name,
+                     const arpc::ChannelArguments& server_arguments,
+                     std::size_t clients, std::uint64_t calls) {
+  arpc::ServerBuilder builder;
+  builder.SetIoUringEntries(server_arguments.GetIoUringEntries());
+  BenchmarkService service;
+  builder.RegisterService(&service);
+  std::unique_ptr<arpc::Server> server = builder.Build();
+
+  std::vector<std::shared_ptr<arpc::FileDescriptor>> client_fds;
+  for (std::size_t i = 0; i < clients; ++i) {
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0) {
+      std::perror("socketpair");
+      std::exit(1);
+    }
+    client_fds.push_back(std::make_shared<arpc::FileDescriptor>(fds[0]));
+    if (server->AddConnection(std::make_shared<arpc::FileDescriptor>(
+            fds[1])) != 0) {
+      std::cerr << name << ": failed to add connection" << std::endl;
+      std::exit(1);
+    }
+  }
+
+  std::thread server_thread([&server, &name]() {
+    while (server->GetConnectionCount() > 0) {
+      if (server->HandleRequest() != 0) {
+        std::cerr << name << ": failed to handle request" << std::endl;
+        std::exit(1);
+      }
+    }
+  });
+
+  Measure(name, clients * calls, [&]() {
+    std::vector<std::thread> client_threads;
+    for (std::shared_ptr<arpc::FileDescriptor>& fd : client_fds) {
+      client_threads.emplace_back([&name, fd = std::move(fd), calls]() {
+        std::unique_ptr<benchmark_proto::BenchmarkService::Stub> stub =
+            benchmark_proto::BenchmarkService::NewStub(
+                arpc::CreateChannel(fd));
+        benchmark_proto::EchoRequest request;
+        benchmark_proto::EchoResponse response;
+        for (std::uint64_t i = 0; i < calls; ++i) {
+          arpc::ClientContext context;
+          if (!stub->Echo(&context, request, &response).ok()) {
+            std::cerr << name << ": call failed" << std::endl;
+            std::exit(1);
+          }
+        }
+      });
+    }
+    for (std::thread& client_thread : client_threads)
+      client_thread.join();
+  });
+  server_thread.join();
+}
+
+}  // namespace
+
+int main(int argc, char* argv[]) {
+  // Benchmarks passing file descriptors may exceed the default soft
+  // limit on the number of open file descriptors.
+  struct rlimit rlim;
+  if (getrlimit(RLIMIT_NOFILE, &rlim) == 0) {
+    rlim.rlim_cur = rlim.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &rlim);
+  }
+
+  arpc::ChannelArguments socket;
+  arpc::ChannelArguments shared_memory;
+  shared_memory.SetSharedMemoryRingSize(1024 * 1024);
+  arpc::ChannelArguments io_uring;
+  io_uring.SetIoUringEntries(256);
+  arpc::ChannelArguments many_fds;
+  many_fds.SetMaxReceiveFileDescriptors(4096);
+  arpc::ChannelArguments pidfd = many_fds;
+  pidfd.SetPidfdThreshold(1);
+  arpc::ChannelArguments field_numbers;
+  field_numbers.SetFieldNumbers(true);
+
+  benchmark_proto::EchoRequest echo_request;
+  echo_request.set_payload("Hello, world");
+  benchmark_proto::WideMessage wide_message;
+  wide_message.set_id(1234567);
+  wide_message.set_name("benchmark message name");
+  wide_message.set_description("A message with many fields of any type");
+  wide_message.set_enabled(true);
+  wide_message.set_priority(-5);
+  wide_message.set_created(1500000000);
+  wide_message.set_modified(1600000000);
+  wide_message.set_owner("owner of the message");
+  wide_message.set_group("group of the message");
+  wide_message.set_mode(0644);
+  wide_message.set_checksum(std::string(32, 'c'));
+  wide_message.set_version(3);
+  wide_message.mutable_nested()->set_payload("nested payload string");
+  wide_message.set_path("/path/to/some/file/on/disk");
+  wide_message.set_size(65536);
+  wide_message.set_archived(true);
+  wide_message.set_comment("comment on the message");
+  benchmark_proto::WideMessage wide_lists = wide_message;
+  for (int i = 0; i < 100; ++i) {
+    wide_lists.add_tags("tag number " + std::to_string(i));
+    wide_lists.add_references(i);
+  }
+  for (int i = 0; i < 20; ++i)
+    (*wide_lists.mutable_attributes())["attribute " + std::to_string(i)] =
+        "value " + std::to_string(i);
+
+  const struct {
+    std::string_view name;
+    std::function<void(std::string_view)> run;
+  } benchmarks[] = {
+      {"unary_echo_empty",
+       [&](std::string_view name) { UnaryEcho(name, socket, 0, 100000); }},
+      {"unary_echo_1k",
+       [&](std::string_view name) { UnaryEcho(name, socket, 1024, 100000); }},
+      {"numbers_unary_echo_empty",
+       [&](std::string_view name) {
+         UnaryEcho(name, field_numbers, 0, 100000);
+       }},
+      {"unary_echo_256k",
+       [&](std::string_view name) {
+         UnaryEcho(name, socket, 262144, 10000);
+       }},
+      {"unary_echo_1m",
+       [&](std::string_view name) {
+         UnaryEcho(name, socket, 1048576, 1000);
+       }},
+      {"server_stream",
+       [&](std::string_view name) {
+         ServerStream(name, socket, 1000000, false);
+       }},
+      {"server_stream_corked",
+       [&](std::string_view name) {
+         ServerStream(name, socket, 1000000, true);
+       }},
+      {"seqpacket_unary_echo_empty",
+       [&](std::string_view name) {
+         UnaryEcho(name, socket, 0, 100000, SOCK_SEQPACKET);
+       }},
+      {"seqpacket_unary_echo_1k",
+       [&](std::string_view name) {
+         UnaryEcho(name, socket, 1024, 100000, SOCK_SEQPACKET);
+       }},
+      {"seqpacket_server_stream_corked",
+       [&](std::string_view name) {
+         ServerStream(name, socket, 1000000, true, SOCK_SEQPACKET);
+       }},
+      {"fds_1",
+       [&](std::string_view name) {
+         PassFileDescriptors(name, many_fds, 1, 200000);
+       }},
+      {"fds_16",
+       [&](std::string_view name) {
+         PassFileDescriptors(name, many_fds, 16, 1000000);
+       }},
+      {"fds_253",
+       [&](std::string_view name) {
+         PassFileDescriptors(name, many_fds, 253, 1000000);
+       }},
+      {"fds_1024",
+       [&](std::string_view name) {
+         PassFileDescriptors(name, many_fds, 1024, 1000000);
+       }},
+      {"fds_4096",
+       [&](std::string_view name) {
+         PassFileDescriptors(name, many_fds, 4096, 1000000);
+       }},
+      {"pidfd_fds_253",
+       [&](std::string_view name) {
+         PassFileDescriptors(name, pidfd, 253, 1000000);
+       }},
+      {"pidfd_fds_4096",
+       [&](std::string_view name) {
+         PassFileDescriptors(name, pidfd, 4096, 1000000);
+       }},
+      {"shm_unary_echo_empty",
+       [&](std::string_view name) {
+         UnaryEcho(name, shared_memory, 0, 100000);
+       }},
+      {"shm_unary_echo_1k",
+       [&](std::string_view name) {
+         UnaryEcho(name, shared_memory, 1024, 100000);
+       }},
+      {"shm_server_stream",
+       [&](std::string_view name) {
+         ServerStream(name, shared_memory, 1000000, false);
+       }},
+      {"inproc_unary_echo_empty",
+       [&](std::string_view name) { InProcessUnaryEcho(name, 0, 100000); }},
+      {"inproc_unary_echo_1k",
+       [&](std::string_view name) { InProcessUnaryEcho(name, 1024, 100000); }},
+      {"multi_echo_64",
+       [&](std::string_view name) {
+         MultiClientEcho(name, socket, 64, 2000);
+       }},
+      {"uring_multi_echo_64",
+       [&](std::string_view name) {
+         MultiClientEcho(name, io_uring, 64, 2000);
+       }},
+      {"message_echo",
+       [&](std::string_view name) {
+         BuildAndParse(name, echo_request, 1000000, false);
+       }},
+      {"message_wide",
+       [&](std::string_view name) {
+         BuildAndParse(name, wide_message, 200000, false);
+       }},
+      {"message_wide_lists",
+       [&](std::string_view name) {
+         BuildAndParse(name, wide_lists, 20000, false);
+       }},
+      {"message_reused_echo",
+       [&](std::string_view name) {
+         BuildAndParse(name, echo_request, 1000000, true);
+       }},
+      {"message_reused_wide",
+       [&](std::string_view name) {
+         BuildAndParse(name, wide_message, 200000, true);
+       }},
+      {"message_reused_wide_lists",
+       [&](std::string_view name) {
+         BuildAndParse(name, wide_lists, 20000, true);
+       }},
+      {"serialize_built_echo",
+       [&](std::string_view name) {
+         Serialize(name, echo_request, 1000000, false);
+       }},
+      {"serialize_built_wide",
+       [&](std::string_view name) {
+         Serialize(name, wide_message, 200000, false);
+       }},
+      {"serialize_built_wide_lists",
+       [&](std::string_view name) {
+         Serialize(name, wide_lists, 20000, false);
+       }},
+      {"serialize_direct_echo",
+       [&](std::string_view name) {
+         Serialize(name, echo_request, 1000000, true);
+       }},
+      {"serialize_direct_wide",
+       [&](std::string_view name) {
+         Serialize(name, wide_message, 200000, true);
+       }},
+      {"serialize_direct_wide_lists",
+       [&](std::string_view name) {
+         Serialize(name, wide_lists, 20000, true);
+       }},
+      {"parse_echo",
+       [&](std::string_view name) {
+         Parse(name, echo_request, 1000000, false);
+       }},
+      {"parse_wide",
+       [&](std::string_view name) {
+         Parse(name, wide_message, 500000, false);
+       }},
+      {"parse_wide_lists",
+       [&](std::string_view name) {
+         Parse(name, wide_lists, 50000, false);
+       }},
+      {"parse_numbers_echo",
+       [&](std::string_view name) {
+         Parse(name, echo_request, 1000000, true);
+       }},
+      {"parse_numbers_wide",
+       [&](std::string_view name) {
+         Parse(name, wide_message, 500000, true);
+       }},
+      {"parse_numbers_wide_lists",
+       [&](std::string_view name) {
+         Parse(name, wide_lists, 50000, true);
+       }},
+  };
+
+  for (const auto& benchmark : benchmarks) {
+    bool selected = argc <= 1;
+    for (int i = 1; i < argc; ++i)
+      if (benchmark.name.substr(0, std::string_view(argv[i]).size()) ==
+          argv[i])
+        selected = true;
+    if (selected)
+      benchmark.run(benchmark.name);
+  }
+  return 0;
+}
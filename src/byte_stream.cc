@@ -0,0 +1,265 @@
+// Copyright (c) 2017 Nuxi (https://nuxi.nl/) and contributors.
+//
+// SPDX-License-Identifier: BSD-2-Clause
+
+#include <sys/mman.h>
+#include <sys/uio.h>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstddef>
+#include <memory>
+#include <thread>
+#include <utility>
+
+#include <arpc++/arpc++.h>
+
+using namespace arpc;
+
+namespace {
+
+// Waits until a file descriptor becomes ready. When feeding a pipe,
+// also wait on the read end of the pipe that is closed to cancel.
+int WaitUntilReady(int fd, short events, int cancel) {
+  struct pollfd pfds[2] = {{.fd = fd, .events = events},
+                           {.fd = cancel, .events = POLLIN}};
+  while (poll(pfds, 2, -1) < 0) {
+    if (errno != EINTR)
+      return errno;
+  }
+  return pfds[1].revents != 0 ? ECANCELED : 0;
+}
+
+int WriteFully(int fd, const char* data, std::size_t length, int cancel) {
+  while (length > 0) {
+    ssize_t retval = write(fd, data, length);
+    if (retval < 0) {
+      if (errno == EINTR)
+        continue;
+      if (errno == EAGAIN) {
+        if (int error = WaitUntilReady(fd, POLLOUT, cancel); error != 0)
+          return error;
+        continue;
+      }
+      return errno;
+    }
+    data += retval;
+    length -= retval;
+  }
+  return 0;
+}
+
+// Copies data between file descriptors for which splice() is not
+// supported.
+int CopyFileDescriptor(int in, int out, std::size_t* length, int cancel) {
+  char buf[65536];
+  for (;;) {
+    ssize_t retval = read(in, buf, sizeof(buf));
+    if (retval < 0) {
+      if (errno == EINTR)
+        continue;
+      if (errno == EAGAIN && cancel >= 0) {
+        if (int error = WaitUntilReady(in, POLLIN, cancel); error != 0)
+          return error;
+        continue;
+      }
+      return errno;
+    }
+    if (retval == 0)
+      return 0;
+    if (int error = WriteFully(out, buf, retval, cancel); error != 0)
+      return error;
+    *length += retval;
+  }
+}
+
+// Number of bytes to move per call to splice().
+constexpr std::size_t kSpliceLength = 1 << 20;
+
+int SpliceFileDescriptor(int in, int out, std::size_t* length,
+                         int cancel = -1) {
+#ifdef SPLICE_F_MOVE
+  for (;;) {
+    // When feeding a pipe, only splice once it has space, so that
+    // splice() doesn't block on it. Failing to make progress then
+    // means that the source is non-blocking and has no data.
+    if (cancel >= 0) {
+      if (int error = WaitUntilReady(out, POLLOUT, cancel); error != 0)
+        return error;
+    }
+    ssize_t retval =
+        splice(in, nullptr, out, nullptr, kSpliceLength, SPLICE_F_MOVE);
+    if (retval < 0) {
+      if (errno == EINTR)
+        continue;
+      if (errno == EAGAIN && cancel >= 0) {
+        if (int error = WaitUntilReady(in, POLLIN, cancel); error != 0)
+          return error;
+        continue;
+      }
+      if (errno == EINVAL && *length == 0)
+        return CopyFileDescriptor(in, out, length, cancel);
+      return errno;
+    }
+    if (retval == 0)
+      return 0;
+    *length += retval;
+  }
+#else
+  return CopyFileDescriptor(in, out, length, cancel);
+#endif
+}
+
+#ifdef SPLICE_F_MOVE
+// Writes to a pipe whose read end has been closed raise SIGPIPE.
+// Suppress it, so that the feeding thread terminates with EPIPE.
+void BlockSigpipe() {
+  sigset_t set;
+  sigemptyset(&set);
+  sigaddset(&set, SIGPIPE);
+  pthread_sigmask(SIG_BLOCK, &set, nullptr);
+}
+
+void FeedFromBuffer(std::shared_ptr<FileDescriptor> pipe,
+                    std::shared_ptr<FileDescriptor> cancel, void* buffer,
+                    std::size_t size) {
+  BlockSigpipe();
+  auto data = static_cast<char*>(buffer);
+  for (std::size_t written = 0; written < size;) {
+    if (WaitUntilReady(pipe->get(), POLLOUT, cancel->get()) != 0)
+      break;
+    struct iovec iov = {.iov_base = data + written,
+                        .iov_len = size - written};
+    ssize_t retval = vmsplice(pipe->get(), &iov, 1, SPLICE_F_NONBLOCK);
+    if (retval < 0) {
+      if (errno == EINTR || errno == EAGAIN)
+        continue;
+      break;
+    }
+    written += retval;
+  }
+
+  // The pipe holds its own references to the pages that haven't been
+  // consumed yet. Unmapping the buffer ensures nothing else can modify
+  // them in the meantime.
+  pipe.reset();
+  if (buffer != nullptr)
+    munmap(buffer, size);
+}
+
+void FeedFromFileDescriptor(std::shared_ptr<FileDescriptor> pipe,
+                            std::shared_ptr<FileDescriptor> cancel,
+                            std::shared_ptr<FileDescriptor> source) {
+  BlockSigpipe();
+  std::size_t length = 0;
+  SpliceFileDescriptor(source->get(), pipe->get(), &length, cancel->get());
+}
+#endif
+
+}  // namespace
+
+ByteStream::ByteStream() : buffer_(nullptr), size_(0) {
+}
+
+ByteStream::~ByteStream() {
+  if (feeder_.joinable()) {
+    cancel_.reset();
+    feeder_.join();
+  }
+  if (buffer_ != nullptr)
+    munmap(buffer_, size_);
+}
+
+int ByteStream::Create(std::size_t size, std::shared_ptr<ByteStream>* stream) {
+  // Allocate the buffer as a separate mapping, as opposed to using the
+  // heap, so that its pages can be safely handed to vmsplice().
+  std::shared_ptr<ByteStream> new_stream(new ByteStream());
+  if (size > 0) {
+    void* buffer = mmap(nullptr, size, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (buffer == MAP_FAILED)
+      return errno;
+    new_stream->buffer_ = buffer;
+    new_stream->size_ = size;
+  }
+  *stream = std::move(new_stream);
+  return 0;
+}
+
+std::shared_ptr<ByteStream> ByteStream::FromFileDescriptor(
+    const std::shared_ptr<FileDescriptor>& source) {
+  std::shared_ptr<ByteStream> stream(new ByteStream());
+  stream->source_ = source;
+  return stream;
+}
+
+std::shared_ptr<ByteStream> ByteStream::FromPipe(
+    const std::shared_ptr<FileDescriptor>& pipe) {
+  std::shared_ptr<ByteStream> stream(new ByteStream());
+  stream->pipe_ = pipe;
+  return stream;
+}
+
+int ByteStream::Open(std::shared_ptr<FileDescriptor>* pipe) {
+  if (!pipe_) {
+#ifdef SPLICE_F_MOVE
+    // The write end is non-blocking, so that the feeding thread never
+    // blocks on it and can be cancelled while the pipe is full.
+    int fds[2], cancel_fds[2];
+    if (pipe2(fds, O_CLOEXEC) != 0)
+      return errno;
+    auto read_end = std::make_shared<FileDescriptor>(fds[0]);
+    auto write_end = std::make_shared<FileDescriptor>(fds[1]);
+    if (fcntl(fds[1], F_SETFL, O_NONBLOCK) != 0 ||
+        pipe2(cancel_fds, O_CLOEXEC) != 0)
+      return errno;
+    auto cancel_read_end = std::make_shared<FileDescriptor>(cancel_fds[0]);
+    cancel_ = std::make_shared<FileDescriptor>(cancel_fds[1]);
+    pipe_ = std::move(read_end);
+
+    // Feed the pipe from a separate thread, as the receiver only starts
+    // consuming data after the message has been sent.
+    if (source_) {
+      feeder_ = std::thread(FeedFromFileDescriptor, std::move(write_end),
+                            std::move(cancel_read_end), std::move(source_));
+    } else {
+      feeder_ = std::thread(FeedFromBuffer, std::move(write_end),
+                            std::move(cancel_read_end), buffer_, size_);
+      buffer_ = nullptr;
+    }
+#else
+    return ENOSYS;
+#endif
+  }
+  *pipe = pipe_;
+  return 0;
+}
+
+int ByteStream::Read(void* buf, std::size_t len, std::size_t* received) {
+  std::shared_ptr<FileDescriptor> pipe;
+  if (int error = Open(&pipe); error != 0)
+    return error;
+  for (;;) {
+    ssize_t retval = read(pipe->get(), buf, len);
+    if (retval < 0) {
+      if (errno == EINTR)
+        continue;
+      return errno;
+    }
+    *received = retval;
+    return 0;
+  }
+}
+
+int ByteStream::SpliceTo(int fd, std::size_t* length) {
+  std::shared_ptr<FileDescriptor> pipe;
+  if (int error = Open(&pipe); error != 0)
+    return error;
+  *length = 0;
+  return SpliceFileDescriptor(pipe->get(), fd, length);
+}
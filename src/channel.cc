@@ -2,20 +2,83 @@
 //
 // SPDX-License-Identifier: BSD-2-Clause
 
+#include <sys/socket.h>
+#include <sys/syscall.h>
+
 #include <poll.h>
+#include <unistd.h>
 
+#include <algorithm>
+#include <chrono>
 #include <cstring>
+#include <map>
 #include <memory>
+#include <string>
+#include <string_view>
 
 #include <arpc++/arpc++.h>
 
+#include "argdata_reader.h"
+#include "argdata_writer.h"
 #include "arpc_protocol.ad.h"
+#include "file_descriptor_registry.h"
+#include "shared_memory_ring.h"
 
 using namespace arpc;
 
+Channel::Channel(const std::shared_ptr<FileDescriptor>& fd,
+                 const ChannelArguments& arguments)
+    : fd_(fd),
+      reader_(std::make_unique<ArgdataReader>(
+          arguments.GetMaxReceiveMessageSize(),
+          arguments.GetMaxReceiveFileDescriptors(),
+          arguments.GetAdaptiveReceiveBuffer())),
+      writer_(std::make_unique<ArgdataWriter>(
+          arguments.GetMaxCorkedBytes(), arguments.GetMaxCorkedMessages(),
+          arguments.GetMaxCorkedDelay(), arguments.GetSpillThreshold())),
+      shared_memory_ring_size_(arguments.GetSharedMemoryRingSize()),
+      file_descriptor_handles_(arguments.GetFileDescriptorHandles()),
+      pidfd_threshold_(arguments.GetPidfdThreshold()),
+      field_numbers_(arguments.GetFieldNumbers()),
+      negotiated_(false) {
+  if (ArgdataReader::IsPacketSocket(fd_->get())) {
+    reader_->SetPacketMode();
+    writer_->SetPacketMode();
+  }
+}
+
+Channel::Channel(const std::map<std::string, Service*, std::less<>>& services)
+    : reader_(std::make_unique<ArgdataReader>(0, 0, true)),
+      writer_(std::make_unique<ArgdataWriter>(
+          0, 0, std::chrono::microseconds(0), 0)),
+      shared_memory_ring_size_(0),
+      file_descriptor_handles_(0),
+      pidfd_threshold_(0),
+      field_numbers_(false),
+      negotiated_(true),
+      services_(services) {
+}
+
+Channel::~Channel() {
+}
+
 Status Channel::BlockingUnaryCall(const RpcMethod& method,
                                   ClientContext* context,
                                   const Message& request, Message* response) {
+  if (IsInProcess()) {
+    // Invoke the service directly, letting it fill in the response.
+    Service* service = GetInProcessService(method.first);
+    if (service == nullptr)
+      return Status(StatusCode::UNIMPLEMENTED, "Service not registered");
+    ServerContext server_context;
+    response->Clear();
+    Status status = service->InProcessUnaryCall(method.second, &server_context,
+                                                request, response);
+    if (!status.ok())
+      response->Clear();
+    return status;
+  }
+
   // Send the request.
   arpc_protocol::ClientMessage client_message;
   arpc_protocol::UnaryRequest* unary_request =
@@ -23,30 +86,45 @@ Status Channel::BlockingUnaryCall(const RpcMethod& method,
   arpc_protocol::RpcMethod* rpc_method = unary_request->mutable_rpc_method();
   rpc_method->set_service(method.first);
   rpc_method->set_rpc(method.second);
-  ArgdataBuilder argdata_builder;
-  unary_request->set_request(request.Build(&argdata_builder));
+  if (FileDescriptorRegistry* fd_registry = GetFileDescriptorRegistry();
+      fd_registry != nullptr) {
+    // Handles of file descriptors are only known once the request has
+    // been built.
+    builder_.SetFileDescriptorRegistry(fd_registry);
+    unary_request->set_request(request.Build(&builder_));
+    builder_.AttachFileDescriptorHandles(&client_message);
+  } else {
+    unary_request->set_request_message(&request);
+  }
 
-  std::unique_ptr<argdata_writer_t> writer = argdata_writer_t::create();
-  writer->set(client_message.Build(&argdata_builder));
-  int error = writer->push(fd_->get());
-  if (error != 0)
+  // The builder may only be reset once the response has been received,
+  // as the server may duplicate file descriptors owned by it.
+  int error =
+      GetWriter()->PushUnaryRequest(fd_->get(), client_message, &builder_);
+  if (error != 0) {
+    builder_.Reset();
     return Status(StatusCode::INTERNAL, strerror(error));
+  }
 
   // Process the response.
-  return FinishUnaryResponse(response);
+  Status status = FinishUnaryResponse(context, response);
+  builder_.Reset();
+  return status;
 }
 
-Status Channel::FinishUnaryResponse(Message* response) {
-  // TODO(ed): Make message size configurable.
-  std::unique_ptr<argdata_reader_t> reader = argdata_reader_t::create(4096, 16);
-  int error = reader->pull(fd_->get());
+Status Channel::FinishUnaryResponse(ClientContext* context,
+                                    Message* response) {
+  // Don't hold back corked messages while waiting for the server.
+  int error = writer_->Flush(fd_->get());
+  if (error == 0)
+    error = reader_->Pull(fd_->get());
   if (error != 0)
     return Status(StatusCode::INTERNAL, strerror(error));
-  const argdata_t* server_response = reader->get();
+  const argdata_t* server_response = reader_->Get();
   if (server_response == nullptr)
     return Status(StatusCode::INTERNAL, "Channel closed by server");
 
-  ArgdataParser argdata_parser(reader.get());
+  ArgdataParser argdata_parser(reader_.get(), context->GetBytesAllocator());
   arpc_protocol::ServerMessage server_message;
   server_message.Parse(*server_response, &argdata_parser);
   if (!server_message.has_unary_response())
@@ -56,11 +134,120 @@ Status Channel::FinishUnaryResponse(Message* response) {
   // TODO(ed): Only do the parsing upon success!
   response->Clear();
   response->Parse(*unary_response.response(), &argdata_parser);
+  if (!argdata_parser.ok()) {
+    response->Clear();
+    return Status(StatusCode::INTERNAL, "Failed to receive file descriptors");
+  }
   const arpc_protocol::Status& status = unary_response.status();
   return Status(StatusCode(status.code()), status.message());
 }
 
+void Channel::Negotiate() {
+  // Servers that predate negotiation don't understand the request and
+  // drop the connection, so don't negotiate unless options are set.
+  negotiated_ = true;
+  if (shared_memory_ring_size_ == 0 && file_descriptor_handles_ == 0 &&
+      pidfd_threshold_ == 0 && !field_numbers_)
+    return;
+
+  // Create a shared memory region and eventfds and offer them to the
+  // server. Continue to use the socket if any of this fails. The region
+  // is mapped before offering it, so that switching to it can't fail
+  // once the server has accepted it.
+  std::shared_ptr<FileDescriptor> shared_memory;
+  std::shared_ptr<FileDescriptor> client_event_fd, server_event_fd;
+  std::unique_ptr<SharedMemoryRing> input, output;
+  if (shared_memory_ring_size_ > 0 &&
+      SharedMemoryRing::Create(shared_memory_ring_size_, &shared_memory) ==
+          0) {
+    if (SharedMemoryRing::CreateEvent(&client_event_fd) == 0 &&
+        SharedMemoryRing::CreateEvent(&server_event_fd) == 0)
+      SharedMemoryRing::Map(shared_memory->get(), shared_memory_ring_size_,
+                            true, client_event_fd, server_event_fd, &input,
+                            &output);
+  }
+  bool offer_shared_memory = input != nullptr;
+
+  // Offer a pidfd referring to this process, allowing the server to
+  // duplicate file descriptors of large unary requests.
+  std::shared_ptr<FileDescriptor> pidfd;
+#ifdef SYS_pidfd_open
+  if (pidfd_threshold_ > 0) {
+    int fd = syscall(SYS_pidfd_open, getpid(), 0);
+    if (fd >= 0)
+      pidfd = std::make_shared<FileDescriptor>(fd);
+  }
+#endif
+  if (!offer_shared_memory && file_descriptor_handles_ == 0 && !pidfd &&
+      !field_numbers_)
+    return;
+
+  arpc_protocol::ClientMessage client_message;
+  arpc_protocol::NegotiateRequest* negotiate_request =
+      client_message.mutable_negotiate_request();
+  if (offer_shared_memory) {
+    negotiate_request->set_shared_memory(shared_memory);
+    negotiate_request->set_ring_size(shared_memory_ring_size_);
+    negotiate_request->set_client_event(client_event_fd);
+    negotiate_request->set_server_event(server_event_fd);
+  }
+  negotiate_request->set_fd_handles(file_descriptor_handles_);
+  if (pidfd) {
+    negotiate_request->set_pidfd(pidfd);
+    negotiate_request->set_pidfd_number(pidfd->get());
+  }
+  negotiate_request->set_field_numbers(field_numbers_);
+
+  // Only switch if the server accepted the request. If the response
+  // can't be obtained, it's unknown whether the server has switched.
+  // Shut down the connection in that case, so that the calls that
+  // follow fail instead of using a different transport than the server.
+  ArgdataBuilder argdata_builder;
+  if (writer_->Push(fd_->get(), client_message.Build(&argdata_builder)) != 0 ||
+      reader_->Pull(fd_->get()) != 0 || reader_->Get() == nullptr) {
+    shutdown(fd_->get(), SHUT_RDWR);
+    return;
+  }
+  ArgdataParser argdata_parser(reader_.get());
+  arpc_protocol::ServerMessage server_message;
+  server_message.Parse(*reader_->Get(), &argdata_parser);
+  if (!server_message.has_negotiate_response()) {
+    shutdown(fd_->get(), SHUT_RDWR);
+    return;
+  }
+  const arpc_protocol::NegotiateResponse& negotiate_response =
+      server_message.negotiate_response();
+  if (offer_shared_memory && negotiate_response.shared_memory()) {
+    reader_->SetSharedMemory(std::move(input));
+    writer_->SetSharedMemory(std::move(output));
+  }
+
+  // Servers may accept a smaller table of file descriptors than asked
+  // for, but never a larger one.
+  if (negotiate_response.fd_handles() > 0)
+    fd_registry_ = std::make_unique<FileDescriptorRegistry>(std::min(
+        std::size_t(negotiate_response.fd_handles()),
+        file_descriptor_handles_));
+  if (negotiate_response.pidfd())
+    writer_->SetPidfdThreshold(pidfd_threshold_);
+  if (negotiate_response.field_numbers())
+    builder_.SetFieldNumbers(true);
+}
+
+Service* Channel::GetInProcessService(std::string_view name) const {
+  auto service = services_.find(name);
+  return service == services_.end() ? nullptr : service->second;
+}
+
+void Channel::EvictFileDescriptor(const std::shared_ptr<FileDescriptor>& fd) {
+  if (fd_registry_ != nullptr)
+    fd_registry_->Evict(fd);
+}
+
 arpc_connectivity_state Channel::GetState(bool try_to_connect) {
+  if (IsInProcess())
+    return ARPC_CHANNEL_READY;
+
   // Perform a non-blocking poll() call to check file descriptor state.
   struct pollfd pfd = {.fd = fd_->get(), .events = POLLIN | POLLOUT};
   if (poll(&pfd, 1, 0) == -1)
@@ -74,3 +261,9 @@ std::shared_ptr<Channel> arpc::CreateChannel(
     const std::shared_ptr<FileDescriptor>& fd) {
   return std::make_shared<Channel>(fd);
 }
+
+std::shared_ptr<Channel> arpc::CreateCustomChannel(
+    const std::shared_ptr<FileDescriptor>& fd,
+    const ChannelArguments& arguments) {
+  return std::make_shared<Channel>(fd, arguments);
+}
@@ -4,10 +4,14 @@
 
 #include <cassert>
 #include <cstring>
+#include <memory>
+#include <thread>
 
 #include <arpc++/arpc++.h>
 #include <argdata.hpp>
 
+#include "argdata_reader.h"
+#include "argdata_writer.h"
 #include "arpc_protocol.ad.h"
 
 using namespace arpc;
@@ -15,7 +19,28 @@ using namespace arpc;
 ClientReaderImpl::ClientReaderImpl(Channel* channel, const RpcMethod& method,
                                    ClientContext* context,
                                    const Message& request)
-    : fd_(channel->GetFileDescriptor()), finished_(false) {
+    : channel_(channel), context_(context), finished_(false) {
+  if (channel_->IsInProcess()) {
+    // Invoke the service in a separate thread, so that it can write
+    // messages while we're reading them. It may outlive the request.
+    Service* service = channel_->GetInProcessService(method.first);
+    if (service == nullptr) {
+      status_ = Status(StatusCode::UNIMPLEMENTED, "Service not registered");
+      finished_ = true;
+      return;
+    }
+    request_ = request.Clone();
+    stream_ = std::make_unique<InProcessStream>();
+    thread_ = std::thread([this, service, rpc = method.second]() {
+      ServerContext server_context;
+      ServerWriterImpl writer(stream_.get());
+      status_ = service->InProcessServerStreamingCall(rpc, &server_context,
+                                                      *request_, &writer);
+      stream_->Close();
+    });
+    return;
+  }
+
   // Send the request.
   arpc_protocol::ClientMessage client_message;
   arpc_protocol::UnaryRequest* unary_request =
@@ -23,19 +48,31 @@ ClientReaderImpl::ClientReaderImpl(Channel* channel, const RpcMethod& method,
   arpc_protocol::RpcMethod* rpc_method = unary_request->mutable_rpc_method();
   rpc_method->set_service(method.first);
   rpc_method->set_rpc(method.second);
-  ArgdataBuilder argdata_builder;
-  unary_request->set_request(request.Build(&argdata_builder));
+  ArgdataBuilder* argdata_builder = channel_->GetBuilder();
+  if (FileDescriptorRegistry* fd_registry =
+          channel_->GetFileDescriptorRegistry();
+      fd_registry != nullptr) {
+    argdata_builder->SetFileDescriptorRegistry(fd_registry);
+    unary_request->set_request(request.Build(argdata_builder));
+    argdata_builder->AttachFileDescriptorHandles(&client_message);
+  } else {
+    unary_request->set_request_message(&request);
+  }
   unary_request->set_server_streaming(true);
 
-  std::unique_ptr<argdata_writer_t> writer = argdata_writer_t::create();
-  writer->set(client_message.Build(&argdata_builder));
-  int error = writer->push(fd_->get());
+  int error = channel_->GetWriter()->Push(
+      channel_->GetFileDescriptor()->get(), client_message, argdata_builder);
+  argdata_builder->Reset();
   if (error != 0)
     status_ = Status(StatusCode::INTERNAL, strerror(error));
 }
 
 ClientReaderImpl::~ClientReaderImpl() {
   assert(finished_ && "RPC only completed partially");
+  if (thread_.joinable()) {
+    stream_->Cancel();
+    thread_.join();
+  }
 }
 
 Status ClientReaderImpl::Finish() {
@@ -47,17 +84,28 @@ bool ClientReaderImpl::Read(Message* msg) {
   if (finished_)
     return false;
 
-  // TODO(ed): Make buffer size configurable!
-  std::unique_ptr<argdata_reader_t> reader = argdata_reader_t::create(4096, 16);
+  if (stream_ != nullptr) {
+    if (stream_->Read(msg))
+      return true;
+    thread_.join();
+    finished_ = true;
+    return false;
+  }
+
+  // Don't hold back corked messages while waiting for the server.
+  ArgdataReader* reader = channel_->GetReader();
   {
-    int error = reader->pull(fd_->get());
+    int fd = channel_->GetFileDescriptor()->get();
+    int error = channel_->GetWriter()->Flush(fd);
+    if (error == 0)
+      error = reader->Pull(fd);
     if (error != 0) {
       status_ = Status(StatusCode::INTERNAL, strerror(error));
       finished_ = true;
       return false;
     }
   }
-  const argdata_t* input = reader->get();
+  const argdata_t* input = reader->Get();
   if (input == nullptr) {
     status_ = Status(StatusCode::INTERNAL, "Unexpected end-of-file");
     finished_ = true;
@@ -65,7 +113,7 @@ bool ClientReaderImpl::Read(Message* msg) {
   }
 
   // Parse the received message.
-  ArgdataParser argdata_parser(reader.get());
+  ArgdataParser argdata_parser(reader, context_->GetBytesAllocator());
   arpc_protocol::ServerMessage server_message;
   server_message.Parse(*input, &argdata_parser);
 
@@ -75,6 +123,13 @@ bool ClientReaderImpl::Read(Message* msg) {
         server_message.streaming_response_data();
     msg->Clear();
     msg->Parse(*streaming_response_data.response(), &argdata_parser);
+    if (!argdata_parser.ok()) {
+      msg->Clear();
+      status_ = Status(StatusCode::INTERNAL,
+                       "Failed to receive file descriptors");
+      finished_ = true;
+      return false;
+    }
     return true;
   } else if (server_message.has_streaming_response_finish()) {
     // Server has indicated no more messages are available for reading.
@@ -4,17 +4,43 @@
 
 #include <cassert>
 #include <cstring>
+#include <memory>
+#include <thread>
 
 #include <arpc++/arpc++.h>
 #include <argdata.hpp>
 
+#include "argdata_writer.h"
 #include "arpc_protocol.ad.h"
 
 using namespace arpc;
 
 ClientWriterImpl::ClientWriterImpl(Channel* channel, const RpcMethod& method,
                                    ClientContext* context, Message* response)
-    : channel_(channel), response_(response), writes_done_(false) {
+    : channel_(channel),
+      context_(context),
+      response_(response),
+      writes_done_(false) {
+  if (channel_->IsInProcess()) {
+    // Invoke the service in a separate thread, so that it can read
+    // messages while we're writing them.
+    Service* service = channel_->GetInProcessService(method.first);
+    if (service == nullptr) {
+      status_ = Status(StatusCode::UNIMPLEMENTED, "Service not registered");
+      return;
+    }
+    stream_ = std::make_unique<InProcessStream>();
+    response_->Clear();
+    thread_ = std::thread([this, service, rpc = method.second]() {
+      ServerContext server_context;
+      ServerReaderImpl reader(stream_.get());
+      server_status_ = service->InProcessClientStreamingCall(
+          rpc, &server_context, &reader, response_);
+      stream_->Cancel();
+    });
+    return;
+  }
+
   // Send the start request.
   arpc_protocol::ClientMessage client_message;
   arpc_protocol::StreamingRequestStart* streaming_request_start =
@@ -24,39 +50,60 @@ ClientWriterImpl::ClientWriterImpl(Channel* channel, const RpcMethod& method,
   rpc_method->set_service(method.first);
   rpc_method->set_rpc(method.second);
 
-  std::unique_ptr<argdata_writer_t> writer = argdata_writer_t::create();
-  ArgdataBuilder argdata_builder;
-  writer->set(client_message.Build(&argdata_builder));
-  int error = writer->push(channel_->GetFileDescriptor()->get());
+  ArgdataBuilder* argdata_builder = channel_->GetBuilder();
+  int error = channel_->GetWriter()->Push(
+      channel_->GetFileDescriptor()->get(), client_message, argdata_builder);
+  argdata_builder->Reset();
   if (error != 0)
     status_ = Status(StatusCode::INTERNAL, std::strerror(error));
 }
 
 ClientWriterImpl::~ClientWriterImpl() {
   assert((writes_done_ || !status_.ok()) && "RPC only completed partially");
+  if (thread_.joinable()) {
+    stream_->Close();
+    thread_.join();
+  }
 }
 
 Status ClientWriterImpl::Finish() {
   assert(writes_done_ && "WritesDone() not called before Finish()");
-  if (status_.ok())
-    status_ = channel_->FinishUnaryResponse(response_);
+  if (thread_.joinable()) {
+    thread_.join();
+    status_ = server_status_;
+    if (!status_.ok())
+      response_->Clear();
+  } else if (status_.ok()) {
+    status_ = channel_->FinishUnaryResponse(context_, response_);
+  }
   return status_;
 }
 
-bool ClientWriterImpl::Write(const Message& msg) {
+bool ClientWriterImpl::Write(const Message& msg, WriteOptions options) {
   assert(!writes_done_ && "Cannot call Write() after WritesDone()");
   if (!status_.ok())
     return false;
+  if (stream_ != nullptr)
+    return stream_->Write(msg);
 
   arpc_protocol::ClientMessage client_message;
   arpc_protocol::StreamingRequestData* streaming_request_data =
       client_message.mutable_streaming_request_data();
-  ArgdataBuilder argdata_builder;
-  streaming_request_data->set_request(msg.Build(&argdata_builder));
+  ArgdataBuilder* argdata_builder = channel_->GetBuilder();
+  if (FileDescriptorRegistry* fd_registry =
+          channel_->GetFileDescriptorRegistry();
+      fd_registry != nullptr) {
+    argdata_builder->SetFileDescriptorRegistry(fd_registry);
+    streaming_request_data->set_request(msg.Build(argdata_builder));
+    argdata_builder->AttachFileDescriptorHandles(&client_message);
+  } else {
+    streaming_request_data->set_request_message(&msg);
+  }
 
-  std::unique_ptr<argdata_writer_t> writer = argdata_writer_t::create();
-  writer->set(client_message.Build(&argdata_builder));
-  int error = writer->push(channel_->GetFileDescriptor()->get());
+  int error = channel_->GetWriter()->Push(
+      channel_->GetFileDescriptor()->get(), client_message, argdata_builder,
+      options.is_corked());
+  argdata_builder->Reset();
   if (error != 0) {
     status_ = Status(StatusCode::INTERNAL, std::strerror(error));
     return false;
@@ -69,13 +116,32 @@ bool ClientWriterImpl::WritesDone() {
   writes_done_ = true;
   if (!status_.ok())
     return false;
+  if (stream_ != nullptr) {
+    stream_->Close();
+    return true;
+  }
 
   arpc_protocol::ClientMessage client_message;
 
-  std::unique_ptr<argdata_writer_t> writer = argdata_writer_t::create();
-  ArgdataBuilder argdata_builder;
-  writer->set(client_message.Build(&argdata_builder));
-  int error = writer->push(channel_->GetFileDescriptor()->get());
+  ArgdataBuilder* argdata_builder = channel_->GetBuilder();
+  int error = channel_->GetWriter()->Push(
+      channel_->GetFileDescriptor()->get(), client_message, argdata_builder);
+  argdata_builder->Reset();
+  if (error != 0) {
+    status_ = Status(StatusCode::INTERNAL, std::strerror(error));
+    return false;
+  }
+  return true;
+}
+
+bool ClientWriterImpl::Flush() {
+  if (!status_.ok())
+    return false;
+  if (stream_ != nullptr)
+    return true;
+
+  int error =
+      channel_->GetWriter()->Flush(channel_->GetFileDescriptor()->get());
   if (error != 0) {
     status_ = Status(StatusCode::INTERNAL, std::strerror(error));
     return false;
@@ -0,0 +1,97 @@
+// Copyright (c) 2017 Nuxi (https://nuxi.nl/) and contributors.
+//
+// SPDX-License-Identifier: BSD-2-Clause
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <cassert>
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <exception>
+#include <memory>
+
+#include <arpc++/arpc++.h>
+
+using namespace arpc;
+
+namespace {
+
+// Reference counts of the file descriptors owned by handles, indexed by
+// file descriptor number. The table is split up into chunks that are
+// allocated on first use and never freed, so that it can be accessed
+// without locking. File descriptors beyond the end of the table are
+// stored in FileDescriptor objects instead.
+constexpr std::size_t kChunkSize = 4096;
+constexpr std::size_t kChunks = 4096;
+std::atomic<std::atomic<std::uint32_t>*> reference_counts[kChunks];
+
+std::atomic<std::uint32_t>* GetReferenceCount(int fd) {
+  std::size_t index = std::size_t(fd) / kChunkSize;
+  if (index >= kChunks)
+    return nullptr;
+  std::atomic<std::uint32_t>* chunk =
+      reference_counts[index].load(std::memory_order_acquire);
+  if (chunk == nullptr) {
+    auto new_chunk = new std::atomic<std::uint32_t>[kChunkSize]();
+    if (reference_counts[index].compare_exchange_strong(
+            chunk, new_chunk, std::memory_order_acq_rel)) {
+      chunk = new_chunk;
+    } else {
+      delete[] new_chunk;
+    }
+  }
+  return &chunk[std::size_t(fd) % kChunkSize];
+}
+
+}  // namespace
+
+FileDescriptorHandle::FileDescriptorHandle(int fd) : fd_(fd) {
+  assert(fd >= 0 && "Attempted to create invalid file descriptor handle");
+  if (std::atomic<std::uint32_t>* count = GetReferenceCount(fd)) {
+    assert(count->load(std::memory_order_relaxed) == 0 &&
+           "File descriptor is already owned by a handle");
+    count->store(1, std::memory_order_relaxed);
+  } else {
+    shared_ = std::make_shared<FileDescriptor>(fd);
+  }
+}
+
+FileDescriptorHandle::FileDescriptorHandle(const FileDescriptorHandle& handle)
+    : fd_(handle.fd_), shared_(handle.shared_) {
+  if (fd_ >= 0 && !shared_)
+    GetReferenceCount(fd_)->fetch_add(1, std::memory_order_relaxed);
+}
+
+const std::shared_ptr<FileDescriptor>& FileDescriptorHandle::Share() {
+  if (fd_ < 0 || shared_)
+    return shared_;
+  std::atomic<std::uint32_t>* count = GetReferenceCount(fd_);
+  if (count->load(std::memory_order_acquire) == 1) {
+    // No other handles refer to the file descriptor, meaning that its
+    // ownership can be passed on to the FileDescriptor object.
+    count->store(0, std::memory_order_relaxed);
+    shared_ = std::make_shared<FileDescriptor>(fd_);
+  } else if (int copy = fcntl(fd_, F_DUPFD_CLOEXEC, 0); copy >= 0) {
+    Release(fd_);
+    fd_ = copy;
+    shared_ = std::make_shared<FileDescriptor>(copy);
+  }
+  return shared_;
+}
+
+void FileDescriptorHandle::Release(int fd) {
+  // No handles can be copied from this one while it's being released,
+  // so the atomic decrement can be skipped if it's the only one.
+  std::atomic<std::uint32_t>* count = GetReferenceCount(fd);
+  if (count->load(std::memory_order_acquire) == 1)
+    count->store(0, std::memory_order_relaxed);
+  else if (count->fetch_sub(1, std::memory_order_acq_rel) != 1)
+    return;
+
+  // Terminate if file descriptor ownership is botched.
+  if (close(fd) != 0 && errno == EBADF)
+    std::terminate();
+}
@@ -0,0 +1,109 @@
+// Copyright (c) 2017 Nuxi (https://nuxi.nl/) and contributors.
+//
+// SPDX-License-Identifier: BSD-2-Clause
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <utility>
+
+#include <arpc++/arpc++.h>
+
+#include "arpc_protocol.ad.h"
+#include "file_descriptor_registry.h"
+
+using namespace arpc;
+
+FileDescriptorRegistry::FileDescriptorRegistry(std::size_t capacity)
+    : slots_(capacity) {
+  for (std::size_t i = 0; i < capacity; ++i) {
+    slots_[i].lru = lru_.insert(lru_.end(), i);
+    slots_[i].pinned = false;
+  }
+}
+
+bool FileDescriptorRegistry::Register(
+    const std::shared_ptr<FileDescriptor>& fd, std::uint64_t* handle) {
+  std::size_t index;
+  if (auto found = handles_.find(fd.get()); found != handles_.end()) {
+    index = found->second;
+  } else {
+    // Slots used by the message that is being built are the most
+    // recently used ones. If the least recently used slot is one of
+    // them, there is no slot left.
+    if (lru_.empty() || slots_[lru_.front()].pinned)
+      return false;
+    index = lru_.front();
+    Slot* slot = &slots_[index];
+    if (slot->fd)
+      handles_.erase(slot->fd.GetShared().get());
+    slot->fd = fd;
+    handles_.emplace(fd.get(), index);
+    registered_.push_back(index);
+  }
+
+  Slot* slot = &slots_[index];
+  lru_.splice(lru_.end(), lru_, slot->lru);
+  if (!slot->pinned) {
+    slot->pinned = true;
+    pinned_.push_back(index);
+  }
+  *handle = index;
+  return true;
+}
+
+void FileDescriptorRegistry::Evict(const std::shared_ptr<FileDescriptor>& fd) {
+  auto found = handles_.find(fd.get());
+  if (found == handles_.end())
+    return;
+  std::size_t index = found->second;
+  handles_.erase(found);
+  Slot* slot = &slots_[index];
+  slot->fd.reset();
+  lru_.splice(lru_.begin(), lru_, slot->lru);
+  evicted_.push_back(index);
+}
+
+void FileDescriptorRegistry::Attach(arpc_protocol::ClientMessage* message) {
+  for (std::size_t index : pinned_)
+    slots_[index].pinned = false;
+  pinned_.clear();
+  if (registered_.empty() && evicted_.empty())
+    return;
+
+  arpc_protocol::FileDescriptorHandles* fd_handles =
+      message->mutable_fd_handles();
+  for (std::size_t index : evicted_)
+    fd_handles->add_evicted(index);
+  for (std::size_t index : registered_) {
+    if (slots_[index].fd) {
+      fd_handles->add_handles(index);
+      fd_handles->add_fds(slots_[index].fd);
+    }
+  }
+  registered_.clear();
+  evicted_.clear();
+}
+
+void FileDescriptorRegistry::Apply(arpc_protocol::ClientMessage* message) {
+  if (!message->has_fd_handles())
+    return;
+  arpc_protocol::FileDescriptorHandles* fd_handles =
+      message->mutable_fd_handles();
+  for (std::uint64_t handle : fd_handles->evicted())
+    if (handle < slots_.size())
+      slots_[handle].fd.reset();
+
+  // Ignore registrations if any of the file descriptors could not be
+  // parsed, as they can then no longer be matched up with the handles.
+  if (fd_handles->handles_size() != fd_handles->fds_size())
+    return;
+  for (std::size_t i = 0; i < fd_handles->handles_size(); ++i)
+    if (std::uint64_t handle = fd_handles->handles(i); handle < slots_.size())
+      slots_[handle].fd = std::move(*fd_handles->mutable_fds(i));
+}
+
+FileDescriptorHandle FileDescriptorRegistry::Lookup(
+    std::uint64_t handle) const {
+  return handle < slots_.size() ? slots_[handle].fd : FileDescriptorHandle();
+}
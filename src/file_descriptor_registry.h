@@ -0,0 +1,76 @@
+// Copyright (c) 2017 Nuxi (https://nuxi.nl/) and contributors.
+//
+// SPDX-License-Identifier: BSD-2-Clause
+
+#ifndef SRC_FILE_DESCRIPTOR_REGISTRY_H
+#define SRC_FILE_DESCRIPTOR_REGISTRY_H
+
+#include <cstddef>
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+
+#include <arpc++/arpc++.h>
+
+namespace arpc {
+
+// Table of file descriptors that a channel has sent to the server
+// before, allowing later messages to refer to them by handle instead of
+// attaching them again. The server mirrors the table, returning the
+// file descriptors it holds when parsing messages that refer to them.
+//
+// Handles are the indices of slots in a table of fixed size. Storing a
+// file descriptor in a slot replaces the one stored in it before,
+// meaning that the number of file descriptors that the server keeps
+// open is bounded by the size of the table. When full, the least
+// recently used slot is reused, except for slots used by the message
+// that is being built. File descriptors may also be evicted explicitly.
+// Changes to the table are sent along with the next message.
+class FileDescriptorRegistry {
+ public:
+  explicit FileDescriptorRegistry(std::size_t capacity);
+
+  // Returns the handle of a file descriptor used by the message that is
+  // being built, storing it in a slot if needed. Returns false if all
+  // slots are in use by the message.
+  bool Register(const std::shared_ptr<FileDescriptor>& fd,
+                std::uint64_t* handle);
+  // Removes a file descriptor from the table, if present.
+  void Evict(const std::shared_ptr<FileDescriptor>& fd);
+  // Adds the changes made since the last call to the message that has
+  // been built.
+  void Attach(arpc_protocol::ClientMessage* message);
+
+  // Applies the changes attached to a message received by the server,
+  // taking ownership of the file descriptors that are registered.
+  void Apply(arpc_protocol::ClientMessage* message);
+  // Returns the file descriptor stored under a handle, if any.
+  FileDescriptorHandle Lookup(std::uint64_t handle) const;
+
+ private:
+  struct Slot {
+    FileDescriptorHandle fd;
+    std::list<std::size_t>::iterator lru;
+    bool pinned;
+  };
+
+  std::vector<Slot> slots_;
+
+  // Indices of the slots, least recently used first.
+  std::list<std::size_t> lru_;
+  std::unordered_map<const FileDescriptor*, std::size_t> handles_;
+
+  // Changes that have not been attached to a message yet.
+  std::vector<std::size_t> pinned_;
+  std::vector<std::size_t> registered_;
+  std::vector<std::size_t> evicted_;
+
+  FileDescriptorRegistry(FileDescriptorRegistry const&) = delete;
+  void operator=(FileDescriptorRegistry const&) = delete;
+};
+
+}  // namespace arpc
+
+#endif
@@ -0,0 +1,52 @@
+// Copyright (c) 2017 Nuxi (https://nuxi.nl/) and contributors.
+//
+// SPDX-License-Identifier: BSD-2-Clause
+
+#include <mutex>
+
+#include <arpc++/arpc++.h>
+
+using namespace arpc;
+
+InProcessStream::InProcessStream()
+    : message_(nullptr), closed_(false), cancelled_(false) {
+}
+
+bool InProcessStream::Write(const Message& msg) {
+  std::unique_lock<std::mutex> lock(mutex_);
+  if (cancelled_)
+    return false;
+
+  // Offer the message to the reader and wait for it to be copied.
+  message_ = &msg;
+  condition_.notify_all();
+  condition_.wait(lock, [this]() { return message_ == nullptr || cancelled_; });
+  if (message_ != nullptr) {
+    message_ = nullptr;
+    return false;
+  }
+  return true;
+}
+
+void InProcessStream::Close() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  closed_ = true;
+  condition_.notify_all();
+}
+
+bool InProcessStream::Read(Message* msg) {
+  std::unique_lock<std::mutex> lock(mutex_);
+  condition_.wait(lock, [this]() { return message_ != nullptr || closed_; });
+  if (message_ == nullptr)
+    return false;
+  msg->CopyFrom(*message_);
+  message_ = nullptr;
+  condition_.notify_all();
+  return true;
+}
+
+void InProcessStream::Cancel() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  cancelled_ = true;
+  condition_.notify_all();
+}
@@ -0,0 +1,228 @@
+// Copyright (c) 2017 Nuxi (https://nuxi.nl/) and contributors.
+//
+// SPDX-License-Identifier: BSD-2-Clause
+
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#endif
+
+#include <arpc++/arpc++.h>
+
+#include "io_uring.h"
+
+using namespace arpc;
+
+#if defined(IORING_FEAT_NODROP) && defined(__NR_io_uring_setup)
+IoUring::IoUring(std::shared_ptr<FileDescriptor> fd, void* rings,
+                 std::size_t rings_length, io_uring_sqe* sqes,
+                 std::size_t sqes_length, unsigned sq_entries,
+                 unsigned cq_entries, unsigned* sq_head, unsigned* sq_tail,
+                 unsigned* sq_array, unsigned* cq_head, unsigned* cq_tail,
+                 io_uring_cqe* cqes)
+    : fd_(std::move(fd)),
+      rings_(rings),
+      rings_length_(rings_length),
+      sqes_(sqes),
+      sqes_length_(sqes_length),
+      sq_entries_(sq_entries),
+      cq_entries_(cq_entries),
+      sq_head_(sq_head),
+      sq_tail_(sq_tail),
+      sq_array_(sq_array),
+      cq_head_(cq_head),
+      cq_tail_(cq_tail),
+      cqes_(cqes),
+      unsubmitted_(0) {
+}
+
+IoUring::~IoUring() {
+  munmap(sqes_, sqes_length_);
+  munmap(rings_, rings_length_);
+}
+
+int IoUring::Create(unsigned entries, std::unique_ptr<IoUring>* io_uring) {
+  // Completions are not dropped when the completion queue overflows, as
+  // long as IORING_FEAT_NODROP is supported. Require it, so that
+  // connections can't end up waiting on operations that were lost.
+  struct io_uring_params params = {};
+  int fd = syscall(__NR_io_uring_setup, entries, &params);
+  if (fd < 0)
+    return errno;
+  auto ring_fd = std::make_shared<FileDescriptor>(fd);
+  if ((params.features & IORING_FEAT_SINGLE_MMAP) == 0 ||
+      (params.features & IORING_FEAT_NODROP) == 0)
+    return ENOSYS;
+
+  // Map the submission and completion queues, which share a single
+  // mapping, and the array of submission queue entries.
+  std::size_t rings_length = std::max(
+      params.sq_off.array + params.sq_entries * sizeof(unsigned),
+      params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe));
+  void* rings = mmap(nullptr, rings_length, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+  if (rings == MAP_FAILED)
+    return errno;
+  std::size_t sqes_length = params.sq_entries * sizeof(struct io_uring_sqe);
+  void* sqes = mmap(nullptr, sqes_length, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+  if (sqes == MAP_FAILED) {
+    int error = errno;
+    munmap(rings, rings_length);
+    return error;
+  }
+
+  auto base = static_cast<std::uint8_t*>(rings);
+  *io_uring = std::make_unique<IoUring>(
+      std::move(ring_fd), rings, rings_length,
+      static_cast<struct io_uring_sqe*>(sqes), sqes_length,
+      params.sq_entries, params.cq_entries,
+      reinterpret_cast<unsigned*>(base + params.sq_off.head),
+      reinterpret_cast<unsigned*>(base + params.sq_off.tail),
+      reinterpret_cast<unsigned*>(base + params.sq_off.array),
+      reinterpret_cast<unsigned*>(base + params.cq_off.head),
+      reinterpret_cast<unsigned*>(base + params.cq_off.tail),
+      reinterpret_cast<struct io_uring_cqe*>(base + params.cq_off.cqes));
+  return 0;
+}
+
+int IoUring::PrepareRecvmsg(int fd, struct msghdr* msg,
+                            std::uint64_t user_data) {
+  struct io_uring_sqe* sqe;
+  if (int error = Prepare(&sqe); error != 0)
+    return error;
+  sqe->opcode = IORING_OP_RECVMSG;
+  sqe->fd = fd;
+  sqe->addr = reinterpret_cast<std::uintptr_t>(msg);
+  sqe->len = 1;
+  sqe->msg_flags = MSG_CMSG_CLOEXEC;
+  sqe->user_data = user_data;
+  return 0;
+}
+
+int IoUring::PrepareSendmsg(int fd, const struct msghdr* msg,
+                            std::uint64_t user_data) {
+  struct io_uring_sqe* sqe;
+  if (int error = Prepare(&sqe); error != 0)
+    return error;
+  sqe->opcode = IORING_OP_SENDMSG;
+  sqe->fd = fd;
+  sqe->addr = reinterpret_cast<std::uintptr_t>(msg);
+  sqe->len = 1;
+  sqe->msg_flags = MSG_NOSIGNAL;
+  sqe->user_data = user_data;
+  return 0;
+}
+
+int IoUring::PreparePoll(int fd, short events, std::uint64_t user_data) {
+  struct io_uring_sqe* sqe;
+  if (int error = Prepare(&sqe); error != 0)
+    return error;
+  sqe->opcode = IORING_OP_POLL_ADD;
+  sqe->fd = fd;
+  sqe->poll_events = events;
+  sqe->user_data = user_data;
+  return 0;
+}
+
+int IoUring::PrepareCancel(std::uint64_t target, std::uint64_t user_data) {
+  struct io_uring_sqe* sqe;
+  if (int error = Prepare(&sqe); error != 0)
+    return error;
+  sqe->opcode = IORING_OP_ASYNC_CANCEL;
+  sqe->fd = -1;
+  sqe->addr = target;
+  sqe->user_data = user_data;
+  return 0;
+}
+
+int IoUring::Submit(unsigned wait) {
+  while (unsubmitted_ > 0 || wait > 0) {
+    int retval = syscall(__NR_io_uring_enter, fd_->get(), unsubmitted_, wait,
+                         wait > 0 ? IORING_ENTER_GETEVENTS : 0, nullptr, 0);
+    if (retval < 0) {
+      if (errno == EINTR)
+        continue;
+      return errno;
+    }
+    unsubmitted_ -= retval;
+    if (unsubmitted_ == 0)
+      break;
+  }
+  return 0;
+}
+
+bool IoUring::PopCompletion(std::uint64_t* user_data, int* result) {
+  unsigned head = *cq_head_;
+  if (head == __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE))
+    return false;
+  const struct io_uring_cqe* cqe = &cqes_[head & (cq_entries_ - 1)];
+  *user_data = cqe->user_data;
+  *result = cqe->res;
+  __atomic_store_n(cq_head_, head + 1, __ATOMIC_RELEASE);
+  return true;
+}
+
+int IoUring::Prepare(io_uring_sqe** sqe) {
+  // Flush the submission queue to the kernel if it's full.
+  unsigned tail = *sq_tail_;
+  if (tail - __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE) >= sq_entries_) {
+    if (int error = Submit(0); error != 0)
+      return error;
+    if (tail - __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE) >= sq_entries_)
+      return EBUSY;
+  }
+
+  unsigned index = tail & (sq_entries_ - 1);
+  *sqe = &sqes_[index];
+  std::memset(*sqe, 0, sizeof(**sqe));
+  sq_array_[index] = index;
+  __atomic_store_n(sq_tail_, tail + 1, __ATOMIC_RELEASE);
+  ++unsubmitted_;
+  return 0;
+}
+#else
+IoUring::~IoUring() {
+}
+
+int IoUring::Create(unsigned entries, std::unique_ptr<IoUring>* io_uring) {
+  return ENOSYS;
+}
+
+int IoUring::PrepareRecvmsg(int fd, struct msghdr* msg,
+                            std::uint64_t user_data) {
+  return ENOSYS;
+}
+
+int IoUring::PrepareSendmsg(int fd, const struct msghdr* msg,
+                            std::uint64_t user_data) {
+  return ENOSYS;
+}
+
+int IoUring::PreparePoll(int fd, short events, std::uint64_t user_data) {
+  return ENOSYS;
+}
+
+int IoUring::PrepareCancel(std::uint64_t target, std::uint64_t user_data) {
+  return ENOSYS;
+}
+
+int IoUring::Submit(unsigned wait) {
+  return ENOSYS;
+}
+
+bool IoUring::PopCompletion(std::uint64_t* user_data, int* result) {
+  return false;
+}
+#endif
@@ -0,0 +1,74 @@
+// Copyright (c) 2017 Nuxi (https://nuxi.nl/) and contributors.
+//
+// SPDX-License-Identifier: BSD-2-Clause
+
+#ifndef SRC_IO_URING_H
+#define SRC_IO_URING_H
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+
+#include <arpc++/arpc++.h>
+
+struct io_uring_cqe;
+struct io_uring_sqe;
+
+namespace arpc {
+
+// Minimal wrapper around io_uring, used by servers to submit receive
+// and send operations for many connections using a single system call.
+// Operations are identified by a user-provided value that is returned
+// along with their result. The submission queue is flushed to the
+// kernel automatically when full.
+class IoUring {
+ public:
+  IoUring(std::shared_ptr<FileDescriptor> fd, void* rings,
+          std::size_t rings_length, io_uring_sqe* sqes,
+          std::size_t sqes_length, unsigned sq_entries, unsigned cq_entries,
+          unsigned* sq_head, unsigned* sq_tail, unsigned* sq_array,
+          unsigned* cq_head, unsigned* cq_tail, io_uring_cqe* cqes);
+  ~IoUring();
+
+  // Creates an io_uring, returning ENOSYS if unsupported.
+  static int Create(unsigned entries, std::unique_ptr<IoUring>* io_uring);
+
+  int PrepareRecvmsg(int fd, struct msghdr* msg, std::uint64_t user_data);
+  int PrepareSendmsg(int fd, const struct msghdr* msg,
+                     std::uint64_t user_data);
+  int PreparePoll(int fd, short events, std::uint64_t user_data);
+  int PrepareCancel(std::uint64_t target, std::uint64_t user_data);
+
+  // Submits all queued operations, waiting for at least the provided
+  // number of operations to complete.
+  int Submit(unsigned wait);
+  // Returns the result of the next completed operation, if any.
+  bool PopCompletion(std::uint64_t* user_data, int* result);
+
+ private:
+  int Prepare(io_uring_sqe** sqe);
+
+  const std::shared_ptr<FileDescriptor> fd_;
+  void* const rings_;
+  const std::size_t rings_length_;
+  io_uring_sqe* const sqes_;
+  const std::size_t sqes_length_;
+  const unsigned sq_entries_;
+  const unsigned cq_entries_;
+  unsigned* const sq_head_;
+  unsigned* const sq_tail_;
+  unsigned* const sq_array_;
+  unsigned* const cq_head_;
+  unsigned* const cq_tail_;
+  io_uring_cqe* const cqes_;
+
+  // Number of entries that have been queued, but not submitted.
+  unsigned unsubmitted_;
+
+  IoUring(IoUring const&) = delete;
+  void operator=(IoUring const&) = delete;
+};
+
+}  // namespace arpc
+
+#endif
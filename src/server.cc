@@ -2,39 +2,587 @@
 //
 // SPDX-License-Identifier: BSD-2-Clause
 
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include <poll.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <memory>
+#include <mutex>
 #include <thread>
 
+#if __has_include(<sys/epoll.h>)
+#include <sys/epoll.h>
+#endif
+#if __has_include(<sys/eventfd.h>)
+#include <sys/eventfd.h>
+#endif
+
 #include <arpc++/arpc++.h>
 #include <argdata.hpp>
 
+#include "argdata_reader.h"
+#include "argdata_writer.h"
 #include "arpc_protocol.ad.h"
+#include "file_descriptor_registry.h"
+#include "io_uring.h"
+#include "shared_memory_ring.h"
 
 using namespace arpc;
 
+namespace {
+
+// Types of the operations submitted through io_uring, stored in the
+// lowest bits of their user data. The remaining bits hold a pointer to
+// the connection on which the operation is performed.
+constexpr std::uint64_t kPollOperation = 0;
+constexpr std::uint64_t kReceiveOperation = 1;
+constexpr std::uint64_t kSendOperation = 2;
+constexpr std::uint64_t kCancelOperation = 3;
+
+// Number of events to retrieve per call to epoll_wait().
+constexpr int kMaxEvents = 64;
+
+// Conditions for which file descriptors are watched through epoll:
+// incoming data and hangups, hangups only, or signalled eventfds.
+enum class Watch { DATA, HANGUP, EVENT };
+
+// Wrappers around epoll and eventfds, returning ENOSYS on systems that
+// don't support them. Multiple connections can then not be handled.
+int CreateEpollFd(std::shared_ptr<FileDescriptor>* epoll) {
+#ifdef EPOLL_CLOEXEC
+  int fd = epoll_create1(EPOLL_CLOEXEC);
+  if (fd < 0)
+    return errno;
+  *epoll = std::make_shared<FileDescriptor>(fd);
+  return 0;
+#else
+  return ENOSYS;
+#endif
+}
+
+int CreateEventFd(std::shared_ptr<FileDescriptor>* event) {
+#ifdef EFD_CLOEXEC
+  int fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+  if (fd < 0)
+    return errno;
+  *event = std::make_shared<FileDescriptor>(fd);
+  return 0;
+#else
+  return ENOSYS;
+#endif
+}
+
+int WatchWithEpoll(int epoll, int fd, Watch watch, void* ptr,
+                   bool modify = false) {
+#ifdef EPOLL_CLOEXEC
+  struct epoll_event event = {};
+  event.events = watch == Watch::DATA     ? EPOLLIN | EPOLLRDHUP
+                 : watch == Watch::HANGUP ? EPOLLRDHUP
+                                          : EPOLLIN | EPOLLET;
+  event.data.ptr = ptr;
+  int op = modify ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+  return epoll_ctl(epoll, op, fd, &event) == 0 ? 0 : errno;
+#else
+  return ENOSYS;
+#endif
+}
+
+void UnwatchWithEpoll(int epoll, int fd) {
+#ifdef EPOLL_CLOEXEC
+  epoll_ctl(epoll, EPOLL_CTL_DEL, fd, nullptr);
+#endif
+}
+
+// Waits for events, storing the pointers registered with the file
+// descriptors for which they occurred.
+int WaitOnEpoll(int epoll, int timeout, void** ptrs, int* count) {
+#ifdef EPOLL_CLOEXEC
+  struct epoll_event events[kMaxEvents];
+  int retval = epoll_wait(epoll, events, kMaxEvents, timeout);
+  if (retval < 0) {
+    *count = 0;
+    return errno == EINTR ? 0 : errno;
+  }
+  for (int i = 0; i < retval; ++i)
+    ptrs[i] = events[i].data.ptr;
+  *count = retval;
+  return 0;
+#else
+  return ENOSYS;
+#endif
+}
+
+}  // namespace
+
+// State of a single connection handled by the server.
+struct Server::Connection {
+  Connection(const std::shared_ptr<FileDescriptor>& fd,
+             const ChannelArguments& arguments)
+      : fd(fd),
+        reader(arguments.GetMaxReceiveMessageSize(),
+               arguments.GetMaxReceiveFileDescriptors(),
+               arguments.GetAdaptiveReceiveBuffer()),
+        writer(arguments.GetMaxCorkedBytes(), arguments.GetMaxCorkedMessages(),
+               arguments.GetMaxCorkedDelay(), arguments.GetSpillThreshold()),
+        ready(false),
+        receiving(false),
+        sending(false),
+        send_error(0),
+        removed(false) {
+    if (ArgdataReader::IsPacketSocket(fd->get())) {
+      reader.SetPacketMode();
+      writer.SetPacketMode();
+    }
+  }
+
+  std::uint64_t GetUserData(std::uint64_t operation) const {
+    return reinterpret_cast<std::uintptr_t>(this) | operation;
+  }
+
+  const std::shared_ptr<FileDescriptor> fd;
+
+  // Reader, writer and builder that are reused for all requests
+  // processed on this connection, including the messages of streaming
+  // calls.
+  ArgdataReader reader;
+  ArgdataWriter writer;
+  ArgdataBuilder builder;
+
+  // Eventfd used by the shared memory transport, if negotiated.
+  std::shared_ptr<FileDescriptor> event;
+
+  // Whether the connection is queued to be processed.
+  bool ready;
+
+  // Operations submitted through io_uring. The reader and writer may
+  // not be used while these are pending.
+  bool receiving;
+  struct msghdr receive_msg;
+  struct iovec receive_iov;
+  bool sending;
+  struct msghdr send_msg;
+  struct iovec send_iov;
+  int send_error;
+  bool removed;
+};
+
+Server::Server(const std::shared_ptr<FileDescriptor>& fd,
+               const std::map<std::string, Service*, std::less<>>& services,
+               const ChannelArguments& arguments)
+    : services_(services),
+      arguments_(arguments),
+      pending_operations_(0),
+      polling_(false) {
+  if (fd != nullptr) {
+    connections_.push_back(std::make_unique<Connection>(fd, arguments_));
+  } else {
+    // Connections are added later on. Failures are reported by
+    // AddConnection() and HandleRequest(), which retry.
+    CreateEpoll();
+  }
+}
+
+Server::~Server() {
+  // Pending operations refer to buffers owned by the connections.
+  // Cancel them and wait for them to complete.
+  if (io_uring_ != nullptr) {
+    for (const auto& connection : connections_)
+      CancelOperations(connection.get());
+    if (polling_)
+      io_uring_->PrepareCancel(kPollOperation, kCancelOperation);
+    while (pending_operations_ > 0 && io_uring_->Submit(1) == 0) {
+      std::uint64_t user_data;
+      int result;
+      while (io_uring_->PopCompletion(&user_data, &result))
+        CompleteOperation(user_data, result);
+    }
+  }
+}
+
+int Server::CreateEpoll() {
+  std::shared_ptr<FileDescriptor> epoll_fd;
+  if (int error = CreateEpollFd(&epoll_fd); error != 0)
+    return error;
+  int epoll = epoll_fd->get();
+
+  // Use io_uring if enabled and supported. Epoll is then only used to
+  // wait on connections using the shared memory transport, and on an
+  // eventfd that is signalled when connections are added.
+  std::unique_ptr<IoUring> io_uring;
+  std::shared_ptr<FileDescriptor> wakeup;
+  if (arguments_.GetIoUringEntries() > 0 &&
+      IoUring::Create(arguments_.GetIoUringEntries(), &io_uring) == 0) {
+    if (int error = CreateEventFd(&wakeup); error != 0)
+      return error;
+    if (int error = WatchWithEpoll(epoll, wakeup->get(), Watch::EVENT,
+                                   nullptr);
+        error != 0)
+      return error;
+  }
+
+  // Register the connection passed to the constructor.
+  std::lock_guard<std::mutex> lock(connections_mutex_);
+  for (const auto& connection : connections_) {
+    if (io_uring == nullptr || connection->event != nullptr) {
+      if (int error = WatchWithEpoll(
+              epoll, connection->fd->get(),
+              connection->event != nullptr ? Watch::HANGUP : Watch::DATA,
+              connection.get());
+          error != 0)
+        return error;
+    }
+    if (connection->event != nullptr) {
+      if (int error = WatchWithEpoll(epoll, connection->event->get(),
+                                     Watch::EVENT, connection.get());
+          error != 0)
+        return error;
+    }
+  }
+  io_uring_ = std::move(io_uring);
+  wakeup_ = std::move(wakeup);
+  epoll_ = std::move(epoll_fd);
+
+  // Data may already have been received on the connection.
+  for (const auto& connection : connections_)
+    MarkReady(connection.get());
+  return 0;
+}
+
+int Server::AddConnection(const std::shared_ptr<FileDescriptor>& fd) {
+  if (epoll_ == nullptr) {
+    if (int error = CreateEpoll(); error != 0)
+      return error;
+  }
+
+  auto connection = std::make_unique<Connection>(fd, arguments_);
+  std::lock_guard<std::mutex> lock(connections_mutex_);
+  if (io_uring_ == nullptr) {
+    if (int error = WatchWithEpoll(epoll_->get(), fd->get(), Watch::DATA,
+                                   connection.get());
+        error != 0)
+      return error;
+  }
+  connections_.push_back(std::move(connection));
+
+  // Wake up the server, so that it starts receiving data from the
+  // connection.
+  if (io_uring_ != nullptr) {
+    MarkReady(connections_.back().get());
+    std::uint64_t value = 1;
+    while (write(wakeup_->get(), &value, sizeof(value)) < 0 &&
+           errno == EINTR) {
+    }
+  }
+  return 0;
+}
+
+void Server::RemoveConnection(Connection* connection) {
+  std::lock_guard<std::mutex> lock(connections_mutex_);
+  UnwatchWithEpoll(epoll_->get(), connection->fd->get());
+  if (connection->event != nullptr)
+    UnwatchWithEpoll(epoll_->get(), connection->event->get());
+  if (connection->ready)
+    ready_.erase(std::find(ready_.begin(), ready_.end(), connection));
+  auto it = std::find_if(
+      connections_.begin(), connections_.end(),
+      [connection](const auto& c) { return c.get() == connection; });
+  if (connection->receiving || connection->sending) {
+    // Keep the connection around until its operations have completed.
+    CancelOperations(connection);
+    connection->removed = true;
+    closing_connections_.splice(closing_connections_.end(), connections_,
+                                it);
+  } else {
+    connections_.erase(it);
+  }
+}
+
 int Server::HandleRequest() {
-  // Read the next message from the socket. Return end-of-file as -1.
-  // TODO(ed): Make buffer size configurable!
-  std::unique_ptr<argdata_reader_t> reader = argdata_reader_t::create(4096, 16);
-  {
-    int error = reader->pull(fd_->get());
-    if (error != 0)
+  if (epoll_ == nullptr && connections_.size() == 1) {
+    // Read the next message from the socket. Return end-of-file as -1.
+    Connection* connection = connections_.front().get();
+    {
+      int error = connection->reader.Pull(connection->fd->get());
+      if (error != 0)
+        return error;
+    }
+    if (connection->reader.Get() == nullptr)
+      return -1;
+    return HandleRequest(connection);
+  }
+
+  if (epoll_ == nullptr) {
+    if (int error = CreateEpoll(); error != 0)
       return error;
   }
-  const argdata_t* input = reader->get();
-  if (input == nullptr)
-    return -1;
+  // Connections that are closed by the client or on which errors occur
+  // are removed without affecting the other connections. Return zero in
+  // that case, so that callers may check whether any connections remain.
+  Connection* connection;
+  if (int error = WaitForRequest(&connection); error != 0)
+    return error;
+  if (connection == nullptr)
+    return 0;
+  if (connection->reader.Get() == nullptr) {
+    RemoveConnection(connection);
+    return 0;
+  }
+  // Send responses that are still corked, as opposed to flushing all
+  // connections before waiting. Process the connection again if it has
+  // more requests, or start waiting for them.
+  int error = HandleRequest(connection);
+  if (error == 0) {
+    error = io_uring_ != nullptr && connection->event == nullptr
+                ? PrepareSend(connection)
+                : connection->writer.Flush(connection->fd->get());
+  }
+  if (error != 0)
+    RemoveConnection(connection);
+  else
+    ResumeConnection(connection);
+  return 0;
+}
+
+std::size_t Server::GetConnectionCount() {
+  std::lock_guard<std::mutex> lock(connections_mutex_);
+  return connections_.size();
+}
+
+int Server::WaitForRequest(Connection** result) {
+  for (;;) {
+    // Process connections in the order in which they became ready.
+    // Only wait for events if there are none.
+    Connection* connection = nullptr;
+    {
+      std::lock_guard<std::mutex> lock(connections_mutex_);
+      if (!ready_.empty()) {
+        connection = ready_.front();
+        ready_.pop_front();
+        connection->ready = false;
+      }
+    }
+    if (connection == nullptr) {
+      if (int error =
+              io_uring_ != nullptr ? WaitForCompletions() : WaitForEvents(-1);
+          error != 0)
+        return error;
+      continue;
+    }
+
+    // Only process the connection if a complete frame has been received,
+    // so that clients sending partial frames don't block the server.
+    // Connections on which errors occur are removed, reporting them to
+    // the caller as not having a request. Connections with pending
+    // operations are queued again once these complete.
+    int error = 0;
+    if (connection->sending) {
+      // Start receiving the next request while sending the response.
+      if (connection->send_error != 0 || connection->receiving ||
+          connection->reader.IsReadable())
+        continue;
+      error = PrepareReceive(connection);
+      if (error != 0)
+        return error;
+      continue;
+    } else if (connection->send_error != 0) {
+      error = connection->send_error;
+    } else if (io_uring_ != nullptr && connection->event == nullptr) {
+      // Send the remainder of a short write before processing requests.
+      if (connection->receiving)
+        continue;
+      if (connection->writer.IsCorked()) {
+        error = PrepareSend(connection);
+        if (error == 0) {
+          ResumeConnection(connection);
+          continue;
+        }
+      } else {
+        error = connection->reader.PullBuffered();
+        if (error == EAGAIN) {
+          error = PrepareReceive(connection);
+          if (error != 0)
+            return error;
+          continue;
+        }
+      }
+    } else {
+      // Clients using the shared memory transport only need to signal
+      // their eventfd while the connection is waited on.
+      if (SharedMemoryRing* ring = connection->reader.GetSharedMemory())
+        ring->FinishWait();
+      error = connection->reader.TryPull(connection->fd->get());
+      if (error == EAGAIN) {
+        ResumeConnection(connection);
+        continue;
+      }
+    }
+    if (error != 0) {
+      RemoveConnection(connection);
+      connection = nullptr;
+    }
+    *result = connection;
+    return 0;
+  }
+}
+
+int Server::WaitForEvents(int timeout) {
+  void* ptrs[kMaxEvents];
+  int count;
+  if (int error = WaitOnEpoll(epoll_->get(), timeout, ptrs, &count);
+      error != 0)
+    return error;
+  std::lock_guard<std::mutex> lock(connections_mutex_);
+  for (int i = 0; i < count; ++i) {
+    if (ptrs[i] != nullptr) {
+      MarkReady(static_cast<Connection*>(ptrs[i]));
+    } else {
+      std::uint64_t value;
+      read(wakeup_->get(), &value, sizeof(value));
+    }
+  }
+  return 0;
+}
+
+void Server::MarkReady(Connection* connection) {
+  if (!connection->ready && !connection->removed) {
+    connection->ready = true;
+    ready_.push_back(connection);
+  }
+}
+
+void Server::ResumeConnection(Connection* connection) {
+  // Connections only need to be processed again right away if data has
+  // already been received, as epoll doesn't report it. Connections
+  // using io_uring need to start receiving data. Announce that we're
+  // about to wait on connections using the shared memory transport, so
+  // that clients signal their eventfd.
+  SharedMemoryRing* ring = connection->reader.GetSharedMemory();
+  if ((ring != nullptr && ring->PrepareWait()) ||
+      (io_uring_ != nullptr && connection->event == nullptr) ||
+      connection->reader.IsReadable()) {
+    std::lock_guard<std::mutex> lock(connections_mutex_);
+    MarkReady(connection);
+  }
+}
+
+void Server::CancelOperations(Connection* connection) {
+  if (connection->receiving)
+    io_uring_->PrepareCancel(connection->GetUserData(kReceiveOperation),
+                             kCancelOperation);
+  if (connection->sending)
+    io_uring_->PrepareCancel(connection->GetUserData(kSendOperation),
+                             kCancelOperation);
+}
+
+void Server::CompleteOperation(std::uint64_t user_data, int result) {
+  auto connection = reinterpret_cast<Connection*>(
+      static_cast<std::uintptr_t>(user_data & ~std::uint64_t(3)));
+  switch (user_data & 3) {
+    case kPollOperation:
+      polling_ = false;
+      --pending_operations_;
+      return;
+    case kReceiveOperation:
+      connection->receiving = false;
+      connection->reader.CompleteReceive(&connection->receive_msg, result);
+      break;
+    case kSendOperation:
+      connection->sending = false;
+      connection->send_error = connection->writer.CompleteFlush(result);
+      break;
+    default:
+      return;
+  }
+  --pending_operations_;
+  MarkReady(connection);
+
+  // Release removed connections once their operations have completed.
+  if (connection->removed && !connection->receiving && !connection->sending)
+    closing_connections_.remove_if(
+        [connection](const auto& c) { return c.get() == connection; });
+}
+
+int Server::PrepareReceive(Connection* connection) {
+  connection->reader.PrepareReceive(&connection->receive_msg,
+                                    &connection->receive_iov);
+  if (int error = io_uring_->PrepareRecvmsg(
+          connection->fd->get(), &connection->receive_msg,
+          connection->GetUserData(kReceiveOperation));
+      error != 0)
+    return error;
+  connection->receiving = true;
+  ++pending_operations_;
+  return 0;
+}
+
+int Server::PrepareSend(Connection* connection) {
+  // Fall back to sending synchronously if the data cannot be sent
+  // through io_uring.
+  if (!connection->writer.PrepareFlush(&connection->send_msg,
+                                       &connection->send_iov) ||
+      io_uring_->PrepareSendmsg(connection->fd->get(), &connection->send_msg,
+                                connection->GetUserData(kSendOperation)) !=
+          0)
+    return connection->writer.Flush(connection->fd->get());
+  connection->sending = true;
+  ++pending_operations_;
+  return 0;
+}
+
+int Server::WaitForCompletions() {
+  // Connections using the shared memory transport and connections that
+  // have been added are reported through epoll. Wait on it as well.
+  if (!polling_) {
+    if (int error = io_uring_->PreparePoll(epoll_->get(), POLLIN,
+                                           kPollOperation);
+        error != 0)
+      return error;
+    polling_ = true;
+    ++pending_operations_;
+  }
+  if (int error = io_uring_->Submit(1); error != 0)
+    return error;
+
+  bool polled = false;
+  {
+    std::lock_guard<std::mutex> lock(connections_mutex_);
+    std::uint64_t user_data;
+    int result;
+    while (io_uring_->PopCompletion(&user_data, &result)) {
+      if ((user_data & 3) == kPollOperation)
+        polled = true;
+      CompleteOperation(user_data, result);
+    }
+  }
+  return polled ? WaitForEvents(0) : 0;
+}
+
+int Server::HandleRequest(Connection* connection) {
+  const argdata_t* input = connection->reader.Get();
+
+  // When using io_uring, responses are sent asynchronously after the
+  // request has been processed.
+  bool corked = io_uring_ != nullptr && connection->event == nullptr;
 
   // Parse the received message.
-  ArgdataParser argdata_parser(reader.get());
+  ArgdataParser argdata_parser(&connection->reader);
   arpc_protocol::ClientMessage client_message;
   client_message.Parse(*input, &argdata_parser);
+  if (FileDescriptorRegistry* fd_registry =
+          connection->reader.GetFileDescriptorRegistry())
+    fd_registry->Apply(&client_message);
 
   if (client_message.has_unary_request()) {
     const arpc_protocol::UnaryRequest& unary_request =
         client_message.unary_request();
     const arpc_protocol::RpcMethod& rpc_method = unary_request.rpc_method();
 
-    ArgdataBuilder argdata_builder;
+    ArgdataBuilder* argdata_builder = &connection->builder;
     arpc_protocol::ServerMessage server_message;
     if (unary_request.server_streaming()) {
       // Server-streaming call.
@@ -50,7 +598,8 @@ int Server::HandleRequest() {
       } else {
         // Service found. Invoke call.
         ServerContext context;
-        ServerWriterImpl writer(fd_);
+        ServerWriterImpl writer(connection->fd, &connection->writer,
+                                argdata_builder);
         Status rpc_status = service->second->BlockingServerStreamingCall(
             rpc_method.rpc(), &context, *unary_request.request(),
             &argdata_parser, &writer);
@@ -75,7 +624,7 @@ int Server::HandleRequest() {
         const argdata_t* response = argdata_t::null();
         Status rpc_status = service->second->BlockingUnaryCall(
             rpc_method.rpc(), &context, *unary_request.request(),
-            &argdata_parser, &response, &argdata_builder);
+            &argdata_parser, &response, argdata_builder);
         arpc_protocol::Status* status = unary_response->mutable_status();
         status->set_code(arpc_protocol::StatusCode(rpc_status.error_code()));
         status->set_message(rpc_status.error_message());
@@ -83,9 +632,10 @@ int Server::HandleRequest() {
       }
     }
 
-    std::unique_ptr<argdata_writer_t> writer = argdata_writer_t::create();
-    writer->set(server_message.Build(&argdata_builder));
-    return writer->push(fd_->get());
+    int error = connection->writer.Push(connection->fd->get(), server_message,
+                                        argdata_builder, corked);
+    argdata_builder->Reset();
+    return error;
   } else if (client_message.has_streaming_request_start()) {
     // Client-streaming call.
     // TODO(ed): Implement bidirectional streaming calls?
@@ -98,7 +648,7 @@ int Server::HandleRequest() {
         server_message.mutable_unary_response();
 
     // Find corresponding service.
-    ArgdataBuilder argdata_builder;
+    ArgdataBuilder* argdata_builder = &connection->builder;
     auto service = services_.find(rpc_method.service());
     if (service == services_.end()) {
       // Service not found.
@@ -108,19 +658,94 @@ int Server::HandleRequest() {
     } else {
       // Service found. Invoke call.
       ServerContext context;
-      ServerReaderImpl reader(fd_);
+      ServerReaderImpl reader(connection->fd, &connection->reader);
       const argdata_t* response = argdata_t::null();
       Status rpc_status = service->second->BlockingClientStreamingCall(
-          rpc_method.rpc(), &context, &reader, &response, &argdata_builder);
+          rpc_method.rpc(), &context, &reader, &response, argdata_builder);
       arpc_protocol::Status* status = unary_response->mutable_status();
       status->set_code(arpc_protocol::StatusCode(rpc_status.error_code()));
       status->set_message(rpc_status.error_message());
       unary_response->set_response(response);
     }
 
-    std::unique_ptr<argdata_writer_t> writer = argdata_writer_t::create();
-    writer->set(server_message.Build(&argdata_builder));
-    return writer->push(fd_->get());
+    int error = connection->writer.Push(connection->fd->get(), server_message,
+                                        argdata_builder, corked);
+    argdata_builder->Reset();
+    return error;
+  } else if (client_message.has_negotiate_request()) {
+    // Request to switch to the shared memory transport. Only accept it
+    // if enabled and if the shared memory region is usable.
+    arpc_protocol::NegotiateRequest* negotiate_request =
+        client_message.mutable_negotiate_request();
+    arpc_protocol::ServerMessage server_message;
+    arpc_protocol::NegotiateResponse* negotiate_response =
+        server_message.mutable_negotiate_response();
+    std::unique_ptr<SharedMemoryRing> input, output;
+    const std::shared_ptr<FileDescriptor>& server_event =
+        negotiate_request->mutable_server_event()->Share();
+    const std::shared_ptr<FileDescriptor>& client_event =
+        negotiate_request->mutable_client_event()->Share();
+    if (negotiate_request->ring_size() > 0 &&
+        negotiate_request->ring_size() <=
+            arguments_.GetSharedMemoryRingSize() &&
+        negotiate_request->shared_memory() && client_event && server_event &&
+        SharedMemoryRing::Map(negotiate_request->shared_memory().get(),
+                              negotiate_request->ring_size(), false,
+                              server_event, client_event, &input,
+                              &output) == 0)
+      negotiate_response->set_shared_memory(true);
+
+    // Mirror the table of file descriptors sent by handle, limiting its
+    // size to bound the number of file descriptors kept open.
+    std::size_t fd_handles =
+        std::min(std::size_t(negotiate_request->fd_handles()),
+                 arguments_.GetFileDescriptorHandles());
+    if (fd_handles > 0) {
+      connection->reader.SetFileDescriptorRegistry(
+          std::make_unique<FileDescriptorRegistry>(fd_handles));
+      negotiate_response->set_fd_handles(fd_handles);
+    }
+
+    // Allow duplicating file descriptors from the client, if permitted.
+    if (arguments_.GetPidfdThreshold() > 0 && negotiate_request->pidfd() &&
+        connection->reader.SetPidfd(
+            negotiate_request->mutable_pidfd()->Share(),
+            negotiate_request->pidfd_number()) == 0)
+      negotiate_response->set_pidfd(true);
+
+    // Switch to field numbers once the response has been sent.
+    bool field_numbers =
+        arguments_.GetFieldNumbers() && negotiate_request->field_numbers();
+    negotiate_response->set_field_numbers(field_numbers);
+
+    int error = connection->writer.Push(
+        connection->fd->get(), server_message.Build(&connection->builder));
+    connection->builder.Reset();
+    if (error != 0)
+      return error;
+    connection->builder.SetFieldNumbers(field_numbers);
+    if (input != nullptr) {
+      connection->reader.SetSharedMemory(std::move(input));
+      connection->writer.SetSharedMemory(std::move(output));
+
+      // Messages are no longer received through the socket, so only
+      // watch it for hangups. Wait on the eventfd instead.
+      std::lock_guard<std::mutex> lock(connections_mutex_);
+      connection->event = server_event;
+      if (epoll_ != nullptr) {
+        if (int error = WatchWithEpoll(epoll_->get(), connection->fd->get(),
+                                       Watch::HANGUP, connection,
+                                       io_uring_ == nullptr);
+            error != 0)
+          return error;
+        if (int error = WatchWithEpoll(epoll_->get(),
+                                       connection->event->get(),
+                                       Watch::EVENT, connection);
+            error != 0)
+          return error;
+      }
+    }
+    return 0;
   } else {
     // Invalid operation.
     return EOPNOTSUPP;
@@ -7,6 +7,7 @@
 #include <arpc++/arpc++.h>
 #include <argdata.hpp>
 
+#include "argdata_reader.h"
 #include "arpc_protocol.ad.h"
 
 using namespace arpc;
@@ -19,23 +20,31 @@ bool ServerReaderImpl::Read(Message* msg) {
   if (finished_)
     return false;
 
-  // TODO(ed): Make buffer size configurable!
-  std::unique_ptr<argdata_reader_t> reader = argdata_reader_t::create(4096, 16);
+  if (stream_ != nullptr) {
+    if (stream_->Read(msg))
+      return true;
+    finished_ = true;
+    return false;
+  }
+
   {
-    int error = reader->pull(fd_->get());
+    int error = reader_->Pull(fd_->get());
     if (error != 0)
       return error;
   }
-  const argdata_t* input = reader->get();
+  const argdata_t* input = reader_->Get();
   if (input == nullptr) {
     finished_ = true;
     return false;
   }
 
   // Parse the received message.
-  ArgdataParser argdata_parser(reader.get());
+  ArgdataParser argdata_parser(reader_);
   arpc_protocol::ClientMessage client_message;
   client_message.Parse(*input, &argdata_parser);
+  if (FileDescriptorRegistry* fd_registry =
+          reader_->GetFileDescriptorRegistry())
+    fd_registry->Apply(&client_message);
 
   if (client_message.has_streaming_request_data()) {
     // Client has sent an additional streamed message.
@@ -43,6 +52,11 @@ bool ServerReaderImpl::Read(Message* msg) {
         client_message.streaming_request_data();
     msg->Clear();
     msg->Parse(*streaming_request_data.request(), &argdata_parser);
+    if (!argdata_parser.ok()) {
+      msg->Clear();
+      finished_ = true;
+      return false;
+    }
     return true;
   } else if (client_message.has_streaming_request_finish()) {
     // Client has indicated no more messages are available for reading.
@@ -2,19 +2,36 @@
 //
 // SPDX-License-Identifier: BSD-2-Clause
 
+#include <sys/mman.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
 
 #include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
 #include <unistd.h>
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
 #include <cstdint>
+#include <cstring>
+#include <future>
+#include <iterator>
 #include <memory>
+#include <string>
 #include <thread>
+#include <utility>
+#include <vector>
 
 #include <arpc++/arpc++.h>
 #include <gtest/gtest.h>
 #include <argdata.hpp>
 
+#include "arena.h"
+#include "argdata_reader.h"
+#include "argdata_writer.h"
 #include "server_test_proto.ad.h"
 
 TEST(Server, EndOfFile) {
@@ -87,6 +104,9 @@ class EchoService final : public server_test_proto::UnaryService::Service {
                          server_test_proto::UnaryOutput* response) override {
     response->set_text(request->text());
     response->set_file_descriptor(request->file_descriptor());
+    response->set_data(request->data());
+    response->set_stream(request->stream());
+    response->set_table(request->table());
     return arpc::Status::OK;
   }
 };
@@ -125,6 +145,472 @@ TEST(Server, UnaryEcho) {
   caller.join();
 }
 
+TEST(Server, UnaryEchoVaryingSizes) {
+  // Alternate between small messages and messages that are larger than
+  // the initial receive buffer, so that buffers get resized.
+  int fds[2];
+  EXPECT_EQ(0, socketpair(AF_UNIX, SOCK_STREAM, 0, fds));
+  std::shared_ptr<arpc::Channel> channel =
+      arpc::CreateChannel(std::make_shared<arpc::FileDescriptor>(fds[0]));
+  std::unique_ptr<server_test_proto::UnaryService::Stub> stub =
+      server_test_proto::UnaryService::NewStub(channel);
+  const std::size_t sizes[] = {10, 1000000, 10, 100000, 100000, 10};
+  std::thread caller([&stub, &sizes]() {
+    for (std::size_t size : sizes) {
+      arpc::ClientContext context;
+      server_test_proto::UnaryInput input;
+      server_test_proto::UnaryOutput output;
+      input.set_text(std::string(size, 'x'));
+      EXPECT_TRUE(stub->UnaryCall(&context, input, &output).ok());
+      EXPECT_EQ(input.text(), output.text());
+    }
+  });
+
+  arpc::ServerBuilder builder(std::make_shared<arpc::FileDescriptor>(fds[1]));
+  EchoService service;
+  builder.RegisterService(&service);
+  std::shared_ptr<arpc::Server> server = builder.Build();
+  for (std::size_t i = 0; i < std::size(sizes); ++i)
+    EXPECT_EQ(0, server->HandleRequest());
+  caller.join();
+}
+
+TEST(Server, UnaryEchoReferenced) {
+  // Large strings and binary blobs are sent without copying them into
+  // the send buffer. They should arrive intact, regardless of whether
+  // they are followed by other fields.
+  int fds[2];
+  EXPECT_EQ(0, socketpair(AF_UNIX, SOCK_STREAM, 0, fds));
+  std::shared_ptr<arpc::Channel> channel =
+      arpc::CreateChannel(std::make_shared<arpc::FileDescriptor>(fds[0]));
+  std::unique_ptr<server_test_proto::UnaryService::Stub> stub =
+      server_test_proto::UnaryService::NewStub(channel);
+  std::thread caller([&stub]() {
+    arpc::ClientContext context;
+    server_test_proto::UnaryInput input;
+    server_test_proto::UnaryOutput output;
+    std::string data(300000, '\0');
+    for (std::size_t i = 0; i < data.size(); ++i)
+      data[i] = i * 7;
+    input.set_text(std::string(5000, 'x'));
+    input.set_data(data);
+    EXPECT_TRUE(stub->UnaryCall(&context, input, &output).ok());
+    EXPECT_EQ(input.text(), output.text());
+    EXPECT_EQ(input.data(), output.data());
+
+    input.set_text("Hello");
+    EXPECT_TRUE(stub->UnaryCall(&context, input, &output).ok());
+    EXPECT_EQ("Hello", output.text());
+    EXPECT_EQ(input.data(), output.data());
+  });
+
+  arpc::ServerBuilder builder(std::make_shared<arpc::FileDescriptor>(fds[1]));
+  EchoService service;
+  builder.RegisterService(&service);
+  std::shared_ptr<arpc::Server> server = builder.Build();
+  EXPECT_EQ(0, server->HandleRequest());
+  EXPECT_EQ(0, server->HandleRequest());
+  caller.join();
+}
+
+TEST(Server, UnaryEchoBytesAllocator) {
+  // Bytes fields of responses should be stored in the buffers returned
+  // by the allocator set on the ClientContext.
+  int fds[2];
+  EXPECT_EQ(0, socketpair(AF_UNIX, SOCK_STREAM, 0, fds));
+  std::shared_ptr<arpc::Channel> channel =
+      arpc::CreateChannel(std::make_shared<arpc::FileDescriptor>(fds[0]));
+  std::unique_ptr<server_test_proto::UnaryService::Stub> stub =
+      server_test_proto::UnaryService::NewStub(channel);
+  std::thread caller([&stub]() {
+    arpc::ClientContext context;
+    std::string buffer;
+    context.SetBytesAllocator(
+        [&buffer](std::string_view field, std::size_t size) -> void* {
+          EXPECT_EQ("data", field);
+          if (size < 1000)
+            return nullptr;
+          buffer.resize(size);
+          return buffer.data();
+        });
+    server_test_proto::UnaryInput input;
+    server_test_proto::UnaryOutput output;
+    input.set_text("Hello");
+    input.set_data(std::string(2000000, 'x'));
+    EXPECT_TRUE(stub->UnaryCall(&context, input, &output).ok());
+    EXPECT_EQ("Hello", output.text());
+    EXPECT_EQ("", output.data());
+    EXPECT_EQ(input.data(), buffer);
+
+    // Small fields are still stored in the message.
+    input.set_data("Small");
+    EXPECT_TRUE(stub->UnaryCall(&context, input, &output).ok());
+    EXPECT_EQ("Small", output.data());
+  });
+
+  arpc::ServerBuilder builder(std::make_shared<arpc::FileDescriptor>(fds[1]));
+  EchoService service;
+  builder.RegisterService(&service);
+  std::shared_ptr<arpc::Server> server = builder.Build();
+  EXPECT_EQ(0, server->HandleRequest());
+  EXPECT_EQ(0, server->HandleRequest());
+  caller.join();
+}
+
+TEST(Server, UnaryEchoByteStream) {
+  // Streams should be passed along as pipes. Let the server echo them,
+  // so that the client ends up receiving the data it sent.
+  int fds[2];
+  EXPECT_EQ(0, socketpair(AF_UNIX, SOCK_STREAM, 0, fds));
+  std::shared_ptr<arpc::Channel> channel =
+      arpc::CreateChannel(std::make_shared<arpc::FileDescriptor>(fds[0]));
+  std::unique_ptr<server_test_proto::UnaryService::Stub> stub =
+      server_test_proto::UnaryService::NewStub(channel);
+  std::thread caller([&stub]() {
+    // Stream data from a buffer, splicing it into a file.
+    std::shared_ptr<arpc::ByteStream> stream;
+    EXPECT_EQ(0, arpc::ByteStream::Create(1000000, &stream));
+    std::string data(stream->size(), '\0');
+    for (std::size_t i = 0; i < data.size(); ++i)
+      data[i] = i * 7;
+    std::copy(data.begin(), data.end(), static_cast<char*>(stream->data()));
+    {
+      arpc::ClientContext context;
+      server_test_proto::UnaryInput input;
+      server_test_proto::UnaryOutput output;
+      input.set_stream(stream);
+      EXPECT_TRUE(stub->UnaryCall(&context, input, &output).ok());
+      ASSERT_TRUE(output.stream());
+
+      FILE* file = tmpfile();
+      std::size_t length;
+      EXPECT_EQ(0, output.stream()->SpliceTo(fileno(file), &length));
+      EXPECT_EQ(data.size(), length);
+      std::string received(data.size(), '\0');
+      EXPECT_EQ(data.size(),
+                pread(fileno(file), received.data(), received.size(), 0));
+      EXPECT_EQ(data, received);
+      fclose(file);
+    }
+
+    // Stream data from a pipe, reading it.
+    int pipefds[2];
+    EXPECT_EQ(0, pipe(pipefds));
+    EXPECT_EQ(5, write(pipefds[1], "Hello", 5));
+    EXPECT_EQ(0, close(pipefds[1]));
+    {
+      arpc::ClientContext context;
+      server_test_proto::UnaryInput input;
+      server_test_proto::UnaryOutput output;
+      input.set_stream(arpc::ByteStream::FromFileDescriptor(
+          std::make_shared<arpc::FileDescriptor>(pipefds[0])));
+      EXPECT_TRUE(stub->UnaryCall(&context, input, &output).ok());
+      ASSERT_TRUE(output.stream());
+
+      char buf[10];
+      std::size_t received;
+      EXPECT_EQ(0, output.stream()->Read(buf, sizeof(buf), &received));
+      EXPECT_EQ("Hello", std::string_view(buf, received));
+      EXPECT_EQ(0, output.stream()->Read(buf, sizeof(buf), &received));
+      EXPECT_EQ(0, received);
+    }
+  });
+
+  arpc::ServerBuilder builder(std::make_shared<arpc::FileDescriptor>(fds[1]));
+  EchoService service;
+  builder.RegisterService(&service);
+  std::shared_ptr<arpc::Server> server = builder.Build();
+  EXPECT_EQ(0, server->HandleRequest());
+  EXPECT_EQ(0, server->HandleRequest());
+  caller.join();
+}
+
+TEST(Server, ByteStreamDestroyed) {
+  // Destroying a stream whose data hasn't been consumed should stop the
+  // thread feeding it, so that the receiver observes end-of-file early.
+  std::shared_ptr<arpc::ByteStream> stream;
+  EXPECT_EQ(0, arpc::ByteStream::Create(16 << 20, &stream));
+  std::shared_ptr<arpc::FileDescriptor> pipe;
+  EXPECT_EQ(0, stream->Open(&pipe));
+  stream.reset();
+
+  FILE* file = tmpfile();
+  std::size_t length;
+  EXPECT_EQ(0, arpc::ByteStream::FromPipe(pipe)->SpliceTo(fileno(file),
+                                                          &length));
+  EXPECT_GT(std::size_t(16 << 20), length);
+  fclose(file);
+}
+
+TEST(Server, UnaryEchoSharedBuffer) {
+  // Shared buffers should be passed along as the memfd storing them.
+  int fds[2];
+  EXPECT_EQ(0, socketpair(AF_UNIX, SOCK_STREAM, 0, fds));
+  std::shared_ptr<arpc::Channel> channel =
+      arpc::CreateChannel(std::make_shared<arpc::FileDescriptor>(fds[0]));
+  std::unique_ptr<server_test_proto::UnaryService::Stub> stub =
+      server_test_proto::UnaryService::NewStub(channel);
+  std::thread caller([&stub]() {
+    std::string data(1000000, 'x');
+    std::shared_ptr<arpc::SharedBuffer> table;
+    EXPECT_EQ(0, arpc::SharedBuffer::Create(data, &table));
+    EXPECT_EQ(data, table->data());
+
+    arpc::ClientContext context;
+    server_test_proto::UnaryInput input;
+    server_test_proto::UnaryOutput output;
+    input.set_table(table);
+    EXPECT_TRUE(stub->UnaryCall(&context, input, &output).ok());
+    ASSERT_TRUE(output.table());
+    EXPECT_NE(table, output.table());
+    EXPECT_EQ(data.size(), output.table()->size());
+    EXPECT_EQ(data, output.table()->data());
+  });
+
+  arpc::ServerBuilder builder(std::make_shared<arpc::FileDescriptor>(fds[1]));
+  EchoService service;
+  builder.RegisterService(&service);
+  EXPECT_EQ(0, builder.Build()->HandleRequest());
+  caller.join();
+
+  // File descriptors that are not sealed should be rejected, as their
+  // contents may change while being accessed.
+  std::shared_ptr<arpc::SharedBuffer> table;
+  EXPECT_EQ(EBADMSG, arpc::SharedBuffer::FromFileDescriptor(
+                         std::make_shared<arpc::FileDescriptor>(
+                             memfd_create("test", MFD_CLOEXEC)),
+                         &table));
+}
+
+namespace {
+
+// Service that records the file descriptors it receives.
+class RecordingService final : public server_test_proto::UnaryService::Service {
+ public:
+  arpc::Status UnaryCall(arpc::ServerContext* context,
+                         const server_test_proto::UnaryInput* request,
+                         server_test_proto::UnaryOutput* response) override {
+    struct stat sb;
+    EXPECT_EQ(0, fstat(request->file_descriptor().get(), &sb));
+    inodes.push_back(sb.st_ino);
+    file_descriptors.push_back(request->file_descriptor());
+    return arpc::Status::OK;
+  }
+
+  std::vector<ino_t> inodes;
+  std::vector<arpc::FileDescriptorHandle> file_descriptors;
+};
+
+}  // namespace
+
+TEST(Server, UnaryFileDescriptorHandles) {
+  // File descriptors that have been sent before should be referred to
+  // by handle, causing the server to reuse its copy of them.
+  int fds[2];
+  EXPECT_EQ(0, socketpair(AF_UNIX, SOCK_STREAM, 0, fds));
+  arpc::ChannelArguments arguments;
+  arguments.SetFileDescriptorHandles(3);
+  std::shared_ptr<arpc::Channel> channel = arpc::CreateCustomChannel(
+      std::make_shared<arpc::FileDescriptor>(fds[0]), arguments);
+  std::unique_ptr<server_test_proto::UnaryService::Stub> stub =
+      server_test_proto::UnaryService::NewStub(channel);
+  std::vector<std::shared_ptr<arpc::FileDescriptor>> pipes;
+  std::vector<ino_t> inodes;
+  for (int i = 0; i < 3; ++i) {
+    int pipefds[2];
+    EXPECT_EQ(0, pipe(pipefds));
+    EXPECT_EQ(0, close(pipefds[1]));
+    pipes.push_back(std::make_shared<arpc::FileDescriptor>(pipefds[0]));
+    struct stat sb;
+    EXPECT_EQ(0, fstat(pipefds[0], &sb));
+    inodes.push_back(sb.st_ino);
+  }
+
+  // The server only accepts a table with two slots, meaning that
+  // sending a third file descriptor evicts the least recently used one.
+  // Before the last call, the first file descriptor is evicted
+  // explicitly, causing it to be transmitted once more.
+  const std::size_t sequence[] = {0, 0, 1, 0, 2, 1, 0, 0};
+  std::thread caller([&]() {
+    for (std::size_t i = 0; i < std::size(sequence); ++i) {
+      if (i == 7)
+        channel->EvictFileDescriptor(pipes[0]);
+      arpc::ClientContext context;
+      server_test_proto::UnaryInput input;
+      server_test_proto::UnaryOutput output;
+      input.set_file_descriptor(pipes[sequence[i]]);
+      EXPECT_TRUE(stub->UnaryCall(&context, input, &output).ok());
+    }
+  });
+
+  arpc::ServerBuilder builder(std::make_shared<arpc::FileDescriptor>(fds[1]));
+  builder.SetFileDescriptorHandles(2);
+  RecordingService service;
+  builder.RegisterService(&service);
+  std::shared_ptr<arpc::Server> server = builder.Build();
+  EXPECT_EQ(0, server->HandleRequest());
+  for (std::size_t i = 0; i < std::size(sequence); ++i) {
+    EXPECT_EQ(0, server->HandleRequest());
+    EXPECT_EQ(inodes[sequence[i]], service.inodes[i]);
+  }
+  caller.join();
+
+  // Only calls that reused a slot should have yielded the same file
+  // descriptor. File descriptors that are no longer stored in a slot
+  // should be closed once the service drops them.
+  std::vector<arpc::FileDescriptorHandle>& received =
+      service.file_descriptors;
+  EXPECT_EQ(received[0], received[1]);
+  EXPECT_EQ(received[0], received[3]);
+  EXPECT_NE(received[0], received[6]);
+  EXPECT_NE(received[2], received[5]);
+  EXPECT_NE(received[6], received[7]);
+  std::vector<int> numbers;
+  for (arpc::FileDescriptorHandle& fd : received) {
+    numbers.push_back(fd.get());
+    fd.reset();
+  }
+  const bool closed[] = {true, true, true, true, true, false, true, false};
+  for (std::size_t i = 0; i < std::size(closed); ++i)
+    EXPECT_EQ(closed[i], fcntl(numbers[i], F_GETFD) < 0) << i;
+}
+
+TEST(Server, UnaryEchoPidfd) {
+  // When negotiated, the server should duplicate file descriptors of
+  // unary requests from the client, instead of receiving them.
+  int fds[2];
+  EXPECT_EQ(0, socketpair(AF_UNIX, SOCK_STREAM, 0, fds));
+  std::thread caller([fd = fds[0]]() {
+    arpc::ChannelArguments arguments;
+    arguments.SetPidfdThreshold(1);
+    std::unique_ptr<server_test_proto::UnaryService::Stub> stub =
+        server_test_proto::UnaryService::NewStub(arpc::CreateCustomChannel(
+            std::make_shared<arpc::FileDescriptor>(fd), arguments));
+    for (int i = 0; i < 2; ++i) {
+      arpc::ClientContext context;
+      server_test_proto::UnaryInput input;
+      server_test_proto::UnaryOutput output;
+
+      int pfds[2];
+      EXPECT_EQ(0, pipe(pfds));
+      EXPECT_EQ(5, write(pfds[1], "Hello", 5));
+      EXPECT_EQ(0, close(pfds[1]));
+      input.set_file_descriptor(
+          std::make_shared<arpc::FileDescriptor>(pfds[0]));
+      EXPECT_TRUE(stub->UnaryCall(&context, input, &output).ok());
+
+      char buf[6];
+      EXPECT_EQ(5, read(output.file_descriptor().get(), buf, sizeof(buf)));
+      EXPECT_EQ("Hello", std::string_view(buf, 5));
+    }
+  });
+
+  arpc::ServerBuilder builder(std::make_shared<arpc::FileDescriptor>(fds[1]));
+  EchoService service;
+  builder.RegisterService(&service);
+  builder.SetPidfdThreshold(1);
+  std::shared_ptr<arpc::Server> server = builder.Build();
+  for (int i = 0; i < 3; ++i)
+    EXPECT_EQ(0, server->HandleRequest());
+  caller.join();
+  EXPECT_EQ(-1, server->HandleRequest());
+}
+
+TEST(Server, UnaryEchoFieldNumbers) {
+  // Field numbers should only be used if enabled on both sides.
+  for (bool server_field_numbers : {false, true}) {
+    int fds[2];
+    EXPECT_EQ(0, socketpair(AF_UNIX, SOCK_STREAM, 0, fds));
+    arpc::ChannelArguments arguments;
+    arguments.SetFieldNumbers(true);
+    std::shared_ptr<arpc::Channel> channel = arpc::CreateCustomChannel(
+        std::make_shared<arpc::FileDescriptor>(fds[0]), arguments);
+    std::thread caller([&channel]() {
+      std::unique_ptr<server_test_proto::UnaryService::Stub> stub =
+          server_test_proto::UnaryService::NewStub(channel);
+      for (int i = 0; i < 2; ++i) {
+        arpc::ClientContext context;
+        server_test_proto::UnaryInput input;
+        server_test_proto::UnaryOutput output;
+        input.set_text("Hello");
+        EXPECT_TRUE(stub->UnaryCall(&context, input, &output).ok());
+        EXPECT_EQ("Hello", output.text());
+      }
+    });
+
+    arpc::ServerBuilder builder(
+        std::make_shared<arpc::FileDescriptor>(fds[1]));
+    EchoService service;
+    builder.RegisterService(&service);
+    builder.SetFieldNumbers(server_field_numbers);
+    std::shared_ptr<arpc::Server> server = builder.Build();
+    for (int i = 0; i < 3; ++i)
+      EXPECT_EQ(0, server->HandleRequest());
+    caller.join();
+    EXPECT_EQ(server_field_numbers, channel->GetBuilder()->UsesFieldNumbers());
+    channel.reset();
+    EXPECT_EQ(-1, server->HandleRequest());
+  }
+}
+
+TEST(Server, UnaryEchoSeqpacket) {
+  // Messages should also be exchanged over SOCK_SEQPACKET sockets,
+  // including ones that don't fit in a single packet.
+  int fds[2];
+  EXPECT_EQ(0, socketpair(AF_UNIX, SOCK_SEQPACKET, 0, fds));
+  std::shared_ptr<arpc::Channel> channel =
+      arpc::CreateChannel(std::make_shared<arpc::FileDescriptor>(fds[0]));
+  std::unique_ptr<server_test_proto::UnaryService::Stub> stub =
+      server_test_proto::UnaryService::NewStub(channel);
+  const std::size_t sizes[] = {10, 65000, 100000, 2000000, 10};
+  std::thread caller([&stub, &sizes]() {
+    for (std::size_t size : sizes) {
+      arpc::ClientContext context;
+      server_test_proto::UnaryInput input;
+      server_test_proto::UnaryOutput output;
+      input.set_text(std::string(size, 'x'));
+      EXPECT_TRUE(stub->UnaryCall(&context, input, &output).ok());
+      EXPECT_EQ(input.text(), output.text());
+    }
+  });
+
+  arpc::ServerBuilder builder(std::make_shared<arpc::FileDescriptor>(fds[1]));
+  EchoService service;
+  builder.RegisterService(&service);
+  std::shared_ptr<arpc::Server> server = builder.Build();
+  for (std::size_t i = 0; i < std::size(sizes); ++i)
+    EXPECT_EQ(0, server->HandleRequest());
+  caller.join();
+}
+
+TEST(Server, MaxReceiveMessageSize) {
+  // Messages exceeding the configured maximum size should be rejected
+  // by the server with EMSGSIZE.
+  int fds[2];
+  EXPECT_EQ(0, socketpair(AF_UNIX, SOCK_STREAM, 0, fds));
+  std::shared_ptr<arpc::Channel> channel =
+      arpc::CreateChannel(std::make_shared<arpc::FileDescriptor>(fds[0]));
+  std::unique_ptr<server_test_proto::UnaryService::Stub> stub =
+      server_test_proto::UnaryService::NewStub(channel);
+  std::thread caller([&stub]() {
+    arpc::ClientContext context;
+    server_test_proto::UnaryInput input;
+    server_test_proto::UnaryOutput output;
+    input.set_text(std::string(1000, 'x'));
+    EXPECT_FALSE(stub->UnaryCall(&context, input, &output).ok());
+  });
+
+  {
+    arpc::ServerBuilder builder(
+        std::make_shared<arpc::FileDescriptor>(fds[1]));
+    EchoService service;
+    builder.RegisterService(&service);
+    builder.SetMaxReceiveMessageSize(100);
+    EXPECT_EQ(EMSGSIZE, builder.Build()->HandleRequest());
+  }
+  caller.join();
+}
+
 TEST(Server, UnaryFileDesciptorPassing) {
   // Use the EchoService to pass a file descriptor back to us.
   int fds[2];
@@ -149,18 +635,196 @@ TEST(Server, UnaryFileDesciptorPassing) {
 
     // Original message should still be contained in the pipe.
     char buf[6];
-    EXPECT_EQ(5, read(output.file_descriptor()->get(), buf, sizeof(buf)));
+    EXPECT_EQ(5, read(output.file_descriptor().get(), buf, sizeof(buf)));
+    EXPECT_EQ("Hello", std::string_view(buf, 5));
+  });
+
+  arpc::ServerBuilder builder(std::make_shared<arpc::FileDescriptor>(fds[1]));
+  EchoService service;
+  builder.RegisterService(&service);
+  std::shared_ptr<arpc::Server> server = builder.Build();
+  EXPECT_EQ(0, server->HandleRequest());
+  caller.join();
+}
+
+TEST(Server, UnarySpilled) {
+  // Messages exceeding the spill threshold are passed through a memfd.
+  // File descriptors contained in them should still be passed along.
+  int fds[2];
+  EXPECT_EQ(0, socketpair(AF_UNIX, SOCK_STREAM, 0, fds));
+  arpc::ChannelArguments arguments;
+  arguments.SetSpillThreshold(1);
+  std::shared_ptr<arpc::Channel> channel = arpc::CreateCustomChannel(
+      std::make_shared<arpc::FileDescriptor>(fds[0]), arguments);
+  std::unique_ptr<server_test_proto::UnaryService::Stub> stub =
+      server_test_proto::UnaryService::NewStub(channel);
+  std::thread caller([&stub]() {
+    arpc::ClientContext context;
+    server_test_proto::UnaryInput input;
+    server_test_proto::UnaryOutput output;
+
+    int pfds[2];
+    EXPECT_EQ(0, pipe(pfds));
+    EXPECT_EQ(5, write(pfds[1], "Hello", 5));
+    EXPECT_EQ(0, close(pfds[1]));
+    input.set_text(std::string(100000, 'x'));
+    input.set_file_descriptor(std::make_shared<arpc::FileDescriptor>(pfds[0]));
+    EXPECT_TRUE(stub->UnaryCall(&context, input, &output).ok());
+    EXPECT_EQ(input.text(), output.text());
+
+    char buf[6];
+    EXPECT_EQ(5, read(output.file_descriptor().get(), buf, sizeof(buf)));
     EXPECT_EQ("Hello", std::string_view(buf, 5));
   });
 
   arpc::ServerBuilder builder(std::make_shared<arpc::FileDescriptor>(fds[1]));
   EchoService service;
   builder.RegisterService(&service);
+  builder.SetSpillThreshold(1);
   std::shared_ptr<arpc::Server> server = builder.Build();
   EXPECT_EQ(0, server->HandleRequest());
   caller.join();
 }
 
+TEST(Server, UnarySharedMemory) {
+  // Messages should be passed through the shared memory transport once
+  // negotiated, including messages larger than the ring buffers. File
+  // descriptors are still passed over the socket.
+  int fds[2];
+  EXPECT_EQ(0, socketpair(AF_UNIX, SOCK_STREAM, 0, fds));
+  std::thread caller([fd = fds[0]]() {
+    arpc::ChannelArguments arguments;
+    arguments.SetSharedMemoryRingSize(4096);
+    std::unique_ptr<server_test_proto::UnaryService::Stub> stub =
+        server_test_proto::UnaryService::NewStub(arpc::CreateCustomChannel(
+            std::make_shared<arpc::FileDescriptor>(fd), arguments));
+    for (std::size_t size : {10, 100000, 10}) {
+      arpc::ClientContext context;
+      server_test_proto::UnaryInput input;
+      server_test_proto::UnaryOutput output;
+
+      int pfds[2];
+      EXPECT_EQ(0, pipe(pfds));
+      EXPECT_EQ(5, write(pfds[1], "Hello", 5));
+      EXPECT_EQ(0, close(pfds[1]));
+      input.set_text(std::string(size, 'x'));
+      input.set_file_descriptor(
+          std::make_shared<arpc::FileDescriptor>(pfds[0]));
+      EXPECT_TRUE(stub->UnaryCall(&context, input, &output).ok());
+      EXPECT_EQ(input.text(), output.text());
+
+      char buf[6];
+      EXPECT_EQ(5, read(output.file_descriptor().get(), buf, sizeof(buf)));
+      EXPECT_EQ("Hello", std::string_view(buf, 5));
+    }
+  });
+
+  // The first request is used to negotiate the transport. The server
+  // should observe end-of-file after the client goes away.
+  arpc::ServerBuilder builder(std::make_shared<arpc::FileDescriptor>(fds[1]));
+  EchoService service;
+  builder.RegisterService(&service);
+  builder.SetSharedMemoryRingSize(4096);
+  std::shared_ptr<arpc::Server> server = builder.Build();
+  for (int i = 0; i < 4; ++i)
+    EXPECT_EQ(0, server->HandleRequest());
+  caller.join();
+  EXPECT_EQ(-1, server->HandleRequest());
+}
+
+TEST(Server, MultipleConnections) {
+  // A single server should be able to serve requests from multiple
+  // clients concurrently, regardless of the transport they use.
+  arpc::ServerBuilder builder;
+  EchoService service;
+  builder.RegisterService(&service);
+  builder.SetSharedMemoryRingSize(4096);
+  std::shared_ptr<arpc::Server> server = builder.Build();
+
+  std::vector<std::thread> callers;
+  for (std::size_t ring_size : {0, 4096}) {
+    int fds[2];
+    EXPECT_EQ(0, socketpair(AF_UNIX, SOCK_STREAM, 0, fds));
+    EXPECT_EQ(0, server->AddConnection(
+                     std::make_shared<arpc::FileDescriptor>(fds[1])));
+    callers.emplace_back([fd = fds[0], ring_size]() {
+      arpc::ChannelArguments arguments;
+      arguments.SetSharedMemoryRingSize(ring_size);
+      std::unique_ptr<server_test_proto::UnaryService::Stub> stub =
+          server_test_proto::UnaryService::NewStub(arpc::CreateCustomChannel(
+              std::make_shared<arpc::FileDescriptor>(fd), arguments));
+      for (std::size_t size : {10, 100000, 10, 10, 10}) {
+        arpc::ClientContext context;
+        server_test_proto::UnaryInput input;
+        server_test_proto::UnaryOutput output;
+        input.set_text(std::string(size, 'x'));
+        EXPECT_TRUE(stub->UnaryCall(&context, input, &output).ok());
+        EXPECT_EQ(input.text(), output.text());
+      }
+    });
+  }
+
+  // A client that hangs up or sends garbage should not affect the
+  // other connections, as the server simply removes its connection.
+  for (std::string_view garbage : {"", "Hello"}) {
+    int fds[2];
+    EXPECT_EQ(0, socketpair(AF_UNIX, SOCK_STREAM, 0, fds));
+    EXPECT_EQ(0, server->AddConnection(
+                     std::make_shared<arpc::FileDescriptor>(fds[1])));
+    EXPECT_EQ(ssize_t(garbage.size()),
+              write(fds[0], garbage.data(), garbage.size()));
+    close(fds[0]);
+  }
+
+  // Keep handling requests until all clients have closed their
+  // connections.
+  while (server->GetConnectionCount() > 0)
+    EXPECT_EQ(0, server->HandleRequest());
+  for (std::thread& caller : callers)
+    caller.join();
+}
+
+TEST(Server, MultipleConnectionsIoUring) {
+  // Requests should also be served properly when using io_uring. Use a
+  // small queue, so that submissions need to be flushed while queueing.
+  // Large messages are spilled, meaning their responses are sent
+  // synchronously, as they carry a file descriptor.
+  arpc::ServerBuilder builder;
+  EchoService service;
+  builder.RegisterService(&service);
+  builder.SetSharedMemoryRingSize(4096);
+  builder.SetIoUringEntries(4);
+  std::shared_ptr<arpc::Server> server = builder.Build();
+
+  std::vector<std::thread> callers;
+  for (std::size_t ring_size : {0, 0, 0, 0, 0, 0, 0, 4096}) {
+    int fds[2];
+    EXPECT_EQ(0, socketpair(AF_UNIX, SOCK_STREAM, 0, fds));
+    EXPECT_EQ(0, server->AddConnection(
+                     std::make_shared<arpc::FileDescriptor>(fds[1])));
+    callers.emplace_back([fd = fds[0], ring_size]() {
+      arpc::ChannelArguments arguments;
+      arguments.SetSharedMemoryRingSize(ring_size);
+      std::unique_ptr<server_test_proto::UnaryService::Stub> stub =
+          server_test_proto::UnaryService::NewStub(arpc::CreateCustomChannel(
+              std::make_shared<arpc::FileDescriptor>(fd), arguments));
+      for (std::size_t size : {10, 100000, 2000000, 10, 10}) {
+        arpc::ClientContext context;
+        server_test_proto::UnaryInput input;
+        server_test_proto::UnaryOutput output;
+        input.set_text(std::string(size, 'x'));
+        EXPECT_TRUE(stub->UnaryCall(&context, input, &output).ok());
+        EXPECT_EQ(input.text(), output.text());
+      }
+    });
+  }
+
+  while (server->GetConnectionCount() > 0)
+    EXPECT_EQ(0, server->HandleRequest());
+  for (std::thread& caller : callers)
+    caller.join();
+}
+
 namespace {
 
 // Service that adds a stream of numbers.
@@ -179,6 +843,26 @@ class AdderService final
   }
 };
 
+// Service that adds a stream of numbers, reporting when it has started
+// processing the stream.
+class StartedAdderService final
+    : public server_test_proto::ClientStreamAdderService::Service {
+ public:
+  arpc::Status Add(arpc::ServerContext* context,
+                   arpc::ServerReader<server_test_proto::AdderInput>* reader,
+                   server_test_proto::AdderOutput* response) override {
+    started.set_value();
+    server_test_proto::AdderInput input;
+    std::int32_t sum = 0;
+    while (reader->Read(&input))
+      sum += input.value();
+    response->set_sum(sum);
+    return arpc::Status::OK;
+  }
+
+  std::promise<void> started;
+};
+
 }  // namespace
 
 TEST(Server, ClientStreamAdder) {
@@ -220,6 +904,110 @@ TEST(Server, ClientStreamAdder) {
   caller.join();
 }
 
+TEST(Server, ClientStreamAdderCorked) {
+  // Corked messages should be sent in batches, both when reaching the
+  // configured number of messages and when finishing the stream.
+  int fds[2];
+  EXPECT_EQ(0, socketpair(AF_UNIX, SOCK_STREAM, 0, fds));
+  arpc::ChannelArguments arguments;
+  arguments.SetMaxCorkedMessages(16);
+  arguments.SetMaxCorkedDelay(std::chrono::hours(1));
+  std::shared_ptr<arpc::Channel> channel = arpc::CreateCustomChannel(
+      std::make_shared<arpc::FileDescriptor>(fds[0]), arguments);
+  std::unique_ptr<server_test_proto::ClientStreamAdderService::Stub> stub =
+      server_test_proto::ClientStreamAdderService::NewStub(channel);
+  std::thread caller([&stub]() {
+    arpc::ClientContext context;
+    server_test_proto::AdderInput input;
+    server_test_proto::AdderOutput output;
+
+    std::unique_ptr<arpc::ClientWriter<server_test_proto::AdderInput>> writer(
+        stub->Add(&context, &output));
+    for (int i = 1; i <= 100; ++i) {
+      input.set_value(i);
+      EXPECT_TRUE(writer->Write(input, arpc::WriteOptions().set_corked()));
+    }
+    EXPECT_TRUE(writer->Flush());
+    input.set_value(1000);
+    EXPECT_TRUE(writer->Write(input, arpc::WriteOptions().set_corked()));
+    EXPECT_TRUE(writer->WritesDone());
+    EXPECT_TRUE(writer->Finish().ok());
+    EXPECT_EQ(6050, output.sum());
+  });
+
+  arpc::ServerBuilder builder(std::make_shared<arpc::FileDescriptor>(fds[1]));
+  AdderService service;
+  builder.RegisterService(&service);
+  std::shared_ptr<arpc::Server> server = builder.Build();
+  EXPECT_EQ(0, server->HandleRequest());
+  caller.join();
+}
+
+TEST(Server, ClientStreamAdderMultipleConnections) {
+  // Servers handling multiple connections process streaming calls
+  // synchronously. Requests on other connections should only be
+  // handled once the stream has finished.
+  arpc::ServerBuilder builder;
+  StartedAdderService adder_service;
+  EchoService echo_service;
+  builder.RegisterService(&adder_service);
+  builder.RegisterService(&echo_service);
+  std::shared_ptr<arpc::Server> server = builder.Build();
+
+  int adder_fds[2], echo_fds[2];
+  EXPECT_EQ(0, socketpair(AF_UNIX, SOCK_STREAM, 0, adder_fds));
+  EXPECT_EQ(0, socketpair(AF_UNIX, SOCK_STREAM, 0, echo_fds));
+  EXPECT_EQ(0, server->AddConnection(
+                   std::make_shared<arpc::FileDescriptor>(adder_fds[1])));
+  EXPECT_EQ(0, server->AddConnection(
+                   std::make_shared<arpc::FileDescriptor>(echo_fds[1])));
+  std::future<void> started = adder_service.started.get_future();
+  std::thread caller([&adder_fds, &echo_fds, &started]() {
+    std::unique_ptr<server_test_proto::ClientStreamAdderService::Stub> stub =
+        server_test_proto::ClientStreamAdderService::NewStub(
+            arpc::CreateChannel(
+                std::make_shared<arpc::FileDescriptor>(adder_fds[0])));
+    arpc::ClientContext context;
+    server_test_proto::AdderInput input;
+    server_test_proto::AdderOutput output;
+    std::unique_ptr<arpc::ClientWriter<server_test_proto::AdderInput>> writer(
+        stub->Add(&context, &output));
+    input.set_value(3);
+    EXPECT_TRUE(writer->Write(input));
+    started.wait();
+
+    // Perform a unary call on the other connection while the stream is
+    // still being processed. It may not complete before the stream.
+    std::atomic<bool> echoed(false);
+    std::thread echo_caller([&echo_fds, &echoed]() {
+      std::unique_ptr<server_test_proto::UnaryService::Stub> stub =
+          server_test_proto::UnaryService::NewStub(arpc::CreateChannel(
+              std::make_shared<arpc::FileDescriptor>(echo_fds[0])));
+      arpc::ClientContext context;
+      server_test_proto::UnaryInput input;
+      server_test_proto::UnaryOutput output;
+      input.set_text("Hello");
+      EXPECT_TRUE(stub->UnaryCall(&context, input, &output).ok());
+      EXPECT_EQ("Hello", output.text());
+      echoed = true;
+    });
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    EXPECT_FALSE(echoed);
+
+    input.set_value(4);
+    EXPECT_TRUE(writer->Write(input));
+    EXPECT_TRUE(writer->WritesDone());
+    EXPECT_TRUE(writer->Finish().ok());
+    EXPECT_EQ(7, output.sum());
+    echo_caller.join();
+    EXPECT_TRUE(echoed);
+  });
+
+  while (server->GetConnectionCount() > 0)
+    EXPECT_EQ(0, server->HandleRequest());
+  caller.join();
+}
+
 namespace {
 
 // Service that generates a stream of numbers.
@@ -311,3 +1099,580 @@ TEST(Server, ServerStreamFibonacci) {
     EXPECT_EQ(ARPC_CHANNEL_SHUTDOWN, channel->GetState(false));
   }
 }
+
+TEST(Server, InProcessUnaryEcho) {
+  // Calls on in-process channels should be dispatched to the service
+  // directly. File descriptors should be passed along as is.
+  arpc::ServerBuilder builder;
+  EchoService service;
+  builder.RegisterService(&service);
+  std::shared_ptr<arpc::Server> server = builder.Build();
+  std::shared_ptr<arpc::Channel> channel = server->InProcessChannel();
+  EXPECT_EQ(ARPC_CHANNEL_READY, channel->GetState(false));
+  std::unique_ptr<server_test_proto::UnaryService::Stub> stub =
+      server_test_proto::UnaryService::NewStub(channel);
+
+  arpc::ClientContext context;
+  server_test_proto::UnaryInput input;
+  server_test_proto::UnaryOutput output;
+  int pfds[2];
+  EXPECT_EQ(0, pipe(pfds));
+  EXPECT_EQ(0, close(pfds[1]));
+  input.set_text("Hello, world!");
+  input.set_file_descriptor(std::make_shared<arpc::FileDescriptor>(pfds[0]));
+  EXPECT_TRUE(stub->UnaryCall(&context, input, &output).ok());
+  EXPECT_EQ("Hello, world!", output.text());
+  EXPECT_EQ(input.file_descriptor(), output.file_descriptor());
+
+  // Services that are not registered on the server cannot be invoked.
+  std::unique_ptr<server_test_proto::ClientStreamAdderService::Stub>
+      adder_stub =
+          server_test_proto::ClientStreamAdderService::NewStub(channel);
+  server_test_proto::AdderOutput adder_output;
+  std::unique_ptr<arpc::ClientWriter<server_test_proto::AdderInput>> writer(
+      adder_stub->Add(&context, &adder_output));
+  EXPECT_FALSE(writer->WritesDone());
+  arpc::Status status = writer->Finish();
+  EXPECT_EQ(arpc::StatusCode::UNIMPLEMENTED, status.error_code());
+  EXPECT_EQ("Service not registered", status.error_message());
+}
+
+TEST(Server, InProcessClientStreamAdder) {
+  arpc::ServerBuilder builder;
+  AdderService service;
+  builder.RegisterService(&service);
+  std::shared_ptr<arpc::Server> server = builder.Build();
+  std::unique_ptr<server_test_proto::ClientStreamAdderService::Stub> stub =
+      server_test_proto::ClientStreamAdderService::NewStub(
+          server->InProcessChannel());
+
+  arpc::ClientContext context;
+  server_test_proto::AdderInput input;
+  server_test_proto::AdderOutput output;
+  std::unique_ptr<arpc::ClientWriter<server_test_proto::AdderInput>> writer(
+      stub->Add(&context, &output));
+  for (std::int32_t value = 1; value <= 100; ++value) {
+    input.set_value(value);
+    EXPECT_TRUE(writer->Write(input, arpc::WriteOptions().set_corked()));
+  }
+  EXPECT_TRUE(writer->Flush());
+  EXPECT_TRUE(writer->WritesDone());
+  EXPECT_TRUE(writer->Finish().ok());
+  EXPECT_EQ(5050, output.sum());
+}
+
+TEST(Server, InProcessServerStreamFibonacci) {
+  arpc::ServerBuilder builder;
+  FibonacciService service;
+  builder.RegisterService(&service);
+  std::shared_ptr<arpc::Server> server = builder.Build();
+  std::unique_ptr<server_test_proto::ServerStreamFibonacciService::Stub> stub =
+      server_test_proto::ServerStreamFibonacciService::NewStub(
+          server->InProcessChannel());
+
+  // The request may be destroyed while the server is still running.
+  arpc::ClientContext context;
+  server_test_proto::FibonacciOutput output;
+  std::unique_ptr<arpc::ClientReader<server_test_proto::FibonacciOutput>>
+      reader;
+  {
+    server_test_proto::FibonacciInput input;
+    input.set_a(2308);
+    input.set_b(4261);
+    input.set_terms(5);
+    reader = stub->GetSequence(&context, input);
+  }
+  for (std::uint64_t term : {2308, 4261, 6569, 10830, 17399}) {
+    EXPECT_TRUE(reader->Read(&output));
+    EXPECT_EQ(term, output.term());
+  }
+  EXPECT_FALSE(reader->Read(&output));
+  EXPECT_TRUE(reader->Finish().ok());
+}
+
+TEST(ArgdataReader, BatchedFrames) {
+  // Frames that are received from the socket at once should be returned
+  // one by one, with file descriptors attached to the right frame.
+  int fds[2];
+  EXPECT_EQ(0, socketpair(AF_UNIX, SOCK_STREAM, 0, fds));
+  int pfds[2];
+  EXPECT_EQ(0, pipe(pfds));
+  {
+    arpc::ArgdataWriter writer(4096, 16, std::chrono::hours(1), 0);
+    for (int i = 0; i < 3; ++i) {
+      std::unique_ptr<argdata_t> ad(argdata_create_int(i));
+      EXPECT_EQ(0, writer.Push(fds[0], ad.get(), true));
+    }
+    std::unique_ptr<argdata_t> ad(argdata_create_fd(pfds[1]));
+    EXPECT_EQ(0, writer.Push(fds[0], ad.get(), true));
+    EXPECT_EQ(0, close(fds[0]));
+  }
+  EXPECT_EQ(0, close(pfds[1]));
+
+  arpc::ArgdataReader reader(4096, 16, true);
+  for (int i = 0; i < 3; ++i) {
+    EXPECT_EQ(0, reader.Pull(fds[1]));
+    int value;
+    EXPECT_EQ(0, argdata_get_int(reader.Get(), &value));
+    EXPECT_EQ(i, value);
+  }
+  EXPECT_EQ(0, reader.Pull(fds[1]));
+  int fd;
+  EXPECT_EQ(0, argdata_get_fd(reader.Get(), &fd));
+  reader.ReleaseFd(fd);
+  EXPECT_EQ(5, write(fd, "Hello", 5));
+  EXPECT_EQ(0, close(fd));
+  EXPECT_EQ(0, reader.Pull(fds[1]));
+  EXPECT_EQ(nullptr, reader.Get());
+  EXPECT_EQ(0, close(fds[1]));
+
+  char buf[6] = {};
+  EXPECT_EQ(5, read(pfds[0], buf, sizeof(buf)));
+  EXPECT_STREQ("Hello", buf);
+  EXPECT_EQ(0, close(pfds[0]));
+}
+
+TEST(ArgdataReader, Packets) {
+  // In packet mode, corked frames should be split up across packets
+  // that don't exceed the maximum packet size.
+  int fds[2];
+  EXPECT_EQ(0, socketpair(AF_UNIX, SOCK_SEQPACKET, 0, fds));
+  EXPECT_TRUE(arpc::ArgdataReader::IsPacketSocket(fds[0]));
+  const std::string data(10000, 'x');
+  {
+    arpc::ArgdataWriter writer(1000000, 1000, std::chrono::hours(1), 0);
+    writer.SetPacketMode();
+    for (int i = 0; i < 20; ++i) {
+      std::unique_ptr<argdata_t> ad(
+          argdata_create_binary(data.data(), data.size()));
+      EXPECT_EQ(0, writer.Push(fds[0], ad.get(), true));
+    }
+    EXPECT_EQ(0, writer.Flush(fds[0]));
+  }
+
+  // Packets containing a partial frame should be rejected.
+  const std::uint8_t truncated[] = {0, 0, 0, 100, 0, 0, 0, 0, 1, 2};
+  EXPECT_EQ(ssize_t(sizeof(truncated)),
+            send(fds[0], truncated, sizeof(truncated), 0));
+  EXPECT_EQ(0, close(fds[0]));
+
+  arpc::ArgdataReader reader(1000000, 16, true);
+  reader.SetPacketMode();
+  for (int i = 0; i < 20; ++i) {
+    EXPECT_EQ(0, reader.Pull(fds[1]));
+    const void* buf;
+    std::size_t len;
+    EXPECT_EQ(0, argdata_get_binary(reader.Get(), &buf, &len));
+    EXPECT_EQ(data, std::string(static_cast<const char*>(buf), len));
+  }
+  EXPECT_EQ(EBADMSG, reader.Pull(fds[1]));
+  EXPECT_EQ(0, close(fds[1]));
+}
+
+TEST(ArgdataReader, ContinuationFrames) {
+  // Frames carrying more file descriptors than can be attached to a
+  // single write should be split up and reassembled.
+  int pipefds[2];
+  EXPECT_EQ(0, pipe(pipefds));
+  struct stat pipe_sb;
+  EXPECT_EQ(0, fstat(pipefds[0], &pipe_sb));
+  std::vector<std::unique_ptr<argdata_t>> storage;
+  std::vector<const argdata_t*> elements;
+  for (int i = 0; i < 1000; ++i) {
+    storage.emplace_back(argdata_create_fd(dup(pipefds[0])));
+    elements.push_back(storage.back().get());
+  }
+  std::unique_ptr<argdata_t> many(
+      argdata_create_seq(elements.data(), elements.size()));
+  std::unique_ptr<argdata_t> one(argdata_create_fd(pipefds[1]));
+
+  for (int type : {SOCK_STREAM, SOCK_SEQPACKET}) {
+    int fds[2];
+    EXPECT_EQ(0, socketpair(AF_UNIX, type, 0, fds));
+    arpc::ArgdataWriter writer(65536, 128, std::chrono::hours(1), 0);
+    arpc::ArgdataReader reader(1000000, 1000, true);
+    if (type == SOCK_SEQPACKET) {
+      writer.SetPacketMode();
+      reader.SetPacketMode();
+    }
+    EXPECT_EQ(0, writer.Push(fds[0], many.get()));
+    EXPECT_EQ(0, writer.Push(fds[0], one.get()));
+    EXPECT_EQ(0, writer.Push(fds[0], many.get()));
+    EXPECT_EQ(0, close(fds[0]));
+
+    for (int i = 0; i < 3; ++i) {
+      EXPECT_EQ(0, reader.Pull(fds[1]));
+      std::vector<int> received;
+      if (i == 1) {
+        int fd;
+        EXPECT_EQ(0, argdata_get_fd(reader.Get(), &fd));
+        received.push_back(fd);
+      } else {
+        argdata_seq_iterator_t it;
+        argdata_seq_iterate(reader.Get(), &it);
+        const argdata_t* element;
+        while (argdata_seq_get(&it, &element)) {
+          int fd;
+          EXPECT_EQ(0, argdata_get_fd(element, &fd));
+          received.push_back(fd);
+          argdata_seq_next(&it);
+        }
+        EXPECT_EQ(1000, received.size());
+      }
+
+      // All file descriptors should refer to the same pipe, in the
+      // right direction.
+      for (int fd : received) {
+        struct stat sb;
+        EXPECT_EQ(0, fstat(fd, &sb));
+        EXPECT_EQ(pipe_sb.st_ino, sb.st_ino);
+        EXPECT_EQ(i == 1 ? O_WRONLY : O_RDONLY,
+                  fcntl(fd, F_GETFL) & O_ACCMODE);
+      }
+    }
+    EXPECT_EQ(0, reader.Pull(fds[1]));
+    EXPECT_EQ(nullptr, reader.Get());
+    EXPECT_EQ(0, close(fds[1]));
+  }
+
+  // The limit on the number of file descriptors should also apply to
+  // the ones attached to continuation frames.
+  int fds[2];
+  EXPECT_EQ(0, socketpair(AF_UNIX, SOCK_STREAM, 0, fds));
+  arpc::ArgdataWriter writer(65536, 128, std::chrono::hours(1), 0);
+  EXPECT_EQ(0, writer.Push(fds[0], many.get()));
+  arpc::ArgdataReader reader(1000000, 500, true);
+  EXPECT_EQ(EMSGSIZE, reader.Pull(fds[1]));
+  EXPECT_EQ(0, close(fds[0]));
+  EXPECT_EQ(0, close(fds[1]));
+
+  for (const auto& element : storage) {
+    int fd;
+    EXPECT_EQ(0, argdata_get_fd(element.get(), &fd));
+    EXPECT_EQ(0, close(fd));
+  }
+  EXPECT_EQ(0, close(pipefds[0]));
+  EXPECT_EQ(0, close(pipefds[1]));
+}
+
+TEST(ArgdataReader, RemoteFrames) {
+  // Unary requests carrying enough file descriptors should be sent as
+  // remote frames, having the receiver duplicate the file descriptors
+  // from the sending process.
+  int pidfd = syscall(SYS_pidfd_open, getpid(), 0);
+  if (pidfd < 0)
+    return;
+  auto pidfd_object = std::make_shared<arpc::FileDescriptor>(pidfd);
+  int pipefds[2];
+  EXPECT_EQ(0, pipe(pipefds));
+  struct stat pipe_sb;
+  EXPECT_EQ(0, fstat(pipefds[0], &pipe_sb));
+  arpc::ArgdataBuilder builder;
+  const argdata_t* request = builder.BuildSeq(
+      {builder.BuildFd(std::make_shared<arpc::FileDescriptor>(pipefds[0])),
+       builder.BuildFd(std::make_shared<arpc::FileDescriptor>(pipefds[1]))});
+
+  // Readers should only accept the pidfd if it refers to the sender.
+  arpc::ArgdataReader reader(65536, 2, true);
+  EXPECT_EQ(EPERM, reader.SetPidfd(pidfd_object, pipefds[0]));
+  EXPECT_EQ(0, reader.SetPidfd(pidfd_object, pidfd));
+
+  for (bool accepted : {true, false}) {
+    int fds[2];
+    EXPECT_EQ(0, socketpair(AF_UNIX, SOCK_STREAM, 0, fds));
+    arpc::ArgdataWriter writer(65536, 128, std::chrono::hours(1), 0);
+    writer.SetPidfdThreshold(2);
+    EXPECT_EQ(0, writer.PushUnaryRequest(fds[0], request, builder));
+    if (accepted) {
+      EXPECT_EQ(0, reader.Pull(fds[1]));
+      argdata_seq_iterator_t it;
+      argdata_seq_iterate(reader.Get(), &it);
+      const argdata_t* element;
+      for (int i = 0; i < 2; ++i) {
+        EXPECT_TRUE(argdata_seq_get(&it, &element));
+        int fd;
+        EXPECT_EQ(0, argdata_get_fd(element, &fd));
+        EXPECT_NE(pipefds[i], fd);
+        struct stat sb;
+        EXPECT_EQ(0, fstat(fd, &sb));
+        EXPECT_EQ(pipe_sb.st_ino, sb.st_ino);
+        EXPECT_EQ(i == 0 ? O_RDONLY : O_WRONLY,
+                  fcntl(fd, F_GETFL) & O_ACCMODE);
+        argdata_seq_next(&it);
+      }
+    } else {
+      // Readers that have not accepted a pidfd should reject them.
+      arpc::ArgdataReader other_reader(65536, 2, true);
+      EXPECT_EQ(EBADMSG, other_reader.Pull(fds[1]));
+    }
+    EXPECT_EQ(0, close(fds[0]));
+    EXPECT_EQ(0, close(fds[1]));
+  }
+}
+
+TEST(Arena, Allocate) {
+  // Allocations should be aligned and not overlap, regardless of
+  // whether they fit in the current chunk.
+  arpc::Arena arena;
+  std::vector<std::pair<char*, std::size_t>> allocations;
+  for (std::size_t size : {1, 7, 24, 3, 5000, 16, 2000000, 1}) {
+    for (std::size_t alignment : {1, 8, 16}) {
+      char* ptr = static_cast<char*>(arena.Allocate(size, alignment));
+      EXPECT_EQ(0, reinterpret_cast<std::uintptr_t>(ptr) % alignment);
+      std::memset(ptr, 0, size);
+      allocations.emplace_back(ptr, size);
+    }
+  }
+  std::sort(allocations.begin(), allocations.end());
+  for (std::size_t i = 1; i < allocations.size(); ++i)
+    EXPECT_LE(allocations[i - 1].first + allocations[i - 1].second,
+              allocations[i].first);
+
+  // Copied strings should be null terminated.
+  std::string_view copy = arena.CopyString("Hello");
+  EXPECT_EQ("Hello", copy);
+  EXPECT_EQ('\0', copy.data()[copy.size()]);
+  EXPECT_EQ("", arena.CopyString(std::string_view()));
+}
+
+TEST(Arena, Reset) {
+  // Memory of a small message should be reused after a reset. Only the
+  // chunk allocated last should be retained, which is the one holding
+  // the larger allocation.
+  arpc::Arena arena;
+  arena.Allocate(100, 8);
+  void* large = arena.Allocate(5000, 8);
+  arena.Reset();
+  void* second = arena.Allocate(100, 8);
+  EXPECT_EQ(large, second);
+  arena.Reset();
+  EXPECT_EQ(second, arena.Allocate(100, 8));
+
+  // Memory of an exceptionally large message should be freed, after
+  // which the arena should remain usable.
+  arena.Allocate(arpc::Arena::kMaxRetainedChunkSize + 1, 1);
+  arena.Reset();
+  for (int i = 0; i < 3; ++i) {
+    char* ptr = static_cast<char*>(arena.Allocate(300, 1));
+    std::memset(ptr, 0, 300);
+  }
+}
+
+TEST(ArgdataBuilder, Reset) {
+  // Resetting a builder should release everything it holds on to, so
+  // that file descriptors are closed and references no longer tracked.
+  arpc::ArgdataBuilder builder;
+  auto fd = std::make_shared<arpc::FileDescriptor>(dup(0));
+  std::weak_ptr<arpc::FileDescriptor> weak_fd = fd;
+  const std::string large_string(10000, 'a');
+  builder.BuildMap({builder.BuildStr("fd"), builder.BuildStr("data")},
+                   {builder.BuildFd(fd), builder.BuildStr(large_string)});
+  fd.reset();
+  EXPECT_FALSE(weak_fd.expired());
+  EXPECT_TRUE(builder.HasReferences());
+  builder.Reset();
+  EXPECT_TRUE(weak_fd.expired());
+  EXPECT_FALSE(builder.HasReferences());
+
+  // Values built afterwards should not be affected.
+  const argdata_t* ad = builder.BuildSeq(
+      {builder.BuildStr("Hello"), builder.BuildInt(42)});
+  std::size_t data_length, fds_length;
+  argdata_serialized_length(ad, &data_length, &fds_length);
+  std::string serialized(data_length, '\0');
+  argdata_serialize(ad, serialized.data(), nullptr);
+  EXPECT_EQ(std::string("\x07\x87\x08Hello\x00\x82\x05\x2a", 12),
+            serialized);
+}
+
+TEST(ArgdataBuilder, Borrowed) {
+  // Borrowed strings and binary blobs should be referenced, as opposed
+  // to copied. Changes made to them should thus end up in the output.
+  std::string str = "Hello";
+  std::string binary = "World";
+  arpc::ArgdataBuilder builder;
+  const argdata_t* ad =
+      builder.BuildSeq({builder.BuildStr(str), builder.BuildBorrowedStr(str),
+                        builder.BuildBinary(binary),
+                        builder.BuildBorrowedBinary(binary)});
+  str[0] = 'J';
+  binary[0] = 'B';
+
+  std::size_t data_length, fds_length;
+  argdata_serialized_length(ad, &data_length, &fds_length);
+  std::string serialized(data_length, '\0');
+  argdata_serialize(ad, serialized.data(), nullptr);
+  EXPECT_EQ(std::string("\x07"
+                        "\x87\x08Hello\x00"
+                        "\x87\x08Jello\x00"
+                        "\x86\x01World"
+                        "\x86\x01"
+                        "Borld",
+                        31),
+            serialized);
+}
+
+TEST(ArgdataBuilder, Fields) {
+  // Messages should only contain the fields that are set. Messages
+  // without any fields set should share a single empty map.
+  arpc::ArgdataBuilder builder;
+  server_test_proto::UnaryInput input;
+  const argdata_t* empty = input.Build(&builder);
+  EXPECT_EQ(empty, server_test_proto::AdderInput().Build(&builder));
+  std::size_t data_length, fds_length;
+  argdata_serialized_length(empty, &data_length, &fds_length);
+  EXPECT_EQ(1, data_length);
+
+  input.set_text("Hello");
+  const argdata_t* ad = input.Build(&builder);
+  argdata_serialized_length(ad, &data_length, &fds_length);
+  std::string serialized(data_length, '\0');
+  argdata_serialize(ad, serialized.data(), nullptr);
+  EXPECT_EQ(std::string("\x06\x86\x08text\x00\x87\x08Hello\x00", 16),
+            serialized);
+}
+
+TEST(ArgdataBuilder, FieldNumbers) {
+  // Messages should be able to use field numbers as keys. Both field
+  // names and field numbers should be accepted when parsing.
+  server_test_proto::UnaryInput input;
+  input.set_text("Hello");
+  input.set_data("World");
+  for (bool field_numbers : {false, true}) {
+    arpc::ArgdataBuilder builder;
+    builder.SetFieldNumbers(field_numbers);
+    const argdata_t* ad = input.Build(&builder);
+    std::size_t data_length, fds_length;
+    argdata_serialized_length(ad, &data_length, &fds_length);
+    EXPECT_EQ(field_numbers ? 22 : 30, data_length);
+
+    arpc::ArgdataParser parser;
+    server_test_proto::UnaryInput parsed;
+    parsed.Parse(*ad, &parser);
+    EXPECT_EQ("Hello", parsed.text());
+    EXPECT_EQ("World", parsed.data());
+  }
+}
+
+TEST(ArgdataParser, RepeatedFileDescriptors) {
+  // Multiple references to the same file descriptor should yield handles
+  // of the same file descriptor, which is closed along with the last
+  // handle.
+  int pipefds[2];
+  EXPECT_EQ(0, pipe(pipefds));
+  EXPECT_EQ(0, close(pipefds[1]));
+  std::unique_ptr<argdata_t> fd(argdata_create_fd(pipefds[0]));
+  arpc::ArgdataBuilder builder;
+  const argdata_t* ad = builder.BuildMap(
+      {builder.BuildStr("fds")}, {builder.BuildSeq({fd.get(), fd.get()})});
+  {
+    server_test_proto::SerializedMessage parsed;
+    {
+      arpc::ArgdataParser parser;
+      parsed.Parse(*ad, &parser);
+      EXPECT_TRUE(parser.ok());
+    }
+    ASSERT_EQ(2, parsed.fds_size());
+    EXPECT_EQ(pipefds[0], parsed.fds(0).get());
+    EXPECT_EQ(pipefds[0], parsed.fds(1).get());
+    parsed.mutable_fds(0)->reset();
+    EXPECT_LE(0, fcntl(pipefds[0], F_GETFD));
+  }
+  EXPECT_EQ(-1, fcntl(pipefds[0], F_GETFD));
+}
+
+TEST(ArgdataBuilder, Gather) {
+  // Serializing a value while leaving out referenced data should yield
+  // the same result as serializing it entirely, once the referenced data
+  // is inserted.
+  const std::string large_string(10000, 'a');
+  const std::string large_binary(300, 'b');
+  const std::string larger_binary(5000, 'c');
+  arpc::ArgdataBuilder builder;
+  const argdata_t* small_string = builder.BuildStr("Hello");
+  const argdata_t* small_binary = builder.BuildBinary(large_binary);
+  EXPECT_FALSE(builder.HasReferences());
+  const argdata_t* ad = builder.BuildMap(
+      {builder.BuildInt(1), builder.BuildInt(2), builder.BuildInt(3)},
+      {small_string, builder.BuildStr(large_string),
+       builder.BuildSeq({small_binary, builder.BuildBinary(larger_binary),
+                         builder.BuildInt(-1000), &argdata_true})});
+  EXPECT_TRUE(builder.HasReferences());
+
+  std::vector<std::uint8_t> buffer;
+  std::vector<arpc::ArgdataBuilder::Reference> references;
+  builder.Gather(ad, &buffer, &references);
+  ASSERT_EQ(2, references.size());
+  EXPECT_EQ(large_string, references[0].data);
+  EXPECT_EQ(larger_binary, references[1].data);
+  std::string gathered(buffer.begin(), buffer.end());
+  gathered.insert(references[1].offset, references[1].data);
+  gathered.insert(references[0].offset, references[0].data);
+
+  std::size_t data_length, fds_length;
+  argdata_serialized_length(ad, &data_length, &fds_length);
+  std::string serialized(data_length, '\0');
+  argdata_serialize(ad, serialized.data(), nullptr);
+  EXPECT_EQ(serialized, gathered);
+}
+
+TEST(ArgdataSerializer, MatchesBuilder) {
+  // Serializing a message directly should yield the same result as
+  // building it and serializing the resulting argdata_t, including the
+  // numbering of file descriptors.
+  auto fd1 = std::make_shared<arpc::FileDescriptor>(
+      open("/dev/null", O_RDONLY | O_CLOEXEC));
+  auto fd2 = std::make_shared<arpc::FileDescriptor>(
+      open("/dev/null", O_RDONLY | O_CLOEXEC));
+  server_test_proto::SerializedMessage message;
+  message.set_signed_value(-129);
+  message.set_unsigned_value(std::uint64_t(1) << 63);
+  message.set_flag(true);
+  message.set_text(std::string(200, 'x'));
+  message.set_data("Hello");
+  message.add_fds(fd1);
+  message.add_fds(fd2);
+  message.add_fds(fd1);
+  for (std::uint64_t value : {std::uint64_t(0), std::uint64_t(127),
+                              std::uint64_t(128), ~std::uint64_t(0)})
+    message.add_values(value);
+  (*message.mutable_attributes())["key"] = "value";
+  (*message.mutable_attributes())["empty"] = "";
+  message.mutable_nested()->set_value(-1);
+  message.add_nested_list();
+  message.add_nested_list()->set_value(1000000);
+  message.set_mode(server_test_proto::Mode::WRITE);
+  message.set_table(std::make_shared<arpc::SharedBuffer>(fd2, 0));
+  server_test_proto::AdderInput details;
+  details.set_value(42);
+  message.set_details_message(&details);
+
+  for (bool field_numbers : {false, true}) {
+    arpc::ArgdataBuilder builder;
+    builder.SetFieldNumbers(field_numbers);
+    const argdata_t* ad = message.Build(&builder);
+    std::size_t data_length, fds_length;
+    argdata_serialized_length(ad, &data_length, &fds_length);
+    std::vector<std::uint8_t> built(data_length);
+    std::vector<int> built_fds(fds_length);
+    argdata_serialize(ad, built.data(), built_fds.data());
+
+    arpc::ArgdataSerializer serializer(field_numbers);
+    std::size_t size = message.ByteSize(&serializer);
+    EXPECT_TRUE(serializer.ok());
+    EXPECT_EQ(4, serializer.GetFileDescriptorCount());
+    ASSERT_EQ(data_length, size);
+    std::vector<std::uint8_t> serialized(size);
+    EXPECT_EQ(serialized.data() + size,
+              message.SerializeTo(serialized.data(), &serializer));
+    EXPECT_EQ(built, serialized);
+    EXPECT_EQ(built_fds, serializer.GetFileDescriptors());
+  }
+
+  // File descriptors contained in values of google.protobuf.Any fields
+  // can't be renumbered.
+  arpc::ArgdataSerializer serializer;
+  std::unique_ptr<argdata_t> fd_value(argdata_create_fd(fd1->get()));
+  serializer.GetArgdataSize(fd_value.get());
+  EXPECT_FALSE(serializer.ok());
+}
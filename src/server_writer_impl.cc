@@ -5,26 +5,43 @@
 #include <arpc++/arpc++.h>
 #include <argdata.hpp>
 
+#include "argdata_writer.h"
 #include "arpc_protocol.ad.h"
 
 using namespace arpc;
 
-bool ServerWriterImpl::Write(const Message& msg) {
+bool ServerWriterImpl::Write(const Message& msg, WriteOptions options) {
   if (finished_)
     return false;
 
+  if (stream_ != nullptr) {
+    if (!stream_->Write(msg))
+      finished_ = true;
+    return !finished_;
+  }
+
   arpc_protocol::ServerMessage server_message;
   arpc_protocol::StreamingResponseData* streaming_response_data =
       server_message.mutable_streaming_response_data();
-  ArgdataBuilder argdata_builder;
-  streaming_response_data->set_response(msg.Build(&argdata_builder));
+  streaming_response_data->set_response_message(&msg);
 
-  std::unique_ptr<argdata_writer_t> writer = argdata_writer_t::create();
-  writer->set(server_message.Build(&argdata_builder));
-  int error = writer->push(fd_->get());
+  int error = writer_->Push(fd_->get(), server_message, builder_,
+                            options.is_corked());
+  builder_->Reset();
   if (error != 0) {
     finished_ = true;
     return false;
   }
   return true;
 }
+
+bool ServerWriterImpl::Flush() {
+  if (finished_ || stream_ != nullptr)
+    return !finished_;
+
+  if (writer_->Flush(fd_->get()) != 0) {
+    finished_ = true;
+    return false;
+  }
+  return true;
+}
@@ -0,0 +1,94 @@
+// Copyright (c) 2017 Nuxi (https://nuxi.nl/) and contributors.
+//
+// SPDX-License-Identifier: BSD-2-Clause
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <string_view>
+#include <utility>
+
+#include <arpc++/arpc++.h>
+
+using namespace arpc;
+
+SharedBuffer::SharedBuffer(std::shared_ptr<FileDescriptor> memfd,
+                           std::size_t size)
+    : memfd_(std::move(memfd)), size_(size), mapping_(nullptr) {
+}
+
+SharedBuffer::~SharedBuffer() {
+  if (mapping_ != nullptr)
+    munmap(mapping_, size_);
+}
+
+int SharedBuffer::Create(std::string_view data,
+                         std::shared_ptr<SharedBuffer>* buffer) {
+#ifdef MFD_ALLOW_SEALING
+  int fd = memfd_create("arpc", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+  if (fd < 0)
+    return errno;
+  auto memfd = std::make_shared<FileDescriptor>(fd);
+
+  // Fill the memfd using write(), as it can only be sealed against
+  // writes if no writable mappings of it exist.
+  for (std::size_t written = 0; written < data.size();) {
+    ssize_t retval =
+        pwrite(fd, data.data() + written, data.size() - written, written);
+    if (retval < 0) {
+      if (errno == EINTR)
+        continue;
+      return errno;
+    }
+    written += retval;
+  }
+  if (fcntl(fd, F_ADD_SEALS,
+            F_SEAL_SEAL | F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE) != 0)
+    return errno;
+  *buffer = std::make_shared<SharedBuffer>(std::move(memfd), data.size());
+  return 0;
+#else
+  return ENOSYS;
+#endif
+}
+
+int SharedBuffer::FromFileDescriptor(
+    const std::shared_ptr<FileDescriptor>& memfd,
+    std::shared_ptr<SharedBuffer>* buffer) {
+#ifdef MFD_ALLOW_SEALING
+  // Only accept memfds that are sealed, as the sender could otherwise
+  // modify or truncate the data while it's being accessed.
+  int seals = fcntl(memfd->get(), F_GET_SEALS);
+  if (seals < 0 || (seals & (F_SEAL_SHRINK | F_SEAL_WRITE)) !=
+                       (F_SEAL_SHRINK | F_SEAL_WRITE))
+    return EBADMSG;
+  struct stat sb;
+  if (fstat(memfd->get(), &sb) != 0)
+    return errno;
+  *buffer = std::make_shared<SharedBuffer>(memfd, sb.st_size);
+  return 0;
+#else
+  return ENOSYS;
+#endif
+}
+
+std::string_view SharedBuffer::data() const {
+  std::call_once(map_once_, [this]() {
+    if (size_ > 0) {
+      void* mapping =
+          mmap(nullptr, size_, PROT_READ, MAP_SHARED, memfd_->get(), 0);
+      if (mapping != MAP_FAILED)
+        mapping_ = mapping;
+    }
+  });
+  if (mapping_ == nullptr)
+    return {};
+  return std::string_view(static_cast<const char*>(mapping_), size_);
+}
@@ -0,0 +1,294 @@
+// Copyright (c) 2017 Nuxi (https://nuxi.nl/) and contributors.
+//
+// SPDX-License-Identifier: BSD-2-Clause
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+
+#if __has_include(<sys/eventfd.h>)
+#include <sys/eventfd.h>
+#endif
+
+#include <arpc++/arpc++.h>
+
+#include "shared_memory_ring.h"
+
+using namespace arpc;
+
+// Positions and wakeup flags of a ring buffer. Positions increase
+// monotonically and are only reduced modulo the capacity when accessing
+// the data. Every field is only written by one side, except for the
+// flags, which are cleared by the side that set them.
+struct arpc::SharedMemoryRingHeader {
+  // Number of bytes ever written, modified by the writer.
+  alignas(64) std::atomic<std::uint64_t> head;
+  // Number of bytes ever read, modified by the reader.
+  alignas(64) std::atomic<std::uint64_t> tail;
+  // Set by the reader or writer when blocking on the ring, indicating
+  // that the peer must signal its eventfd after making progress.
+  alignas(64) std::atomic<std::uint32_t> reader_waiting;
+  std::atomic<std::uint32_t> writer_waiting;
+};
+
+static_assert(std::atomic<std::uint64_t>::is_always_lock_free,
+              "Ring buffer positions must be lock-free to be shared");
+
+namespace {
+
+// Largest ring buffer size that is accepted.
+constexpr std::size_t kMaxCapacity = 1 << 30;
+
+// Offset of the data of both ring buffers in the memfd.
+constexpr std::size_t kDataOffset =
+    (2 * sizeof(SharedMemoryRingHeader) + 4095) & ~std::size_t(4095);
+
+}  // namespace
+
+SharedMemoryRing::SharedMemoryRing(
+    const std::shared_ptr<void>& mapping, SharedMemoryRingHeader* header,
+    std::uint8_t* data, std::size_t capacity,
+    const std::shared_ptr<FileDescriptor>& event,
+    const std::shared_ptr<FileDescriptor>& peer_event)
+    : mapping_(mapping),
+      header_(header),
+      data_(data),
+      capacity_(capacity),
+      event_(event),
+      peer_event_(peer_event) {
+}
+
+int SharedMemoryRing::Create(std::size_t capacity,
+                             std::shared_ptr<FileDescriptor>* memfd) {
+#ifdef MFD_ALLOW_SEALING
+  if (capacity == 0 || capacity > kMaxCapacity)
+    return EINVAL;
+  int fd = memfd_create("arpc", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+  if (fd < 0)
+    return errno;
+  auto result = std::make_shared<FileDescriptor>(fd);
+  // The peer may not shrink the memfd, as that would cause accesses to
+  // the ring buffers to fault.
+  if (ftruncate(fd, kDataOffset + 2 * capacity) != 0 ||
+      fcntl(fd, F_ADD_SEALS, F_SEAL_SEAL | F_SEAL_SHRINK | F_SEAL_GROW) != 0)
+    return errno;
+  *memfd = std::move(result);
+  return 0;
+#else
+  return ENOSYS;
+#endif
+}
+
+int SharedMemoryRing::CreateEvent(std::shared_ptr<FileDescriptor>* event) {
+#ifdef EFD_CLOEXEC
+  int fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+  if (fd < 0)
+    return errno;
+  *event = std::make_shared<FileDescriptor>(fd);
+  return 0;
+#else
+  return ENOSYS;
+#endif
+}
+
+int SharedMemoryRing::Map(int memfd, std::size_t capacity, bool client,
+                          const std::shared_ptr<FileDescriptor>& event,
+                          const std::shared_ptr<FileDescriptor>& peer_event,
+                          std::unique_ptr<SharedMemoryRing>* input,
+                          std::unique_ptr<SharedMemoryRing>* output) {
+#ifdef MFD_ALLOW_SEALING
+  if (capacity == 0 || capacity > kMaxCapacity)
+    return EINVAL;
+  int seals = fcntl(memfd, F_GET_SEALS);
+  if (seals < 0)
+    return errno;
+  if ((seals & F_SEAL_SHRINK) == 0)
+    return EPERM;
+  std::size_t length = kDataOffset + 2 * capacity;
+  struct stat sb;
+  if (fstat(memfd, &sb) != 0)
+    return errno;
+  if (std::size_t(sb.st_size) < length)
+    return EINVAL;
+
+  void* base = mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_SHARED,
+                    memfd, 0);
+  if (base == MAP_FAILED)
+    return errno;
+  std::shared_ptr<void> mapping(
+      base, [length](void* base) { munmap(base, length); });
+
+  // The first ring buffer is used to send messages from the client to
+  // the server. The second one is used for the opposite direction.
+  auto headers = static_cast<SharedMemoryRingHeader*>(base);
+  auto data = static_cast<std::uint8_t*>(base) + kDataOffset;
+  SharedMemoryRingHeader* input_header = &headers[client ? 1 : 0];
+  SharedMemoryRingHeader* output_header = &headers[client ? 0 : 1];
+  std::uint8_t* input_data = data + (client ? capacity : 0);
+  std::uint8_t* output_data = data + (client ? 0 : capacity);
+  *input = std::make_unique<SharedMemoryRing>(
+      mapping, input_header, input_data, capacity, event, peer_event);
+  *output = std::make_unique<SharedMemoryRing>(
+      mapping, output_header, output_data, capacity, event, peer_event);
+  return 0;
+#else
+  return ENOSYS;
+#endif
+}
+
+int SharedMemoryRing::Read(int fd, void* buf, std::size_t len,
+                           std::size_t* received, bool block) {
+  for (;;) {
+    std::uint64_t tail = header_->tail.load(std::memory_order_relaxed);
+    std::uint64_t head = header_->head.load(std::memory_order_acquire);
+    if (head - tail > capacity_)
+      return EBADMSG;
+    if (head != tail) {
+      // Copy data out of the ring buffer, which may wrap around.
+      std::size_t length = std::min(len, std::size_t(head - tail));
+      std::size_t offset = tail % capacity_;
+      std::size_t first = std::min(length, capacity_ - offset);
+      std::memcpy(buf, data_ + offset, first);
+      std::memcpy(static_cast<std::uint8_t*>(buf) + first, data_,
+                  length - first);
+      header_->tail.store(tail + length, std::memory_order_seq_cst);
+      if (header_->writer_waiting.load(std::memory_order_seq_cst) != 0)
+        Signal();
+      *received = length;
+      return 0;
+    }
+
+    // Ring buffer is empty. When not blocking, only check whether the
+    // peer has gone away.
+    if (!block) {
+      if (!HasHungUp(fd))
+        return EAGAIN;
+      if (header_->head.load(std::memory_order_acquire) != tail)
+        continue;
+      *received = 0;
+      return 0;
+    }
+
+    // Announce that we're going to wait, and check once more to prevent
+    // missing a wakeup.
+    header_->reader_waiting.store(1, std::memory_order_seq_cst);
+    if (header_->head.load(std::memory_order_seq_cst) == tail) {
+      int error = Wait(fd);
+      if (error == EPIPE) {
+        // Peer is gone. Return end-of-file after draining the data
+        // written before it went away.
+        header_->reader_waiting.store(0, std::memory_order_relaxed);
+        if (header_->head.load(std::memory_order_acquire) != tail)
+          continue;
+        *received = 0;
+        return 0;
+      } else if (error != 0) {
+        header_->reader_waiting.store(0, std::memory_order_relaxed);
+        return error;
+      }
+    }
+    header_->reader_waiting.store(0, std::memory_order_relaxed);
+  }
+}
+
+int SharedMemoryRing::Write(int fd, const void* buf, std::size_t len) {
+  const std::uint8_t* data = static_cast<const std::uint8_t*>(buf);
+  while (len > 0) {
+    std::uint64_t head = header_->head.load(std::memory_order_relaxed);
+    std::uint64_t tail = header_->tail.load(std::memory_order_acquire);
+    if (head - tail > capacity_)
+      return EBADMSG;
+    if (head - tail < capacity_) {
+      // Copy data into the ring buffer, which may wrap around.
+      std::size_t length =
+          std::min(len, std::size_t(capacity_ - (head - tail)));
+      std::size_t offset = head % capacity_;
+      std::size_t first = std::min(length, capacity_ - offset);
+      std::memcpy(data_ + offset, data, first);
+      std::memcpy(data_, data + first, length - first);
+      header_->head.store(head + length, std::memory_order_seq_cst);
+      if (header_->reader_waiting.load(std::memory_order_seq_cst) != 0)
+        Signal();
+      data += length;
+      len -= length;
+      continue;
+    }
+
+    // Ring buffer is full. Wait for the peer to consume data.
+    header_->writer_waiting.store(1, std::memory_order_seq_cst);
+    if (header_->tail.load(std::memory_order_seq_cst) == tail) {
+      if (int error = Wait(fd); error != 0) {
+        header_->writer_waiting.store(0, std::memory_order_relaxed);
+        return error;
+      }
+    }
+    header_->writer_waiting.store(0, std::memory_order_relaxed);
+  }
+  return 0;
+}
+
+bool SharedMemoryRing::IsReadable() const {
+  return header_->head.load(std::memory_order_acquire) !=
+         header_->tail.load(std::memory_order_relaxed);
+}
+
+bool SharedMemoryRing::PrepareWait() {
+  header_->reader_waiting.store(1, std::memory_order_seq_cst);
+  return header_->head.load(std::memory_order_seq_cst) !=
+         header_->tail.load(std::memory_order_relaxed);
+}
+
+void SharedMemoryRing::FinishWait() {
+  header_->reader_waiting.store(0, std::memory_order_relaxed);
+}
+
+void SharedMemoryRing::Signal() {
+  std::uint64_t value = 1;
+  while (write(peer_event_->get(), &value, sizeof(value)) < 0 &&
+         errno == EINTR) {
+  }
+}
+
+int SharedMemoryRing::Wait(int fd) {
+#ifdef POLLRDHUP
+  // Only the hangup of the socket is of interest, as it may also contain
+  // data that is sent along with file descriptors.
+  struct pollfd pfds[2] = {{.fd = event_->get(), .events = POLLIN},
+                           {.fd = fd, .events = POLLRDHUP}};
+  while (poll(pfds, 2, -1) < 0) {
+    if (errno != EINTR)
+      return errno;
+  }
+  if ((pfds[1].revents & (POLLERR | POLLHUP | POLLNVAL | POLLRDHUP)) != 0)
+    return EPIPE;
+  if ((pfds[0].revents & POLLIN) != 0) {
+    // The eventfd may be non-blocking and drained by another waiter.
+    std::uint64_t value;
+    if (read(event_->get(), &value, sizeof(value)) < 0 && errno != EINTR &&
+        errno != EAGAIN)
+      return errno;
+  }
+  return 0;
+#else
+  return ENOSYS;
+#endif
+}
+
+bool SharedMemoryRing::HasHungUp(int fd) {
+#ifdef POLLRDHUP
+  struct pollfd pfd = {.fd = fd, .events = POLLRDHUP};
+  return poll(&pfd, 1, 0) != 0;
+#else
+  return false;
+#endif
+}
@@ -0,0 +1,76 @@
+// Copyright (c) 2017 Nuxi (https://nuxi.nl/) and contributors.
+//
+// SPDX-License-Identifier: BSD-2-Clause
+
+#ifndef SRC_SHARED_MEMORY_RING_H
+#define SRC_SHARED_MEMORY_RING_H
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+
+#include <arpc++/arpc++.h>
+
+namespace arpc {
+
+struct SharedMemoryRingHeader;
+
+// One direction of the shared memory transport. Data is copied through
+// a ring buffer that is stored in memory shared between the client and
+// the server. Each side has an eventfd through which it is woken up by
+// its peer when it's blocked on reading from an empty ring or writing
+// to a full one. While blocked, the socket is monitored to detect that
+// the peer has gone away.
+class SharedMemoryRing {
+ public:
+  SharedMemoryRing(const std::shared_ptr<void>& mapping,
+                   SharedMemoryRingHeader* header, std::uint8_t* data,
+                   std::size_t capacity,
+                   const std::shared_ptr<FileDescriptor>& event,
+                   const std::shared_ptr<FileDescriptor>& peer_event);
+
+  // Creates a sealed memfd holding ring buffers for both directions.
+  static int Create(std::size_t capacity,
+                    std::shared_ptr<FileDescriptor>* memfd);
+  // Creates an eventfd through which the reader of a ring is woken up.
+  static int CreateEvent(std::shared_ptr<FileDescriptor>* event);
+  // Maps the ring buffers stored in a memfd created by Create().
+  static int Map(int memfd, std::size_t capacity,
+                 bool client, const std::shared_ptr<FileDescriptor>& event,
+                 const std::shared_ptr<FileDescriptor>& peer_event,
+                 std::unique_ptr<SharedMemoryRing>* input,
+                 std::unique_ptr<SharedMemoryRing>* output);
+
+  // Reads at least one byte, blocking if the ring is empty, unless
+  // EAGAIN should be returned instead. End-of-file is returned when the
+  // peer has closed the socket.
+  int Read(int fd, void* buf, std::size_t len, std::size_t* received,
+           bool block = true);
+  int Write(int fd, const void* buf, std::size_t len);
+
+  // Functions for waiting on the eventfd externally, e.g. using epoll.
+  // PrepareWait() announces that the reader is about to wait, returning
+  // whether data is available, in which case it should not wait.
+  bool IsReadable() const;
+  bool PrepareWait();
+  void FinishWait();
+
+ private:
+  void Signal();
+  int Wait(int fd);
+  bool HasHungUp(int fd);
+
+  const std::shared_ptr<void> mapping_;
+  SharedMemoryRingHeader* const header_;
+  std::uint8_t* const data_;
+  const std::size_t capacity_;
+  const std::shared_ptr<FileDescriptor> event_;
+  const std::shared_ptr<FileDescriptor> peer_event_;
+
+  SharedMemoryRing(SharedMemoryRing const&) = delete;
+  void operator=(SharedMemoryRing const&) = delete;
+};
+
+}  // namespace arpc
+
+#endif